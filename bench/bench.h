@@ -0,0 +1,37 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  *** BENCHMARK HELPERS ***
+**
+**  bench_now()           --> Current time (in seconds) from a monotonic clock.
+**
+**  bench_report(name, secs, items, bytes)
+**                        --> Prints a line with the elapsed time and the
+**                            throughput in items/sec and MB/sec.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <time.h>
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_report(char *name, double secs, double items, double bytes)
+{
+  if (secs <= 0) secs = 1e-9;
+  printf("%-28s %9.4f s %12.0f items/s %9.2f MB/s\n",
+          name, secs, items / secs, bytes / secs / (1024.0 * 1024.0));
+  fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,151 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Generates many small sequences (a few hundred events each) and reports
+**  the number of allocations and the latency of each sequence when:
+**    - a new sequence is created and closed each time;
+**    - the same sequence is reused with mf_seq_reset();
+**    - as above but with memory reserved upfront with mf_seq_reserve();
+**    - a new sequence is created each time using an arena allocator.
+**
+**  Usage: b_alloc [num_sequences [events_per_sequence]]
+**         (default: 100000 sequences, 200 events)
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+static long n_alloc = 0;
+
+static void *cnt_alloc(void *aux, void *ptr, size_t old_sz, size_t sz)
+{
+  if (sz == 0) { free(ptr); return NULL; }
+  n_alloc++;
+  return realloc(ptr, sz);
+}
+
+/* A bump allocator: blocks are never freed, the whole arena is cleared
+** when the sequence is closed. The last block can grow in place.
+*/
+typedef struct {
+  uint8_t *mem;
+  size_t   cnt;
+  size_t   max;
+  size_t   last;
+} arena;
+
+static void *arena_alloc(void *aux, void *ptr, size_t old_sz, size_t sz)
+{
+  arena   *a = aux;
+  uint8_t *p;
+
+  if (sz == 0) return NULL;
+  sz = (sz + 15) & ~(size_t)15;
+  if (ptr && (uint8_t *)ptr == a->mem + a->last && a->last + sz <= a->max) {
+    a->cnt = a->last + sz;
+    return ptr;
+  }
+  if (a->cnt + sz > a->max) return NULL;
+  p = a->mem + a->cnt;
+  if (ptr) memcpy(p, ptr, old_sz < sz ? old_sz : sz);
+  a->last = a->cnt;
+  a->cnt += sz;
+  return p;
+}
+
+static int cmp_dbl(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void fill(mf_seq *ms, long nevt)
+{
+  long k;
+
+  mf_seq_track_name(ms, 0, "Small");
+  mf_seq_set_bpm(ms, 0, 120);
+  for (k=0; k < nevt/2; k++) {
+    mf_seq_set_track(ms, k & 3);
+    mf_seq_note(ms, 48 + (k*7) % 36, 120 + (k % 5) * 60, 64 + k % 32);
+  }
+  mf_seq_bytick(ms);
+}
+
+#define MODE_NEW     0
+#define MODE_RESET   1
+#define MODE_RESERVE 2
+#define MODE_ARENA   3
+
+static void run(char *name, int mode, long nseq, long nevt, double *lat)
+{
+  mf_seq *ms = NULL;
+  arena   a;
+  long    k, n_new = 0;
+  double  t, t0;
+  char    line[64];
+
+  a.max = 64 * 1024 * 1024; a.cnt = a.last = 0;
+  a.mem = (mode == MODE_ARENA) ? malloc(a.max) : NULL;
+  if (mode == MODE_ARENA && !a.mem) return;
+
+  n_alloc = 0;
+  if (mode == MODE_RESET || mode == MODE_RESERVE) {
+    ms = mf_seq_new(NULL, 96); n_new++;
+    mf_seq_set_alloc(ms, cnt_alloc, NULL);
+    if (mode == MODE_RESERVE) mf_seq_reserve(ms, nevt + 16, 256);
+  }
+
+  t0 = bench_now();
+  for (k=0; k < nseq; k++) {
+    t = bench_now();
+    if (mode == MODE_NEW || mode == MODE_ARENA) {
+      ms = mf_seq_new(NULL, 96); n_new++;
+      if (mode == MODE_ARENA) mf_seq_set_alloc(ms, arena_alloc, &a);
+      else mf_seq_set_alloc(ms, cnt_alloc, NULL);
+    }
+    else mf_seq_reset(ms, NULL, 96);
+
+    fill(ms, nevt);
+
+    if (mode == MODE_NEW || mode == MODE_ARENA) mf_seq_close(ms);
+    if (mode == MODE_ARENA) a.cnt = a.last = 0;
+    lat[k] = bench_now() - t;
+  }
+  t0 = bench_now() - t0;
+  if (mode == MODE_RESET || mode == MODE_RESERVE) mf_seq_close(ms);
+  if (a.mem) free(a.mem);
+
+  qsort(lat, nseq, sizeof(double), cmp_dbl);
+  bench_report(name, t0, nseq * nevt, (double)nseq * nevt * sizeof(uint64_t));
+  sprintf(line, "  allocs/seq %.3f", (double)(n_alloc + n_new) / nseq);
+  printf("%-28s  p50 %7.2f us  p99 %7.2f us  max %8.2f us\n", line,
+          lat[nseq/2] * 1e6, lat[nseq - 1 - nseq/100] * 1e6, lat[nseq-1] * 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+  long    nseq = 100000;
+  long    nevt = 200;
+  double *lat;
+
+  if (argc > 1) nseq = atol(argv[1]);
+  if (argc > 2) nevt = atol(argv[2]);
+  if (nseq < 1) nseq = 1;
+  if (nevt < 2) nevt = 2;
+
+  lat = malloc(nseq * sizeof(double));
+  if (!lat) return 1;
+
+  printf("# mf_seq reuse: %ld sequences, %ld events each\n", nseq, nevt);
+  run("new/close",     MODE_NEW,     nseq, nevt, lat);
+  run("reset",         MODE_RESET,   nseq, nevt, lat);
+  run("reset+reserve", MODE_RESERVE, nseq, nevt, lat);
+  run("arena",         MODE_ARENA,   nseq, nevt, lat);
+
+  free(lat);
+  return 0;
+}
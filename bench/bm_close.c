@@ -0,0 +1,97 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Time taken by mf_seq_save() to encode a multi-track sequence with
+**  a different number of threads, and by mf_seq_render() to encode it
+**  in memory (all tracks and half of them).
+**
+**  Usage: b_close [num_events [tracks [max_threads]]]
+**         (default: 20M events, 32 tracks, up to 8 threads)
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+static mf_seq *build(long nevt, int ntrk)
+{
+  mf_seq *ms;
+  long k;
+  int  t;
+
+  ms = mf_seq_new("b_close.mid", 480);
+  if (!ms) return NULL;
+  for (t=0; t<ntrk; t++) {
+    mf_seq_set_track(ms, t);
+    for (k=0; k < nevt / ntrk / 2; k++) {
+      mf_seq_evt(ms, k * 120, mf_st_note_on, t & 0x0F, 36 + (k % 48), 90);
+      mf_seq_evt(ms, k * 120 + 100, mf_st_note_off, t & 0x0F, 36 + (k % 48), 0);
+    }
+  }
+  return ms;
+}
+
+int main(int argc, char *argv[])
+{
+  long     nevt = 20000000;
+  int      ntrk = 32;
+  int      maxthr = 8;
+  int      thr, k;
+  mf_seq  *ms;
+  double   t;
+  char     name[64];
+  FILE    *f;
+  long     fsize = 0;
+  uint8_t *buf;
+  uint32_t len;
+  uint8_t  half[128];
+
+  if (argc > 1) nevt = atol(argv[1]);
+  if (argc > 2) ntrk = atoi(argv[2]);
+  if (argc > 3) maxthr = atoi(argv[3]);
+
+  ms = build(nevt, ntrk);
+  if (!ms) return 1;
+  mf_seq_bytrack(ms);  /* not part of the encoding */
+
+  printf("# mf_seq_save: %d tracks, %ld events\n", ntrk, nevt);
+  for (thr = 1; thr <= maxthr; thr *= 2) {
+    mf_seq_set_threads(ms, thr);
+    t = bench_now();
+    mf_seq_save(ms);
+    t = bench_now() - t;
+    if ((f = fopen("b_close.mid", "rb"))) {
+      fseek(f, 0, SEEK_END); fsize = ftell(f); fclose(f);
+    }
+    sprintf(name, "save %d thread%s", thr, thr > 1 ? "s" : "");
+    bench_report(name, t, nevt, fsize);
+  }
+  remove("b_close.mid");
+
+  mf_seq_set_threads(ms, 1);
+  buf = NULL;
+  t = bench_now();
+  mf_seq_render(ms, NULL, 0, &buf, &len);
+  t = bench_now() - t;
+  bench_report("render", t, nevt, len);
+
+  /* Again in the same buffer */
+  t = bench_now();
+  mf_seq_render(ms, NULL, 0, &buf, &len);
+  t = bench_now() - t;
+  bench_report("render (reused buffer)", t, nevt, len);
+  free(buf);
+
+  for (k=0; k < ntrk/2; k++) half[k] = 2*k;
+  buf = NULL;
+  t = bench_now();
+  mf_seq_render(ms, half, ntrk/2, &buf, &len);
+  t = bench_now() - t;
+  bench_report("render even tracks", t, nevt/2, len);
+  free(buf);
+
+  mf_seq_close(ms);
+  return 0;
+}
@@ -0,0 +1,236 @@
+/*
+**  (C) by Remo Dentato (rdentato@gmail.com)
+**
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Generates a deterministic synthetic corpus and measures, for each
+**  file, the throughput of:
+**    write  - mf_writer producing the file (this is the generator);
+**    scan   - mf_scan() of the memory mapped file with empty callbacks;
+**    load   - mf_seq_load() of the file in a sequence;
+**    save   - mf_seq_save() of that sequence.
+**
+**  The corpus has three kinds of content (dense notes, controller
+**  streams and large sysex dumps), 1 to 256 tracks and sizes from 1KB up
+**  to max_size. Each file is generated from a fixed seed so the corpus is
+**  the same on every run and on every machine.
+**
+**  Results are printed and also written as JSON to json_file so that
+**  they can be compared across releases.
+**
+**  Usage: b_corpus [max_size [json_file]]
+**         (default: 64M, b_corpus.json; use 500M for the full corpus)
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+#define CORPUS_FILE  "b_corpus.mid"
+#define CORPUS_SAVE  "b_corpus_out.mid"
+
+#define KIND_NOTES    0
+#define KIND_CTRL     1
+#define KIND_SYSEX    2
+
+static char *kind_name[] = {"notes", "controllers", "sysex"};
+static long  sizes[]     = {1L<<10, 64L<<10, 4L<<20, 64L<<20, 500L<<20};
+static int   tracks[]    = {1, 16, 256};
+
+/* xorshift32: small, fast and the same everywhere */
+static uint32_t rnd_state;
+static uint32_t rnd(void)
+{
+  uint32_t x = rnd_state;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return (rnd_state = x);
+}
+
+static uint8_t sysex[4096];
+
+static void gen_evt(mf_writer *mw, int kind, int trk)
+{
+  uint32_t r = rnd();
+  uint8_t  chan = trk & 0x0F;
+  int16_t  len;
+
+  switch (kind) {
+    case KIND_NOTES:  /* chords of short notes */
+      mf_note_on(mw, r & 0x0F, chan, 36 + (r >> 8) % 60, 40 + (r >> 16) % 80);
+      mf_note_off(mw, 1 + (r >> 4 & 0x3F), chan, 36 + (r >> 8) % 60);
+      break;
+
+    case KIND_CTRL:   /* dense controllers and pitch bend */
+      if (r & 0x80000000) mf_pitch_bend(mw, r & 0x03, chan, (int16_t)((r >> 8) % 16384) - 8192);
+      else mf_control_change(mw, r & 0x03, chan, (r >> 8) % 120, (r >> 16) & 0x7F);
+      break;
+
+    case KIND_SYSEX:  /* sysex dumps with a few notes in between */
+      if ((r & 0x0F) == 0) {
+        len = 256 + (r >> 8) % (sizeof(sysex) - 256);
+        sysex[len-1] = 0xF7;
+        mf_sys_evt(mw, r >> 4 & 0xFF, mf_st_system_exclusive, 0, len, sysex);
+        sysex[len-1] = 0x00;
+      }
+      else mf_note_on(mw, r >> 4 & 0x3F, chan, 36 + (r >> 8) % 60, (r >> 16) & 0x7F);
+      break;
+  }
+}
+
+/* Returns the number of events written or -1 on error */
+static long generate(int kind, int ntrk, long size)
+{
+  mf_writer *mw;
+  long       per_trk = size / ntrk;
+  long       nevt = 0;
+  int        trk;
+
+  rnd_state = 0x9E3779B9u ^ (kind << 24) ^ (ntrk << 12) ^ (uint32_t)(size >> 10);
+  for (trk=0; trk < (int)sizeof(sysex); trk++) sysex[trk] = rnd() & 0x7F;
+
+  mw = mf_new(CORPUS_FILE, 480);
+  if (!mw) return -1;
+  mf_set_ntracks(mw, ntrk);
+  for (trk=0; trk<ntrk; trk++) {
+    mf_track_start(mw);
+    while ((long)(mw->buf_cnt - mw->trk_pos) < per_trk - 4) {
+      gen_evt(mw, kind, trk);
+      nevt += (kind == KIND_NOTES) ? 2 : 1;
+    }
+  }
+  if (mf_close(mw)) return -1;
+  return nevt;
+}
+
+static uint64_t n_evt;
+
+static int16_t nop_error(mf_reader *mr, int16_t err, char *msg) { return err; }
+static int16_t nop_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division) { return 0; }
+static int16_t nop_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen) { return 0; }
+static int16_t nop_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
+                                                         int16_t data1, int16_t data2)
+{ n_evt++; return 0; }
+static int16_t nop_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
+                                                         int32_t len,  uint8_t *data)
+{ n_evt++; return 0; }
+
+static long file_size(char *fname)
+{
+  FILE *f;
+  long  sz = 0;
+
+  if ((f = fopen(fname, "rb"))) {
+    fseek(f, 0, SEEK_END);
+    sz = ftell(f);
+    fclose(f);
+  }
+  return sz;
+}
+
+static FILE *json = NULL;
+static int   json_first = 1;
+
+static void report(char *op, int kind, int ntrk, long size, double secs, double nevt, double bytes)
+{
+  char name[64];
+
+  sprintf(name, "%-5s %-11s %3d trk %6ldK", op, kind_name[kind], ntrk, size >> 10);
+  bench_report(name, secs, nevt, bytes);
+
+  if (!json) return;
+  if (secs <= 0) secs = 1e-9;
+  fprintf(json, "%s\n    {\"op\": \"%s\", \"corpus\": \"%s\", \"tracks\": %d, \"size\": %ld, "
+                "\"bytes\": %.0f, \"events\": %.0f, \"secs\": %.6f, "
+                "\"events_per_sec\": %.0f, \"mb_per_sec\": %.3f}",
+                json_first ? "" : ",", op, kind_name[kind], ntrk, size,
+                bytes, nevt, secs, nevt / secs, bytes / secs / (1024.0 * 1024.0));
+  json_first = 0;
+}
+
+static void run(int kind, int ntrk, long size)
+{
+  mf_reader *mr;
+  mf_seq    *ms;
+  long       nevt, fsize;
+  double     t;
+
+  t = bench_now();
+  nevt = generate(kind, ntrk, size);
+  t = bench_now() - t;
+  if (nevt < 0) { fprintf(stderr, "Unable to write " CORPUS_FILE "\n"); return; }
+  fsize = file_size(CORPUS_FILE);
+  report("write", kind, ntrk, size, t, nevt, fsize);
+
+  if ((mr = mf_reader_map(CORPUS_FILE))) {
+    mr->on_error    = nop_error;
+    mr->on_header   = nop_header;
+    mr->on_track    = nop_track;
+    mr->on_midi_evt = nop_midi_evt;
+    mr->on_sys_evt  = nop_sys_evt;
+    n_evt = 0;
+    t = bench_now();
+    mf_scan(mr);
+    t = bench_now() - t;
+    mf_reader_close(mr);
+    report("scan", kind, ntrk, size, t, n_evt, fsize);
+  }
+
+  if ((ms = mf_seq_new(CORPUS_SAVE, 0))) {
+    t = bench_now();
+    mf_seq_load(ms, CORPUS_FILE);
+    t = bench_now() - t;
+    report("load", kind, ntrk, size, t, mf_evt_count(ms), fsize);
+
+    mf_seq_bytrack(ms);  /* not part of the encoding */
+    t = bench_now();
+    mf_seq_save(ms);
+    t = bench_now() - t;
+    report("save", kind, ntrk, size, t, mf_evt_count(ms), file_size(CORPUS_SAVE));
+    mf_seq_close(ms);
+  }
+  remove(CORPUS_SAVE);
+  remove(CORPUS_FILE);
+}
+
+static long parse_size(char *s)
+{
+  char *end;
+  long  n = strtol(s, &end, 10);
+
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; break;
+    case 'm': case 'M': n <<= 20; break;
+    case 'g': case 'G': n <<= 30; break;
+  }
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  long  max_size = 64L << 20;
+  char *json_file = "b_corpus.json";
+  int   kind, k, s;
+
+  if (argc > 1) max_size = parse_size(argv[1]);
+  if (argc > 2) json_file = argv[2];
+
+  json = fopen(json_file, "w");
+  if (json) fprintf(json, "{\n  \"bench\": \"umf corpus\",\n  \"max_size\": %ld,\n  \"results\": [", max_size);
+
+  printf("# corpus: up to %ldK per file, JSON in %s\n", max_size >> 10, json_file);
+  for (kind = KIND_NOTES; kind <= KIND_SYSEX; kind++) {
+    for (s=0; s < (int)(sizeof(sizes)/sizeof(sizes[0])) && sizes[s] <= max_size; s++) {
+      for (k=0; k < (int)(sizeof(tracks)/sizeof(tracks[0])); k++) {
+        /* Leave room for at least a few events (or a sysex) in each track */
+        if (sizes[s] / tracks[k] < (kind == KIND_SYSEX ? 8192 : 64)) continue;
+        run(kind, tracks[k], sizes[s]);
+      }
+    }
+  }
+
+  if (json) {
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+  }
+  return 0;
+}
@@ -0,0 +1,161 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Round trip of a file through a sequence: loading it with callbacks
+**  that call mf_seq_evt()/mf_seq_sys() versus mf_seq_load(), and saving
+**  it back with mf_seq_save().
+**  Then the time to get a sorted sequence at start up: from the file
+**  (mf_seq_load() and mf_seq_bytick()) versus from a snapshot.
+**
+**  Usage: b_load [events_per_track [tracks [threads]]]
+**         (default: 1M events, 8 tracks, 4 threads)
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+static int16_t cb_error(mf_reader *mr, int16_t err, char *msg) { return err; }
+static int16_t cb_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division) { return 0; }
+
+static int16_t cb_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen)
+{ return eot ? 0 : mf_seq_set_track(mr->aux, tracknum-1); }
+
+static int16_t cb_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
+                                                         int16_t data1, int16_t data2)
+{ return mf_seq_evt(mr->aux, tick, type, chan-1, data1, data2 < 0 ? 0 : data2); }
+
+static int16_t cb_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
+                                                         int32_t len,  uint8_t *data)
+{ return mf_seq_sys(mr->aux, tick, type, aux, len, data); }
+
+static long file_size(char *fname)
+{
+  FILE *f;
+  long  sz = 0;
+
+  if ((f = fopen(fname, "rb"))) {
+    fseek(f, 0, SEEK_END);
+    sz = ftell(f);
+    fclose(f);
+  }
+  return sz;
+}
+
+static void run(char *name, char *fname, long fsize, int16_t nthreads)
+{
+  mf_seq    *ms;
+  mf_reader *mr;
+  uint32_t   nevt;
+  double     t, t_load, t_save;
+  char       line[64];
+
+  ms = mf_seq_new("b_load_out.mid", 0);
+  if (!ms) return;
+  t = bench_now();
+  if (nthreads > 0) {
+    mf_seq_set_threads(ms, nthreads);
+    mf_seq_load(ms, fname);
+  }
+  else if ((mr = mf_reader_map(fname))) {
+    mr->aux         = ms;
+    mr->on_error    = cb_error;
+    mr->on_header   = cb_header;
+    mr->on_track    = cb_track;
+    mr->on_midi_evt = cb_midi_evt;
+    mr->on_sys_evt  = cb_sys_evt;
+    mf_scan(mr);
+    mf_reader_close(mr);
+  }
+  t_load = bench_now() - t;
+  nevt = mf_evt_count(ms);
+
+  t = bench_now();
+  mf_seq_save(ms);
+  t_save = bench_now() - t;
+  mf_seq_close(ms);
+
+  sprintf(line, "%s load", name);  bench_report(line, t_load, nevt, fsize);
+  sprintf(line, "%s save", name);  bench_report(line, t_save, nevt, fsize);
+  sprintf(line, "%s total", name); bench_report(line, t_load + t_save, nevt, fsize);
+  remove("b_load_out.mid");
+}
+
+static void run_snap(char *fname, long fsize)
+{
+  static char *name[] = {"snapshot read", "snapshot map", "snapshot map+verify"};
+  static uint16_t flags[] = {0, MF_SNAP_MAP, MF_SNAP_MAP | MF_SNAP_VERIFY};
+  mf_seq *ms;
+  double  t;
+  long    ssize;
+  int     k;
+
+  ms = mf_seq_new(NULL, 0);
+  if (!ms) return;
+  t = bench_now();
+  mf_seq_load(ms, fname);
+  mf_seq_bytick(ms);
+  t = bench_now() - t;
+  bench_report("mf_seq_load+bytick", t, mf_evt_count(ms), fsize);
+  mf_seq_snap_save(ms, "b_load.snp");
+  mf_seq_close(ms);
+  ssize = file_size("b_load.snp");
+
+  for (k=0; k<3; k++) {
+    t = bench_now();
+    ms = mf_seq_snap_load("b_load.snp", flags[k]);
+    t = bench_now() - t;
+    if (!ms) continue;
+    bench_report(name[k], t, mf_evt_count(ms), ssize);
+    mf_seq_close(ms);
+  }
+  remove("b_load.snp");
+}
+
+int main(int argc, char *argv[])
+{
+  char *fname = "b_load.mid";
+  uint8_t sysex[256];
+  long nevt = 1000000;
+  int ntrk = 8;
+  int nthr = 4;
+  mf_writer *mw;
+  long fsize;
+  long k;
+  int  t;
+
+  if (argc > 1) nevt = atol(argv[1]);
+  if (argc > 2) ntrk = atoi(argv[2]);
+  if (argc > 3) nthr = atoi(argv[3]);
+  if (ntrk > MF_MAX_TRACKS) ntrk = MF_MAX_TRACKS;
+
+  for (k=0; k < (long)sizeof(sysex); k++) sysex[k] = k & 0x7F;
+
+  mw = mf_new(fname, 480);
+  if (!mw) return 1;
+  for (t=0; t<ntrk; t++) {
+    mf_track_start(mw);
+    mf_track_name(mw, 0, "Benchmark");
+    for (k=0; k<nevt; k++) {
+      if ((k & 0xFF) == 0) mf_sys_evt(mw, 0, mf_st_system_exclusive, 0, sizeof(sysex), sysex);
+      else if (k & 1)      mf_note_off(mw, 60, t & 0x0F, 36 + (k % 48));
+      else                 mf_note_on(mw, 0, t & 0x0F, 36 + (k % 48), 90);
+    }
+  }
+  mf_close(mw);
+  fsize = file_size(fname);
+
+  printf("# round trip: %d tracks, %ld events/track, %ld bytes\n", ntrk, nevt, fsize);
+  run("callbacks", fname, fsize, 0);
+  run("mf_seq_load", fname, fsize, 1);
+  if (nthr > 1) {
+    sprintf((char *)sysex, "mf_seq_load %dthr", nthr);
+    run((char *)sysex, fname, fsize, nthr);
+  }
+  run_snap(fname, fsize);
+
+  remove(fname);
+  return 0;
+}
@@ -0,0 +1,77 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Plays a sequence to a dummy output and prints the jitter histogram:
+**  how late each event has been dispatched with respect to its time.
+**
+**  Usage: b_play [num_events [interval_us]]
+**         (default: 1000 events, one every 1000us)
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+static int16_t dummy_out(void *aux, mf_evt *e, uint64_t us)
+{
+  (*(uint32_t *)aux)++;
+  return 0;
+}
+
+/* Upper bound (in us) of the bin where the p-th percentile falls */
+static uint32_t percentile(const mf_jitter *jt, double p)
+{
+  uint32_t k, n = 0;
+
+  for (k=0; k < MF_JITTER_BINS; k++) {
+    n += jt->bin[k];
+    if (n >= jt->count * p) break;
+  }
+  return (k+1) * MF_JITTER_STEP;
+}
+
+int main(int argc, char *argv[])
+{
+  long       nevt = 1000;
+  long       intv = 1000;
+  mf_seq    *ms;
+  mf_player *mp;
+  uint32_t   n = 0;
+  long       k;
+  double     t;
+  const mf_jitter *jt;
+
+  if (argc > 1) nevt = atol(argv[1]);
+  if (argc > 2) intv = atol(argv[2]);
+
+  /* 1 tick = 1us */
+  ms = mf_seq_new("b_play.mid", 1000);
+  if (!ms) return 1;
+  mf_seq_set_tempo(ms, 0, 1000);
+  for (k=0; k<nevt; k++)
+    mf_seq_evt(ms, k * intv, mf_st_note_on, 0, 60, k & 1 ? 0 : 90);
+
+  mp = mf_play_new(ms, dummy_out, &n);
+  if (!mp) return 1;
+
+  t = bench_now();
+  mf_play_start(mp);
+  mf_play_wait(mp);
+  t = bench_now() - t;
+
+  jt = mf_play_jitter(mp);
+  printf("# mf_play: %ld events, one every %ldus\n", nevt, intv);
+  printf("dispatched %u  p50 <%uus  p99 <%uus  p99.9 <%uus  max %uus\n", n,
+           percentile(jt, 0.5), percentile(jt, 0.99), percentile(jt, 0.999), jt->max_us);
+  for (k=0; k < MF_JITTER_BINS-1; k++)
+    if (jt->bin[k]) printf("  %4ld-%4ldus %6u\n", k * MF_JITTER_STEP, (k+1) * MF_JITTER_STEP - 1, jt->bin[k]);
+  if (jt->bin[k]) printf("  %4ld+    us %6u\n", k * MF_JITTER_STEP, jt->bin[k]);
+  bench_report("mf_play", t, n, 0);
+
+  mf_play_close(mp);
+  mf_seq_close(ms);
+  remove("b_play.mid");
+  return 0;
+}
@@ -0,0 +1,146 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Compares mf_scan() reading through a FILE* with mf_scan() reading
+**  from a memory mapped file, mf_scan_mt() decoding tracks in parallel
+**  and mf_feed() pushing the file in chunks. Also with filters that
+**  skip sysex, notes or a whole track.
+**
+**  Usage: b_read [events_per_track [tracks]]
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+static uint32_t n_evt = 0;
+static uint32_t n_trk[256];
+
+#define count(mr) (n_trk[mr->track & 0xFF]++)
+
+static int16_t nop_error(mf_reader *mr, int16_t err, char *msg) { return err; }
+static int16_t nop_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division) { return 0; }
+static int16_t nop_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen) { return 0; }
+
+static int16_t nop_midi_evt(mf_reader *mr, uint32_t delta, int16_t type, int16_t chan,
+                                                          int16_t data1, int16_t data2)
+{ count(mr); return 0; }
+
+static int16_t nop_sys_evt(mf_reader *mr, uint32_t delta, int16_t type, int16_t aux,
+                                                          int32_t len,  uint8_t *data)
+{ count(mr); return 0; }
+
+static void run(char *name, mf_reader *mr, long fsize, int16_t nthreads)
+{
+  double t;
+  int k;
+
+  if (!mr) { fprintf(stderr, "Unable to open the file\n"); return; }
+  mr->on_error    = nop_error;
+  mr->on_header   = nop_header;
+  mr->on_track    = nop_track;
+  mr->on_midi_evt = nop_midi_evt;
+  mr->on_sys_evt  = nop_sys_evt;
+
+  n_evt = 0;
+  for (k=0; k<256; k++) n_trk[k] = 0;
+  t = bench_now();
+  if (nthreads > 1) mf_scan_mt(mr, nthreads);
+  else mf_scan(mr);
+  t = bench_now() - t;
+  for (k=0; k<256; k++) n_evt += n_trk[k];
+  mf_reader_close(mr);
+  bench_report(name, t, n_evt, fsize);
+}
+
+static mf_reader *skip(mf_reader *mr, uint16_t classes, int16_t track)
+{
+  mf_skip(mr, classes);
+  if (track > 0) mf_skip_track(mr, track, 1);
+  return mr;
+}
+
+static void run_push(char *name, char *fname, long fsize, size_t chunk)
+{
+  static uint8_t buf[65536];
+  mf_reader *mr;
+  FILE      *f;
+  size_t     n;
+  double     t;
+  int k;
+
+  mr = mf_reader_push();
+  f  = fopen(fname, "rb");
+  if (!mr || !f || chunk > sizeof(buf)) { fprintf(stderr, "Unable to open the file\n"); return; }
+  mr->on_error    = nop_error;
+  mr->on_header   = nop_header;
+  mr->on_track    = nop_track;
+  mr->on_midi_evt = nop_midi_evt;
+  mr->on_sys_evt  = nop_sys_evt;
+
+  n_evt = 0;
+  for (k=0; k<256; k++) n_trk[k] = 0;
+  t = bench_now();
+  while ((n = fread(buf, 1, chunk, f)) > 0)
+    if (mf_feed(mr, buf, n)) break;
+  mf_feed_end(mr);
+  t = bench_now() - t;
+  for (k=0; k<256; k++) n_evt += n_trk[k];
+  fclose(f);
+  mf_reader_close(mr);
+  bench_report(name, t, n_evt, fsize);
+}
+
+int main(int argc, char *argv[])
+{
+  char *fname = "b_read.mid";
+  uint8_t sysex[256];
+  long nevt = 1000000;
+  int ntrk = 8;
+  mf_writer *mw;
+  FILE *f;
+  long fsize;
+  long k;
+  int  t;
+
+  if (argc > 1) nevt = atol(argv[1]);
+  if (argc > 2) ntrk = atoi(argv[2]);
+
+  for (k=0; k < (long)sizeof(sysex); k++) sysex[k] = k & 0x7F;
+
+  mw = mf_new(fname, 480);
+  if (!mw) return 1;
+  for (t=0; t<ntrk; t++) {
+    mf_track_start(mw);
+    mf_track_name(mw, 0, "Benchmark");
+    for (k=0; k<nevt; k++) {
+      if ((k & 0xFF) == 0) mf_sys_evt(mw, 0, mf_st_system_exclusive, 0, sizeof(sysex), sysex);
+      else if (k & 1)      mf_note_off(mw, 60, t & 0x0F, 36 + (k % 48));
+      else                 mf_note_on(mw, 0, t & 0x0F, 36 + (k % 48), 90);
+    }
+  }
+  mf_close(mw);
+
+  f = fopen(fname, "rb");
+  if (!f) return 1;
+  fseek(f, 0, SEEK_END);
+  fsize = ftell(f);
+  fclose(f);
+
+  printf("# mf_scan: %ld tracks, %ld events/track, %ld bytes\n", (long)ntrk, nevt, fsize);
+  run("scan FILE*",  mf_reader_new(fname), fsize, 1);
+  run("FILE* skip sysex",  skip(mf_reader_new(fname), MF_SKIP_SYSEX, 0), fsize, 1);
+  run("FILE* skip notes",  skip(mf_reader_new(fname), MF_SKIP(0x80) | MF_SKIP(0x90), 0), fsize, 1);
+  run("scan mmap",   mf_reader_map(fname), fsize, 1);
+  run("scan mmap 2 threads", mf_reader_map(fname), fsize, 2);
+  run("scan mmap 4 threads", mf_reader_map(fname), fsize, 4);
+  run("mmap skip notes",   skip(mf_reader_map(fname), MF_SKIP(0x80) | MF_SKIP(0x90), 0), fsize, 1);
+  run("mmap skip track 1", skip(mf_reader_map(fname), 0, 1), fsize, 1);
+  run_push("push 64KB chunks", fname, fsize, 65536);
+  run_push("push 100B chunks", fname, fsize, 100);
+
+  remove(fname);
+  return 0;
+}
@@ -0,0 +1,171 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Compares mf_seq_bytrack() with the qsort() based sort over the old
+**  representation (9 bytes records in a buffer plus an array of offsets)
+**  and measures mf_seq_bytick() merging the sorted tracks and
+**  mf_notes_new() pairing the notes of the tracks.
+**
+**  Usage: b_sort [num_events ...]   (default: 1M 10M 50M)
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+/* The previous comparison function (uses a global!) */
+static char *old_ord = "71023456";
+#define old_cmp_st(x) (old_ord[((x)>>4) & 0x07])
+
+static uint8_t *old_base;
+static int old_cmp_bytrack(const void *a, const void *b)
+{
+  int      ret = 0;
+  uint8_t *pa = old_base + *((uint32_t *)a);
+  uint8_t *pb = old_base + *((uint32_t *)b);
+
+  if (!(ret = pa[0]-pb[0]))
+  if (!(ret = pa[1]-pb[1]))
+  if (!(ret = pa[2]-pb[2]))
+  if (!(ret = pa[3]-pb[3]))
+  if (!(ret = pa[4]-pb[4])) {
+    ret = old_cmp_st(pb[5]) - old_cmp_st(pa[5]);  
+  }
+  return ret;
+}
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+  rnd_state ^= rnd_state << 13; rnd_state ^= rnd_state >> 17; rnd_state ^= rnd_state << 5;
+  return rnd_state;
+}
+
+/* Decode the events in batches to check that ticks are not decreasing */
+static uint32_t check_bytick(mf_seq *ms)
+{
+  static uint32_t tick[1024];
+  static uint8_t  track[1024], status[1024], chan[1024], data1[1024], data2[1024];
+  mf_evt_soa b = {0, tick, track, status, chan, data1, data2};
+  uint32_t   first, k, bad = 0, prev = 0;
+
+  for (first = 0; mf_evt_batch(ms, first, 1024, &b) > 0; first += b.cnt) {
+    for (k=0; k<b.cnt; k++) {
+      bad += (tick[k] < prev);
+      prev = tick[k];
+    }
+  }
+  return bad;
+}
+
+static void run(uint32_t nevt)
+{
+  static uint8_t st[] = {mf_st_note_on, mf_st_note_off, mf_st_control_change, mf_st_pitch_bend};
+  mf_seq   *ms;
+  mf_notes *mn;
+  uint8_t  *buf = NULL, *p;
+  uint32_t *off = NULL;
+  uint32_t  k, bad = 0, tick, trk, s;
+  mf_evt    e;
+  double    t;
+  char      name[64];
+
+  ms  = mf_seq_new(NULL, 480);
+  buf = malloc((size_t)nevt * 9);
+  off = malloc((size_t)nevt * sizeof(uint32_t));
+  if (!ms || !buf || !off) goto done;
+  
+  rnd_state = 1;
+  t = bench_now();
+  for (k=0; k<nevt; k++) {
+    trk  = rnd() % 16;
+    tick = (k / 4) + (rnd() % 1000);
+    s    = st[rnd() & 3];
+    mf_seq_set_track(ms, trk);
+    mf_seq_evt(ms, tick, s, 0, k & 0x7F, 64);
+  }
+  t = bench_now() - t;
+  if (ms->evt_cnt != nevt) {
+    fprintf(stderr, "Unable to allocate %u events\n", nevt);
+    goto done;
+  }
+  sprintf(name, "mf_seq_evt %uM", nevt / 1000000);
+  bench_report(name, t, nevt, (double)ms->evt_max * sizeof(uint64_t));
+  printf("%-28s %12.2f bytes/event\n", "", (double)ms->evt_max * sizeof(uint64_t) / nevt);
+
+  /* Same events in the old representation */
+  rnd_state = 1;
+  for (k=0; k<nevt; k++) {
+    p = buf + k * 9;
+    off[k] = k * 9;
+    p[0] = rnd() % 16;
+    tick = (k / 4) + (rnd() % 1000);
+    p[1] = tick >> 24; p[2] = tick >> 16; p[3] = tick >> 8; p[4] = tick;
+    p[5] = st[rnd() & 3]; p[6] = 0; p[7] = k & 0x7F; p[8] = 64;
+  }
+
+  t = bench_now();
+  old_base = buf;
+  qsort(off, nevt, sizeof(uint32_t), old_cmp_bytrack);
+  t = bench_now() - t;
+  sprintf(name, "qsort %uM", nevt / 1000000);
+  bench_report(name, t, nevt, (double)nevt * 13);
+
+  t = bench_now();
+  mf_seq_bytrack(ms);
+  t = bench_now() - t;
+  sprintf(name, "mf_seq_bytrack %uM", nevt / 1000000);
+  bench_report(name, t, nevt, (double)nevt * sizeof(uint64_t));
+
+  for (k=0; k<nevt; k++) {
+    p = buf + off[k];
+    mf_evt_get(ms, k, &e);
+    bad += (e.track != p[0]) || (e.tick != ((uint32_t)p[1]<<24 | p[2]<<16 | p[3]<<8 | p[4]))
+                             || (e.status != p[5]);
+  }
+  if (bad) printf("# MISMATCH: %u events\n", bad);
+
+  t = bench_now();
+  mn = mf_notes_new(ms);
+  t = bench_now() - t;
+  sprintf(name, "mf_notes_new %uM", nevt / 1000000);
+  bench_report(name, t, nevt, (double)nevt * sizeof(uint64_t));
+  if (mn) {
+    printf("%-28s %12u notes\n", "", mn->note_cnt);
+    mf_notes_free(mn);
+  }
+
+  t = bench_now();
+  mf_seq_bytick(ms);
+  t = bench_now() - t;
+  sprintf(name, "mf_seq_bytick %uM", nevt / 1000000);
+  bench_report(name, t, nevt, (double)nevt * sizeof(uint64_t));
+
+  t = bench_now();
+  bad = check_bytick(ms);
+  t = bench_now() - t;
+  sprintf(name, "mf_evt_batch %uM", nevt / 1000000);
+  bench_report(name, t, nevt, (double)nevt * sizeof(uint64_t));
+  if (bad) printf("# NOT SORTED BY TICK: %u events\n", bad);
+
+ done:
+  if (buf) free(buf);
+  if (off) free(off);
+  if (ms) { ms->fname = NULL; free(ms->buf); free(ms->evt); free(ms->sys); free(ms); }
+}
+
+int main(int argc, char *argv[])
+{
+  int k;
+
+  printf("# mf_seq_bytrack vs qsort\n");
+  if (argc > 1) {
+    for (k=1; k<argc; k++) run(atol(argv[k]));
+  }
+  else {
+    run(1000000); run(10000000); run(50000000);
+  }
+  return 0;
+}
@@ -0,0 +1,59 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Converting ticks to microseconds one by one with mf_tempo_us() and
+**  with mf_tempo_us_bulk() over an ascending array of ticks.
+**
+**  Usage: b_tempo [num_ticks [tempo_changes]]
+**         (default: 10M ticks, 1000 tempo changes)
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+  long      nticks = 10000000;
+  long      nchg = 1000;
+  mf_tempo *mt;
+  uint32_t *ticks;
+  uint64_t *us;
+  uint64_t  chk = 0;
+  double    t;
+  long      k;
+
+  if (argc > 1) nticks = atol(argv[1]);
+  if (argc > 2) nchg = atol(argv[2]);
+
+  ticks = malloc(nticks * sizeof(uint32_t));
+  us    = malloc(nticks * sizeof(uint64_t));
+  mt    = mf_tempo_new(480);
+  if (!ticks || !us || !mt) return 1;
+
+  for (k=0; k<nchg; k++) mf_tempo_set(mt, (uint32_t)(k * (nticks / nchg)), 400000 + (k % 7) * 50000);
+  for (k=0; k<nticks; k++) ticks[k] = k;
+
+  printf("# mf_tempo: %ld ticks, %u segments\n", nticks, mt->seg_cnt);
+
+  t = bench_now();
+  for (k=0; k<nticks; k++) us[k] = mf_tempo_us(mt, ticks[k]);
+  t = bench_now() - t;
+  for (k=0; k<nticks; k++) chk += us[k];
+  bench_report("mf_tempo_us", t, nticks, nticks * sizeof(uint32_t));
+
+  t = bench_now();
+  mf_tempo_us_bulk(mt, ticks, us, nticks);
+  t = bench_now() - t;
+  for (k=0; k<nticks; k++) chk -= us[k];
+  bench_report("mf_tempo_us_bulk", t, nticks, nticks * sizeof(uint32_t));
+
+  if (chk != 0) printf("MISMATCH!\n");
+
+  mf_tempo_free(mt);
+  free(ticks);
+  free(us);
+  return 0;
+}
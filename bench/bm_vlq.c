@@ -0,0 +1,129 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Compares the byte by byte encoding and decoding of variable length
+**  quantities (as they were done by the reader and the writer) with
+**  mf_vlq_encode() and mf_vlq_decode().
+**
+**  Values are taken from two distributions: "deltas" (mostly one byte,
+**  as in real MIDI files) and "mixed" (lengths from 1 to 4 in equal
+**  parts).
+**
+**  Usage: b_vlq [num_values [rounds]]
+**         (default: 4M values, 10 rounds)
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+static uint32_t rnd_state = 0x2545F491;
+static uint32_t rnd(void)
+{
+  uint32_t x = rnd_state;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return (rnd_state = x);
+}
+
+/* The previous implementation of the writer */
+static uint32_t loop_encode(const uint32_t *src, uint32_t n, uint8_t *dst)
+{
+  uint8_t *p = dst;
+  uint32_t v, buf;
+
+  while (n-- > 0) {
+    v = *src++ & 0x0FFFFFFF;
+    buf = v & 0x7F;
+    while ((v >>= 7) != 0) buf = (buf << 8) | (v & 0x7F) | 0x80;
+    while (1) {
+      *p++ = buf & 0xFF;
+      if ((buf & 0x80) == 0) break;
+      buf >>= 8;
+    }
+  }
+  return p - dst;
+}
+
+/* The previous implementation of the reader */
+static int32_t loop_decode(const uint8_t *src, uint32_t len, uint32_t *dst, uint32_t n)
+{
+  const uint8_t *end = src + len;
+  uint32_t k = 0;
+  int32_t  v, c;
+
+  while (k < n && src < end) {
+    v = 0;
+    do {
+      if (src >= end) return -1;
+      c = *src++;
+      v = (v << 7) | (c & 0x7F);
+    } while (c & 0x80);
+    dst[k++] = v;
+  }
+  return k;
+}
+
+static void run(char *dist, uint32_t *vals, uint32_t n, int rounds, uint8_t *buf, uint32_t *out)
+{
+  static uint32_t lim[] = {0x80, 0x4000, 0x200000, 0x10000000};
+  uint32_t k, len = 0;
+  char     name[64];
+  double   t;
+  int      r;
+
+  for (k=0; k<n; k++) {
+    if (*dist == 'd') vals[k] = (rnd() & 0x0F) ? rnd() % lim[0] : rnd() % lim[1];
+    else vals[k] = rnd() % lim[rnd() & 3];
+  }
+
+  t = bench_now();
+  for (r=0; r<rounds; r++) len = loop_encode(vals, n, buf);
+  t = bench_now() - t;
+  sprintf(name, "encode loop  %s", dist);
+  bench_report(name, t, (double)n * rounds, (double)len * rounds);
+
+  t = bench_now();
+  for (r=0; r<rounds; r++) len = mf_vlq_encode(vals, n, buf);
+  t = bench_now() - t;
+  sprintf(name, "encode table %s", dist);
+  bench_report(name, t, (double)n * rounds, (double)len * rounds);
+
+  t = bench_now();
+  for (r=0; r<rounds; r++) loop_decode(buf, len, out, n);
+  t = bench_now() - t;
+  sprintf(name, "decode loop  %s", dist);
+  bench_report(name, t, (double)n * rounds, (double)len * rounds);
+
+  t = bench_now();
+  for (r=0; r<rounds; r++) mf_vlq_decode(buf, len, out, n);
+  t = bench_now() - t;
+  sprintf(name, "decode table %s", dist);
+  bench_report(name, t, (double)n * rounds, (double)len * rounds);
+
+  if (memcmp(vals, out, n * sizeof(uint32_t)) != 0) fprintf(stderr, "Decoding mismatch!\n");
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t  n = 4 << 20;
+  int       rounds = 10;
+  uint32_t *vals, *out;
+  uint8_t  *buf;
+
+  if (argc > 1) n = atol(argv[1]);
+  if (argc > 2) rounds = atoi(argv[2]);
+
+  vals = malloc(n * sizeof(uint32_t));
+  out  = malloc(n * sizeof(uint32_t));
+  buf  = malloc(n * 4);
+  if (!vals || !out || !buf) { fprintf(stderr, "Out of memory\n"); return 1; }
+
+  printf("# vlq: %u values, %d rounds\n", n, rounds);
+  run("deltas", vals, n, rounds, buf, out);
+  run("mixed",  vals, n, rounds, buf, out);
+
+  free(vals); free(out); free(buf);
+  return 0;
+}
@@ -0,0 +1,72 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Output size and write throughput of mf_writer with and without
+**  running status, on dense controller and pitch bend streams.
+**
+**  Usage: b_write [events_per_track [tracks]]
+*/
+
+#include "umf.h"
+#include "bench.h"
+
+static int16_t count_bytes(void *aux, uint8_t *data, uint32_t len)
+{
+  *(uint64_t *)aux += len;
+  return 0;
+}
+
+static void run(char *name, int16_t running, int16_t kind, long nevt, int ntrk)
+{
+  mf_writer *mw;
+  uint64_t   size = 0;
+  double     t;
+  char       label[64];
+  long       k;
+  int        trk;
+
+  t = bench_now();
+  mw = mf_new_sink(count_bytes, &size, 480);
+  if (!mw) return;
+  mf_set_running(mw, running);
+  mf_set_ntracks(mw, ntrk);
+  for (trk=0; trk<ntrk; trk++) {
+    mf_track_start(mw);
+    for (k=0; k<nevt; k++) {
+      switch (kind) {
+        case 0: mf_control_change(mw, 1, trk & 0x0F, mf_cc_modulation_wheel, k & 0x7F); break;
+        case 1: mf_pitch_bend(mw, 1, trk & 0x0F, (k % 16384) - 8192); break;
+        case 2: if (k & 1) mf_note_off(mw, 10, trk & 0x0F, 36 + (k % 48));
+                else       mf_note_on(mw, 0, trk & 0x0F, 36 + (k % 48), 90);
+                break;
+      }
+    }
+  }
+  mf_close(mw);
+  t = bench_now() - t;
+
+  sprintf(label, "%s%s", name, running ? " (running)" : "");
+  bench_report(label, t, (double)nevt * ntrk, size);
+  printf("%-28s %12llu bytes\n", "", (unsigned long long)size);
+}
+
+int main(int argc, char *argv[])
+{
+  long nevt = 1000000;
+  int  ntrk = 4;
+
+  if (argc > 1) nevt = atol(argv[1]);
+  if (argc > 2) ntrk = atoi(argv[2]);
+
+  printf("# mf_writer: %d tracks, %ld events/track\n", ntrk, nevt);
+  run("controllers", 0, 0, nevt, ntrk);
+  run("controllers", 1, 0, nevt, ntrk);
+  run("pitch bend",  0, 1, nevt, ntrk);
+  run("pitch bend",  1, 1, nevt, ntrk);
+  run("notes",       0, 2, nevt, ntrk);
+  run("notes",       1, 2, nevt, ntrk);
+  return 0;
+}
@@ -8,10 +8,216 @@
 #include "umf.h"
 #include "dbg.h"
 
+#ifdef _WIN32
+#define MF_NO_MMAP
+#endif
+
+#ifndef MF_NO_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#ifndef MF_NO_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+#ifdef MF_STATS
+#include <time.h>
+#endif
+
 #define MThd 0x4d546864
 #define MTrk 0x4d54726b
 
 
+/* == Running jobs in parallel
+**
+** run_jobs() calls fn(arg, job, thread) for each job in [0, njobs) using up
+** to nthreads threads (the calling thread is one of them). Jobs are taken
+** in order from a shared counter, so longer jobs should come first.
+** The counter is atomic: with many short jobs (e.g. small files) on many
+** cores, taking a job must not serialize the threads on a lock.
+** If MF_NO_THREADS is defined, jobs are executed sequentially.
+*/
+
+typedef void (*job_fn)(void *arg, uint32_t job, int16_t thread);
+
+#ifndef MF_NO_THREADS
+typedef atomic_uint job_counter;
+#define job_take(c)  atomic_fetch_add_explicit(&(c), 1, memory_order_relaxed)
+#else
+typedef uint32_t job_counter;
+#define job_take(c)  ((c)++)
+#endif
+
+typedef struct {
+  job_fn      fn;
+  void       *arg;
+  uint32_t    njobs;
+  job_counter next;
+  job_counter thread;
+} job_queue;
+
+static void *job_worker(void *q_)
+{
+  job_queue *q = q_;
+  uint32_t   job;
+  int16_t    thread;
+
+  thread = job_take(q->thread);
+
+  while (1) {
+    job = job_take(q->next);
+    if (job >= q->njobs) break;
+    q->fn(q->arg, job, thread);
+  }
+  return NULL;
+}
+
+static void run_jobs(job_fn fn, void *arg, uint32_t njobs, int16_t nthreads)
+{
+  job_queue q;
+
+  q.fn = fn; q.arg = arg; q.njobs = njobs;
+#ifndef MF_NO_THREADS
+  atomic_init(&q.next, 0);
+  atomic_init(&q.thread, 0);
+#else
+  q.next = 0; q.thread = 0;
+#endif
+
+  if (nthreads > (int32_t)njobs) nthreads = njobs;
+
+#ifndef MF_NO_THREADS
+  {
+    pthread_t *thr = NULL;
+    int16_t    k, n = 0;
+
+    if (nthreads > 1) thr = malloc(nthreads * sizeof(pthread_t));
+    if (thr) {
+      for (n=0; n < nthreads-1; n++)
+        if (pthread_create(&thr[n], NULL, job_worker, &q) != 0) break;
+    }
+    job_worker(&q);
+    for (k=0; k<n; k++) pthread_join(thr[k], NULL);
+    if (thr) free(thr);
+  }
+#else
+  job_worker(&q);
+#endif
+}
+
+/* == Statistics and tracing
+**
+** With MF_STATS defined, readers, writers and sequences count what they
+** do in their stats field and the main phases (scanning a track, sorting,
+** encoding a track) can be recorded as "complete" events of the Chrome
+** trace format. Without MF_STATS the stat_* macros expand to nothing.
+**
+** The trace is a single file for the whole process; events are written
+** as soon as they end, under a lock. Timestamps are in microseconds
+** since mf_trace_start().
+*/
+
+#ifdef MF_STATS
+
+static uint64_t stat_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stat_merge(mf_stats *dst, const mf_stats *src)
+{
+  uint64_t       *d = (uint64_t *)dst;
+  const uint64_t *s = (const uint64_t *)src;
+  uint32_t        k;
+
+  for (k=0; k < sizeof(mf_stats)/sizeof(uint64_t); k++) d[k] += s[k];
+}
+
+static FILE    *trace_file = NULL;
+static uint64_t trace_t0   = 0;
+static int16_t  trace_cnt  = 0;
+#ifndef MF_NO_THREADS
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void trace_evt(char *name, int32_t arg, int16_t thread, uint64_t t0, uint64_t t1)
+{
+  if (!trace_file) return;
+#ifndef MF_NO_THREADS
+  pthread_mutex_lock(&trace_lock);
+#endif
+  if (trace_file) {
+    fprintf(trace_file, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                        "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"n\": %d}}",
+                        trace_cnt++ ? "," : "", name, thread,
+                        (t0 - trace_t0) / 1000.0, (t1 - t0) / 1000.0, arg);
+  }
+#ifndef MF_NO_THREADS
+  pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+int16_t mf_trace_start(char *fname)
+{
+  FILE *f;
+
+  if (!fname) return 999;
+  if (trace_file) mf_trace_stop();
+  f = fopen(fname, "w");
+  if (!f) return 997;
+  fprintf(f, "[");
+  trace_cnt  = 0;
+  trace_t0   = stat_now();
+  trace_file = f;
+  return 0;
+}
+
+int16_t mf_trace_stop(void)
+{
+  int16_t ret = 0;
+
+#ifndef MF_NO_THREADS
+  pthread_mutex_lock(&trace_lock);
+#endif
+  if (trace_file) {
+    fprintf(trace_file, "\n]\n");
+    if (fclose(trace_file) != 0) ret = 996;
+    trace_file = NULL;
+  }
+#ifndef MF_NO_THREADS
+  pthread_mutex_unlock(&trace_lock);
+#endif
+  return ret;
+}
+
+#define stat_add(st,f,n)        ((st)->f += (n))
+#define stat_evt(st,s)          ((st)->evt[mf_stat_class(s)]++)
+#define stat_time(t)            uint64_t t = stat_now()
+#define stat_span(st,f,t)       ((st)->f += stat_now() - (t))
+#define stat_trace(nm,a,th,t)   (trace_file ? trace_evt(nm, a, th, t, stat_now()) : (void)0)
+
+#else
+
+int16_t mf_trace_start(char *fname) { return 998; }
+int16_t mf_trace_stop(void)         { return 0; }
+
+#define stat_add(st,f,n)
+#define stat_evt(st,s)
+#define stat_time(t)
+#define stat_span(st,f,t)
+#define stat_trace(nm,a,th,t)
+
+#endif
+
 /* *********************************************************
      ooooooooo.   oooooooooooo       .o.       oooooooooo.
      `888   `Y88. `888'     `8      .888.      `888'   `Y8b
@@ -31,43 +237,156 @@ int16_t mf_numparms(int16_t s)  { return ("\2\2\2\2\1\1\2"[((s) & 0x70)>>4]); }
 
 /********************************************************************/
 
+/* == Variable length quantities
+**
+**  mf_vlq_get() decodes a quantity from memory without a per-byte loop:
+**  when at least four bytes are available they are loaded as a big endian
+**  word, the continuation bits of the four bytes form an index in a table
+**  that gives the length (or 0 if all four bytes have the continuation bit
+**  set) and the 7-bit groups are compacted with shifts and masks. Only the
+**  last three bytes of a buffer go through the byte by byte path.
+**  Single byte quantities (most of the deltas in real files) are
+**  handled upfront.
+**
+**  mf_vlq_put() does the reverse: the bits are spread over a word, the
+**  continuation bits are added in one go and the whole word is stored.
+**  It may write four bytes (only the first `len` are meaningful) so the
+**  destination must have room for them.
+**
+**  The standard limits quantities to four bytes (0x0FFFFFFF), longer ones
+**  are rejected.
+*/
+
+static const uint8_t vlq_len[16] = {1,1,1,1,1,1,1,1,2,2,2,2,3,3,4,0};
+static const uint32_t vlq_cont[5] = {0, 0, 0x8000, 0x808000, 0x80808000};
+
+#define vlq_load(p)  (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+                      ((uint32_t)(p)[2] <<  8) |  (uint32_t)(p)[3])
+
+#define vlq_key(x)   ((((x) >> 28) & 8) | (((x) >> 21) & 4) | (((x) >> 14) & 2) | (((x) >> 7) & 1))
+
+/* Returns the value or -1 if the buffer ends before the quantity and -2 if
+** it is longer than four bytes. On error *p is left unchanged. */
+int32_t mf_vlq_get(const uint8_t **p, const uint8_t *end)
+{
+  const uint8_t *s = *p;
+  uint32_t x, len;
+
+  if (s < end && *s < 0x80) { *p = s + 1; return *s; }  /* most deltas */
+
+  if (end - s >= 4) {
+    x = vlq_load(s);
+    if ((len = vlq_len[vlq_key(x)]) == 0) return -2;
+    x >>= (4 - len) * 8;
+    *p = s + len;
+    return (x & 0x7F) | ((x >> 1) & 0x3F80) | ((x >> 2) & 0x1FC000) | ((x >> 3) & 0xFE00000);
+  }
+
+  for (x = 0; s < end; s++) {
+    x = (x << 7) | (*s & 0x7F);
+    if ((*s & 0x80) == 0) { *p = s + 1; return x; }
+  }
+  return -1;  /* at most three bytes were left: can't be too long */
+}
+
+/* Stores n (truncated to 28 bits) in up to four bytes at p and returns the
+** length of its representation (1 to 4). */
+uint32_t mf_vlq_put(uint8_t *p, uint32_t n)
+{
+  uint32_t len, x;
+
+  n &= 0x0FFFFFFF;
+  if (n < 0x80) { p[0] = n; return 1; }  /* most deltas */
+  len = 1 + (n > 0x7F) + (n > 0x3FFF) + (n > 0x1FFFFF);
+  x  = (n & 0x7F) | ((n << 1) & 0x7F00) | ((n << 2) & 0x7F0000) | ((n << 3) & 0x7F000000);
+  x  = (x | vlq_cont[len]) << ((4 - len) * 8);
+  p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+  return len;
+}
+
+/* Decodes up to n quantities from src. Returns the number of values
+** stored in dst or -1 if src holds an invalid or truncated quantity. */
+int32_t mf_vlq_decode(const uint8_t *src, uint32_t len, uint32_t *dst, uint32_t n)
+{
+  const uint8_t *end = src + len;
+  uint32_t k = 0;
+  int32_t  v;
+
+  while (k < n && src < end) {
+    if ((v = mf_vlq_get(&src, end)) < 0) return -1;
+    dst[k++] = v;
+  }
+  return k;
+}
+
+/* Encodes n quantities. dst must have room for 4*n bytes; returns the
+** number of bytes actually used. */
+uint32_t mf_vlq_encode(const uint32_t *src, uint32_t n, uint8_t *dst)
+{
+  uint8_t *p = dst;
+
+  while (n-- > 0) p += mf_vlq_put(p, *src++);
+  return p - dst;
+}
+
+/********************************************************************/
+
 /* == Reading Values
 **
 **  readnum(n)  reads n bytes and assembles them to create an integer
 **              if n is 0, reads a variable length representation
+**
+**  If the reader has an in-memory source (mem != NULL) bytes are taken
+**  directly from it, otherwise they are read from the file.
+**
+**  readvar() returns -1 at the end of the data and -2 if the quantity is
+**  longer than four bytes.
 */
 
+#define readbyte(m) ((m)->mem ? ((m)->mem_cur < (m)->mem_end ? *(m)->mem_cur++ : EOF) \
+                              : fgetc((m)->file))
+
 static int32_t readvar(mf_reader *mfile)
 {
   int32_t v = 0;
-  int16_t c;
+  int16_t c, k;
 
-  if ((c = fgetc(mfile->file)) == EOF) return -1;
+  stat_add(&mfile->stats, varlen, 1);
+  if (mfile->mem) return mf_vlq_get(&mfile->mem_cur, mfile->mem_end);
 
-  while (c & 0x80 ) {
-    v = (v << 7) | (c & 0x7f);
+  for (k=0; k<4; k++) {
     if ((c = fgetc(mfile->file)) == EOF) return -1;
+    v = (v << 7) | (c & 0x7f);
+    if ((c & 0x80) == 0) return v;
   }
-  v = (v << 7) | c;
-  return (v);
+  return -2;
 }
 
 static int32_t readnum(mf_reader *mfile, int16_t k)
 {
-  int32_t x = 0, v = 0;
+  int32_t  x = 0;
+  uint32_t v = 0;
 
   if (k == 0) return(readvar(mfile));
 
+  if (mfile->mem) {
+    if (mfile->mem_end - mfile->mem_cur < k) return -1;
+    while (k-- > 0) v = (v << 8) | *mfile->mem_cur++;
+    return (int32_t)v;
+  }
+
   while (k-- > 0) {
     if ((x = fgetc(mfile->file)) == EOF) return -1;
     v = (v << 8) | x;
   }
-  return v;
+  return (int32_t)v;
 }
 
 /* === Read messages
 **   readmsg(n)  reads n bytes, stores them in a buffer end returns
 **               a pointer to the buffer;
+**               For in-memory sources no copy is made: the returned
+**               pointer points directly into the source.
 */
 
 static uint8_t *chrbuf_set(mf_reader *mfile, int32_t sz)
@@ -78,6 +397,7 @@ static uint8_t *chrbuf_set(mf_reader *mfile, int32_t sz)
     if (t) {
       mfile->chrbuf    = t;
       mfile->chrbuf_sz = sz;
+      stat_add(&mfile->stats, chrbuf_realloc, 1);
     }
   }
   return mfile->chrbuf;
@@ -90,8 +410,16 @@ static uint8_t *readmsg(mf_reader *mfile, int32_t n)
 
   if (n == 0) return (uint8_t *)"";
 
+  if (mfile->mem) {
+    if (mfile->mem_end - mfile->mem_cur < n) return NULL;
+    s = (uint8_t *)mfile->mem_cur;
+    mfile->mem_cur += n;
+    return s;
+  }
+
   chrbuf_set(mfile, n);
   if (mfile->chrbuf_sz < n) return NULL;
+  stat_add(&mfile->stats, sys_bytes, n);
 
   s = mfile->chrbuf;
   while (n-- > 0) {   /*** Read the message ***/
@@ -102,10 +430,126 @@ static uint8_t *readmsg(mf_reader *mfile, int32_t n)
   return mfile->chrbuf;
 }
 
+/* === Skip bytes
+**   skipmsg(n)  moves n bytes ahead without copying them. Files are
+**               read through only if they can't be seeked (e.g. pipes).
+*/
+
+#define skip_bit(a,n)  ((a)[((n) >> 5) & 7] & (1u << ((n) & 31)))
+
+static int16_t skipmsg(mf_reader *mfile, uint32_t n)
+{
+  if (mfile->mem) {
+    if ((uint32_t)(mfile->mem_end - mfile->mem_cur) < n) return -1;
+    mfile->mem_cur += n;
+    return 0;
+  }
+
+  if (n > 0 && n <= 0x7FFFFFFF && fseek(mfile->file, n, SEEK_CUR) == 0) {
+    stat_add(&mfile->stats, seeks, 1);
+    return 0;
+  }
+
+  while (n-- > 0)
+    if (fgetc(mfile->file) == EOF) return -1;
+  return 0;
+}
+
+/* == Recovering from errors
+**
+** In tolerant mode mf_scan() goes on after finding an inconsistency:
+**   - chunks that are not MTrk are skipped using their length (123);
+**   - if a chunk header makes no sense the data is searched for the
+**     next "MTrk" (124);
+**   - a track longer than the rest of the file is clamped (125) and no
+**     event is read beyond the declared length of its track;
+**   - if the events of a track are bad (e.g. running status with no
+**     previous status) the rest of the track is skipped and on_track()
+**     is called as if the end of track had been found;
+**   - if there are less tracks than declared in the header (120) the
+**     scan stops there.
+** Each problem is passed to on_error() with a message. mr->track is the
+** track and mr->err_pos the offset from the start of the file. Errors
+** returned by the other callbacks still stop the scan.
+**
+** Files are read in memory first: lengths can then be checked against
+** the real size and the data can be searched. mf_scan_mt() falls back
+** to mf_scan() since on_error() must be called from the calling thread.
+*/
+
+int16_t mf_set_tolerant(mf_reader *mr, int16_t on)
+{
+  if (!mr) return 69;
+  if (on) mr->flags |= MF_TOLERANT;
+  else    mr->flags &= ~MF_TOLERANT;
+  return 0;
+}
+
+static void scan_diag(mf_reader *mr, int16_t err, const uint8_t *at, char *msg)
+{
+  mr->err_pos = at - mr->mem;
+  mr->err_cnt++;
+  mr->on_error(mr, err, msg);
+}
+
+static char *scan_errmsg(int16_t err)
+{
+  switch (err) {
+    case 211: return "bad delta time";
+    case 212: return "truncated event";
+    case 214: return "truncated meta event";
+    case 215: return "bad length";
+    case 216: return "truncated data";
+    case 223: return "running status with no previous status";
+    case 543: return "unexpected status byte";
+  }
+  return "bad data";
+}
+
+/* The rest of the track is skipped (by the caller) */
+static int16_t track_bad(mf_reader *mr, int16_t err, int32_t curtrack, uint32_t track_time)
+{
+  char msg[80];
+
+  if (mr->mem_cur >= mr->mem_end)
+    sprintf(msg, "track %d: end of track missing", curtrack);
+  else
+    sprintf(msg, "track %d: %s, %u bytes skipped", curtrack, scan_errmsg(err),
+                                                    (uint32_t)(mr->mem_end - mr->mem_cur));
+  scan_diag(mr, err, mr->mem_cur, msg);
+  stat_add(&mr->stats, callbacks, 1);
+  return mr->on_track(mr, 1, curtrack, track_time);
+}
+
+/* Read what is left of the file in memory */
+static int16_t reader_load(mf_reader *mr)
+{
+  uint8_t *mem = NULL, *t;
+  size_t   len = 0, max = 0, n;
+
+  do {
+    if (len == max) {
+      max = max ? 2 * max : 64 * 1024;
+      if (max > UINT32_MAX || !(t = realloc(mem, max))) { free(mem); return 126; }
+      mem = t;
+    }
+    n = fread(mem + len, 1, max - len, mr->file);
+    len += n;
+  } while (n > 0);
+
+  mr->mem     = mem;
+  mr->mem_cur = mem;
+  mr->mem_end = mem + len;
+  mr->mem_own = 2;
+  return 0;
+}
+
 /*
 ** This is the FSM used to scan the midi file.
 ** mthd is the start state.
 ** From any state an error will make it move to the fail state
+** (errors in the events go through the bad state first: in tolerant
+** mode it reports them and ends the track)
 **   
 **                              .--------.
 **                              v         \
@@ -123,53 +567,67 @@ static uint8_t *readmsg(mf_reader *mfile, int32_t n)
 #define fsmGOTO(x)    goto fsm_state_##x
 #define fsmSTATE(x)   fsm_state_##x :
 
-int16_t mf_scan(mf_reader *mfile)
+static int16_t scan_header(mf_reader *mfile, int32_t *ntracks)
+{
+  int32_t tmp;
+  int32_t v1, v2;
+
+  if (readnum(mfile, 4) != MThd) return 110;
+  tmp = readnum(mfile, 4); /* chunk length */
+  if (tmp < 6) return 111;
+  v1 = readnum(mfile,2);
+  *ntracks = readnum(mfile,2);
+  v2 = readnum(mfile,2);
+  if (v2 < 0) return 111;
+  if (tmp > 6) readnum(mfile,tmp-6);
+  stat_add(&mfile->stats, bytes, 8 + tmp);
+  stat_add(&mfile->stats, callbacks, 1);
+  return mfile->on_header(mfile, v1, *ntracks, v2);
+}
+
+static int16_t scan_track(mf_reader *mfile, int32_t curtrack)
 {
   int32_t tmp;
   int32_t v1, v2;
   int16_t ERROR = 0;
   int32_t track_time;
   int32_t tracklen;
-  int32_t ntracks;
-  int32_t curtrack = 0;
   int32_t status = 0;
   uint8_t *msg;
   int32_t chan;
+  stat_time(t0);
+
+  mfile->track = curtrack;
 
   fsm {
-    fsmSTATE(mthd) {
-      if (readnum(mfile, 4) != MThd) {ERROR = 110; fsmGOTO(fail);};
-      tmp = readnum(mfile, 4); /* chunk length */
-      if (tmp < 6) {ERROR = 111; fsmGOTO(fail);};
-      v1 = readnum(mfile,2);
-      ntracks = readnum(mfile,2);
-      v2 = readnum(mfile,2);
-      ERROR = mfile->on_header(v1, ntracks, v2);
-      if (ERROR) fsmGOTO(fail);
-      if (tmp > 6) readnum(mfile,tmp-6);
-      fsmGOTO(mtrk);
-    }
-    
     fsmSTATE(mtrk) {
-      if (curtrack++ == ntracks) fsmGOTO(end);
-      if (readnum(mfile,4) != MTrk) {ERROR=120; fsmGOTO(fail); }
+      if (readnum(mfile,4) != MTrk) {ERROR=120; fsmGOTO(end); }
       tracklen = readnum(mfile,4);
-      if (tracklen < 0) {ERROR=121; fsmGOTO(fail); }
+      if ((mfile->flags & MF_TOLERANT) && mfile->mem &&
+          (uint32_t)tracklen > (uint32_t)(mfile->mem_end - mfile->mem_cur))
+        tracklen = mfile->mem_end - mfile->mem_cur;  /* already reported */
+      if (tracklen < 0) {ERROR=121; fsmGOTO(end); }
       track_time = 0;
       status = 0;
-      ERROR = mfile->on_track(0, curtrack, tracklen);
-      if (ERROR) fsmGOTO(fail);
+      if (curtrack <= 256 && skip_bit(mfile->skip_trk, curtrack-1)) {
+        if (skipmsg(mfile, tracklen)) ERROR=122;
+        fsmGOTO(end);
+      }
+      stat_add(&mfile->stats, bytes, 8 + tracklen);
+      stat_add(&mfile->stats, callbacks, 1);
+      ERROR = mfile->on_track(mfile, 0, curtrack, tracklen);
+      if (ERROR) fsmGOTO(end);
       fsmGOTO(event);
     }
     
     fsmSTATE(event) {
-      tmp = readnum(mfile,0); if (tmp < 0) {ERROR=211; fsmGOTO(fail); }
+      tmp = readnum(mfile,0); if (tmp < 0) {ERROR=211; fsmGOTO(bad); }
       track_time += tmp;
     
-      tmp = readnum(mfile,1); if (tmp < 0) {ERROR=212; fsmGOTO(fail); }
+      tmp = readnum(mfile,1); if (tmp < 0) {ERROR=212; fsmGOTO(bad); }
     
       if ((tmp & 0x80) == 0) {
-        if (status == 0) {ERROR=223; fsmGOTO(fail); } /* running status not allowed! */
+        if (status == 0) {ERROR=223; fsmGOTO(bad); } /* running status not allowed! */
         fsmGOTO(midi_evt);
       }
     
@@ -178,8 +636,8 @@ int16_t mf_scan(mf_reader *mfile)
       if (status == 0xFF) fsmGOTO(meta_evt);
       if (status == 0xF0) fsmGOTO(sys_evt);
       if (status == 0xF7) fsmGOTO(sys_evt);
-      if (status >  0xF0) {ERROR=543; fsmGOTO(fail); }
-      tmp = readnum(mfile,1);
+      if (status >  0xF0) {ERROR=543; fsmGOTO(bad); }
+      tmp = readnum(mfile,1); if (tmp < 0) {ERROR=212; fsmGOTO(bad); }
       fsmGOTO(midi_evt);
     }
     
@@ -189,66 +647,323 @@ int16_t mf_scan(mf_reader *mfile)
       v2 = -1;
       if (mf_numparms(status) == 2) {
         v2 = readnum(mfile,1);
-        if (v2 < 0) {ERROR=212; fsmGOTO(fail); }
+        if (v2 < 0) {ERROR=212; fsmGOTO(bad); }
       }
-      ERROR = mfile->on_midi_evt(track_time, status & 0xF0, chan, v1, v2);
-      if (ERROR) fsmGOTO(fail);
+      if (mfile->skip_cls & (1 << ((status >> 4) & 0x07))) fsmGOTO(event);
+      stat_evt(&mfile->stats, status);
+      stat_add(&mfile->stats, callbacks, 1);
+      ERROR = mfile->on_midi_evt(mfile, track_time, status & 0xF0, chan, v1, v2);
+      if (ERROR) fsmGOTO(end);
     
       fsmGOTO(event);
     }
     
     fsmSTATE(meta_evt) {
       v1 = readnum(mfile,1);
-      if (v1 < 0) {ERROR=214; fsmGOTO(fail); }
+      if (v1 < 0) {ERROR=214; fsmGOTO(bad); }
       fsmGOTO(sys_evt);
     }
     
     fsmSTATE(sys_evt) {
       v2 = readnum(mfile,0);
-      if (v2 < 0) {ERROR=215; fsmGOTO(fail); }
+      if (v2 < 0) {ERROR=215; fsmGOTO(bad); }
+
+      if (v1 != mf_me_end_of_track &&
+          ((mfile->skip_cls & MF_SKIP(status)) ||
+           (v1 >= 0 && skip_bit(mfile->skip_meta, v1)))) {
+        if (skipmsg(mfile, v2)) {ERROR=216; fsmGOTO(bad); }
+        status = 0;
+        fsmGOTO(event);
+      }
     
       msg = readmsg(mfile,v2);
-      if (msg == NULL) {ERROR=216; fsmGOTO(fail); }
+      if (msg == NULL) {ERROR=216; fsmGOTO(bad); }
     
+      stat_add(&mfile->stats, callbacks, 1);
       if (v1 == mf_me_end_of_track) {
-        ERROR = mfile->on_track(1, curtrack, track_time);
-        if (ERROR) fsmGOTO(fail); 
-        fsmGOTO(mtrk);
+        ERROR = mfile->on_track(mfile, 1, curtrack, track_time);
+        fsmGOTO(end);
       }
-      ERROR = mfile->on_sys_evt(track_time, status, v1, v2, msg);
-      if (ERROR) fsmGOTO(fail); 
+      stat_evt(&mfile->stats, status);
+      ERROR = mfile->on_sys_evt(mfile, track_time, status, v1, v2, msg);
+      if (ERROR) fsmGOTO(end); 
       status = 0;
       fsmGOTO(event);
     }
     
-    fsmSTATE(fail) {
-      if (ERROR < 0) ERROR = -ERROR;
-      mfile->on_error(ERROR, NULL);
+    fsmSTATE(bad) {
+      if (mfile->flags & MF_TOLERANT) ERROR = track_bad(mfile, ERROR, curtrack, track_time);
       fsmGOTO(end);
     }
-    
+
     fsmSTATE(end) {
+      stat_trace("scan track", curtrack, mfile->thread, t0);
       return ERROR;
     }
   }  
 }
 
+#define chunk_chr(c) (0x20 <= (c) && (c) < 0x7F)
+#define chunk_id(p)  (chunk_chr((p)[0]) && chunk_chr((p)[1]) && chunk_chr((p)[2]) && chunk_chr((p)[3]))
+
+/* Find the next MTrk chunk and scan it with the end of the source set to
+** the end of the chunk. At the end mem_cur is moved after the chunk
+** whatever happened in it. found is 0 if there are no more tracks.
+*/
+static int16_t scan_track_tolerant(mf_reader *mr, int32_t curtrack, int16_t *found)
+{
+  const uint8_t *end = mr->mem_end;
+  const uint8_t *chunk, *p;
+  uint32_t       len;
+  int16_t        ERROR;
+  char           msg[80];
+
+  mr->track = curtrack;
+  *found = 0;
+  while (1) {
+    chunk = mr->mem_cur;
+    if (end - chunk < 8) {
+      mr->mem_cur = end;
+      return 0;
+    }
+    if (readnum(mr,4) == MTrk) break;
+
+    len = (uint32_t)readnum(mr,4);
+    if (chunk_id(chunk) && len <= (uint32_t)(end - mr->mem_cur)) {
+      sprintf(msg, "unknown chunk '%.4s' skipped (%u bytes)", chunk, len);
+      scan_diag(mr, 123, chunk, msg);
+      mr->mem_cur += len;
+      continue;
+    }
+
+    for (p = chunk+1; p + 4 <= end && memcmp(p, "MTrk", 4) != 0; p++) ;
+    if (p + 4 > end) p = end;
+    sprintf(msg, "bad chunk header, %u bytes skipped", (uint32_t)(p - chunk));
+    scan_diag(mr, 124, chunk, msg);
+    mr->mem_cur = p;
+  }
+
+  len = (uint32_t)readnum(mr,4);
+  if (len > (uint32_t)(end - mr->mem_cur)) {
+    sprintf(msg, "track %d: %u bytes declared, %u available", curtrack, len,
+                                                 (uint32_t)(end - mr->mem_cur));
+    scan_diag(mr, 125, chunk, msg);
+    len = end - mr->mem_cur;
+  }
+
+  *found = 1;
+  mr->mem_cur = chunk;
+  mr->mem_end = chunk + 8 + len;
+  ERROR = scan_track(mr, curtrack);
+  mr->mem_cur = mr->mem_end;
+  mr->mem_end = end;
+  return ERROR;
+}
+
+int16_t mf_scan(mf_reader *mfile)
+{
+  int16_t ERROR = 0;
+  int32_t ntracks;
+  int32_t curtrack = 0;
+  int16_t found;
+  char    msg[80];
+  stat_time(t0);
+
+  if ((mfile->flags & MF_TOLERANT) && !mfile->mem) {
+    if (!mfile->file) ERROR = 127;
+    else ERROR = reader_load(mfile);
+  }
+  if (!ERROR) ERROR = scan_header(mfile, &ntracks);
+
+  while (!ERROR && curtrack++ < ntracks) {
+    if (!(mfile->flags & MF_TOLERANT)) {
+      ERROR = scan_track(mfile, curtrack);
+      continue;
+    }
+    ERROR = scan_track_tolerant(mfile, curtrack, &found);
+    if (!ERROR && !found) {
+      sprintf(msg, "tracks %d to %d missing", curtrack, ntracks);
+      scan_diag(mfile, 120, mfile->mem_cur, msg);
+      break;
+    }
+  }
+
+  stat_span(&mfile->stats, ns_scan, t0);
+
+  if (ERROR) {
+    if (ERROR < 0) ERROR = -ERROR;
+    mfile->on_error(mfile, ERROR, NULL);
+  }
+  return ERROR;
+}
+
+/* == Scanning tracks in parallel
+**
+** Tracks of an in-memory file are first located, hopping from a chunk to
+** the next, and then decoded concurrently. Callbacks will be called from
+** different threads at the same time: mr->track and mr->thread (0 to
+** nthreads-1) can be used to keep separate state for each track/thread.
+** Only on_header() and on_error() are called from the calling thread.
+*/
+
+typedef struct {
+  mf_reader     *mr;
+  const uint8_t **trk;  /* where each track starts */
+  uint32_t      *len;   /* length (including the chunk header) */
+  int32_t       *ord;   /* tracks, longest first */
+  int16_t       *err;
+#ifdef MF_STATS
+  mf_stats      *st;    /* per track, merged at the end */
+#endif
+} scan_jobs;
+
+static void scan_job(void *arg, uint32_t job, int16_t thread)
+{
+  scan_jobs *sj = arg;
+  mf_reader  mr;
+  int32_t    t = sj->ord[job];
+
+  mr = *sj->mr;
+  mr.file    = NULL;
+  mr.chrbuf  = NULL;
+  mr.chrbuf_sz = 0;
+  mr.mem_own = 0;
+  mr.mem     = sj->trk[t];
+  mr.mem_cur = sj->trk[t];
+  mr.mem_end = sj->trk[t] + sj->len[t];
+  mr.thread  = thread;
+#ifdef MF_STATS
+  memset(&mr.stats, 0, sizeof(mf_stats));
+#endif
+
+  sj->err[t] = scan_track(&mr, t+1);
+  if (mr.chrbuf) free(mr.chrbuf);
+#ifdef MF_STATS
+  sj->st[t] = mr.stats;
+#endif
+}
+
+int16_t mf_scan_mt(mf_reader *mr, int16_t nthreads)
+{
+  scan_jobs  sj;
+  int32_t    ntracks = 0;
+  int32_t    t, j;
+  uint32_t   len;
+  int16_t    ERROR = 0;
+  stat_time(t0);
+
+  if (!mr) return 79;
+  if (!mr->mem || nthreads < 2 || (mr->flags & MF_TOLERANT)) return mf_scan(mr);
+
+  ERROR = scan_header(mr, &ntracks);
+  if (ERROR) {
+    mr->on_error(mr, ERROR, NULL);
+    return ERROR;
+  }
+  if (ntracks <= 0) return 0;  /* nothing to index (and no malloc(0)) */
+
+  sj.mr  = mr;
+  sj.trk = malloc(ntracks * sizeof(uint8_t *));
+  sj.len = malloc(ntracks * sizeof(uint32_t));
+  sj.ord = malloc(ntracks * sizeof(int32_t));
+  sj.err = calloc(ntracks, sizeof(int16_t));
+#ifdef MF_STATS
+  sj.st  = calloc(ntracks, sizeof(mf_stats));
+  if (!sj.st) ERROR = 78;
+#endif
+
+  if (!sj.trk || !sj.len || !sj.ord || !sj.err) ERROR = 78;
+
+  /* Index the tracks */
+  for (t=0; t<ntracks && !ERROR; t++) {
+    if (mr->mem_end - mr->mem_cur < 8) { ERROR = 120; break; }
+    sj.trk[t] = mr->mem_cur;
+    if (readnum(mr,4) != MTrk) { ERROR = 120; break; }
+    len = (uint32_t)readnum(mr,4);
+    if (len > (uint32_t)(mr->mem_end - mr->mem_cur)) len = mr->mem_end - mr->mem_cur;
+    mr->mem_cur += len;
+    sj.len[t] = len + 8;
+    for (j=t; j>0 && sj.len[sj.ord[j-1]] < sj.len[t]; j--)
+      sj.ord[j] = sj.ord[j-1];
+    sj.ord[j] = t;
+  }
+
+  if (!ERROR) run_jobs(scan_job, &sj, ntracks, nthreads);
+
+  for (t=0; t<ntracks && !ERROR; t++) ERROR = sj.err[t];
+
+#ifdef MF_STATS
+  for (t=0; sj.st && t<ntracks; t++) stat_merge(&mr->stats, &sj.st[t]);
+  if (sj.st) free(sj.st);
+#endif
+  stat_span(&mr->stats, ns_scan, t0);
+
+  if (sj.trk) free(sj.trk);
+  if (sj.len) free(sj.len);
+  if (sj.ord) free(sj.ord);
+  if (sj.err) free(sj.err);
+
+  if (ERROR) {
+    if (ERROR < 0) ERROR = -ERROR;
+    mr->on_error(mr, ERROR, NULL);
+  }
+  return ERROR;
+}
+
+/* == Filtering
+**
+** Skipped channel events are still decoded (they are at most three bytes
+** and are needed to track the running status), skipped sysex and meta
+** events are jumped over by advancing the pointer (or seeking the file).
+** Skipped tracks are jumped over as a whole using their length, not even
+** on_track() is called for them.
+*/
+
+int16_t mf_skip(mf_reader *mr, uint16_t classes)
+{
+  if (!mr) return 69;
+  mr->skip_cls = classes;
+  return 0;
+}
+
+int16_t mf_skip_meta(mf_reader *mr, int16_t type, int16_t skip)
+{
+  if (!mr) return 69;
+  if (type < 0 || type > 255) return 68;
+  if (skip) mr->skip_meta[type >> 5] |=  (1u << (type & 31));
+  else      mr->skip_meta[type >> 5] &= ~(1u << (type & 31));
+  return 0;
+}
+
+int16_t mf_skip_track(mf_reader *mr, int16_t track, int16_t skip)
+{
+  if (!mr) return 69;
+  if (track < 1 || track > 256) return 68;
+  track--;
+  if (skip) mr->skip_trk[track >> 5] |=  (1u << (track & 31));
+  else      mr->skip_trk[track >> 5] &= ~(1u << (track & 31));
+  return 0;
+}
+
 
 /*************************************************************/
 
-static int16_t mf_dmp_header (int16_t type, int16_t ntracks, int16_t division)
+static int16_t mf_dmp_header (mf_reader *mr, int16_t type, int16_t ntracks, int16_t division)
 {
-  printf("HEADER: %u, %u, %u\n", type, ntracks, division);
+  if (mf_is_smpte(division))
+    printf("HEADER: %u, %u, SMPTE %d fps %d tpf\n", type, ntracks, mf_smpte_fps(division), mf_smpte_tpf(division));
+  else
+    printf("HEADER: %u, %u, %u\n", type, ntracks, division);
   return 0;
 }
 
-static int16_t mf_dmp_track (int16_t eot, int16_t tracknum, uint32_t tracklen)
+static int16_t mf_dmp_track (mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen)
 {
   printf("TRACK %s: %d (%lu %s)\n", eot?"END":"START", tracknum, tracklen,eot?"ticks":"bytes");
   return 0;
 }
 
-static int16_t mf_dmp_midi_evt(uint32_t tick, int16_t type, int16_t chan,
+static int16_t mf_dmp_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
                                                   int16_t data1, int16_t data2)
 {
   printf("%8ld %02X %02X %02X", tick, type, chan, data1);
@@ -257,7 +972,7 @@ static int16_t mf_dmp_midi_evt(uint32_t tick, int16_t type, int16_t chan,
   return 0;
 }
 
-static int16_t mf_dmp_sys_evt(uint32_t tick, int16_t type, int16_t aux,
+static int16_t mf_dmp_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
                                                int32_t len, uint8_t *data)
 {
   printf("%8ld %02X ", tick, type);
@@ -271,7 +986,7 @@ static int16_t mf_dmp_sys_evt(uint32_t tick, int16_t type, int16_t aux,
   return 0;
 }
 
-static int16_t mf_dmp_error(int16_t err, char *msg)
+static int16_t mf_dmp_error(mf_reader *mr, int16_t err, char *msg)
 {
   if (msg == NULL) msg = "";
   fprintf(stderr, "Error %03d - %s\n", err, msg);
@@ -280,6 +995,45 @@ static int16_t mf_dmp_error(int16_t err, char *msg)
 
 /*************************************************************/
 
+static mf_reader *reader_init(FILE *f, const uint8_t *mem, uint32_t len)
+{
+  mf_reader *mr = NULL;
+
+  mr = malloc(sizeof(mf_reader));
+  if (mr) {
+    mr->file = f;
+
+    mr->mem     = mem;
+    mr->mem_cur = mem;
+    mr->mem_end = mem ? mem + len : NULL;
+    mr->mem_own = 0;
+
+    mr->on_error    = mf_dmp_error    ;
+    mr->on_header   = mf_dmp_header   ;
+    mr->on_track    = mf_dmp_track    ;
+    mr->on_midi_evt = mf_dmp_midi_evt ;
+    mr->on_sys_evt  = mf_dmp_sys_evt  ;
+
+    mr->chrbuf      = NULL;
+    mr->chrbuf_sz   = 0;
+
+    mr->track  = 0;
+    mr->thread = 0;
+    mr->feed   = NULL;
+    memset(&mr->stats, 0, sizeof(mf_stats));
+    mr->skip_cls = 0;
+    memset(mr->skip_meta, 0, sizeof(mr->skip_meta));
+    memset(mr->skip_trk,  0, sizeof(mr->skip_trk));
+    mr->flags   = 0;
+    mr->err_pos = 0;
+    mr->err_cnt = 0;
+    mr->filenum = 0;
+
+    mr->aux = NULL;
+  }
+  return mr;
+}
+
 mf_reader *mf_reader_new(char  *fname)
 {
   mf_reader *mr = NULL;
@@ -287,37 +1041,114 @@ mf_reader *mf_reader_new(char  *fname)
 
   f = fopen(fname,"rb");
   if (f) {
-    mr = malloc(sizeof(mf_reader));
-    if (mr) {
-      mr->file = f;
-
-      mr->on_error    = mf_dmp_error    ;
-      mr->on_header   = mf_dmp_header   ;
-      mr->on_track    = mf_dmp_track    ;
-      mr->on_midi_evt = mf_dmp_midi_evt ;
-      mr->on_sys_evt  = mf_dmp_sys_evt  ;
-
-      mr->chrbuf      = NULL;
-      mr->chrbuf_sz   = 0;
-
-      mr->aux = NULL;
-    }
+    mr = reader_init(f, NULL, 0);
+    if (!mr) fclose(f);
   }
   return mr;
 }
 
-void mf_reader_close(mf_reader *mr)
+/* Scan directly from a buffer owned by the caller. The buffer must stay
+** valid (and unchanged) until the reader is closed.
+*/
+mf_reader *mf_reader_mem(const uint8_t *buf, uint32_t len)
 {
-  if (mr) {
-    if (mr->file)   fclose(mr->file);
-    if (mr->chrbuf) free(mr->chrbuf);
-    free(mr);
-  }
+  if (!buf) return NULL;
+  return reader_init(NULL, buf, len);
 }
 
-int16_t mf_read( char          *fname      , mf_fn_error   fn_error   ,
-                 mf_fn_header   fn_header  , mf_fn_track   fn_track   ,
-                 mf_fn_midi_evt fn_midi_evt, mf_fn_sys_evt fn_sys_evt  )
+/* Maps the entire file in memory or, where mmap() is not available, loads
+** it in a malloc'd buffer. own is set to the value for mem_own.
+*/
+static uint8_t *map_file(char *fname, long *len_, int16_t *own_)
+{
+  uint8_t   *mem = NULL;
+  long       len = 0;
+  int16_t    own = 2;
+
+#ifndef MF_NO_MMAP
+  int fd;
+  struct stat st;
+
+  fd = open(fname, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= UINT32_MAX) {
+    len = st.st_size;
+    mem = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem == MAP_FAILED) mem = NULL;
+    else {
+      own = 1;
+#ifdef MADV_SEQUENTIAL
+      madvise(mem, len, MADV_SEQUENTIAL);
+#endif
+    }
+  }
+  close(fd);
+#endif
+
+  if (!mem) {
+    FILE *f = fopen(fname, "rb");
+    if (!f) return NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+      mem = malloc(len+1);
+      if (mem && fread(mem, 1, len, f) != (size_t)len) { free(mem); mem = NULL; }
+    }
+    fclose(f);
+    if (!mem) return NULL;
+    own = 2;
+  }
+
+  *len_ = len;
+  *own_ = own;
+  return mem;
+}
+
+static void unmap_file(const uint8_t *mem, long len, int16_t own)
+{
+  if (own == 2) free((void *)mem);
+#ifndef MF_NO_MMAP
+  if (own == 1) munmap((void *)mem, len);
+#endif
+}
+
+/* Map the entire file in memory and scan it from there. Where mmap() is
+** not available the file is loaded in a malloc'd buffer instead.
+** Note that sysex and meta data passed to on_sys_evt() point into the
+** (read only) mapping.
+*/
+mf_reader *mf_reader_map(char *fname)
+{
+  mf_reader *mr  = NULL;
+  uint8_t   *mem;
+  long       len = 0;
+  int16_t    own = 0;
+
+  mem = map_file(fname, &len, &own);
+  if (!mem) return NULL;
+
+  mr = reader_init(NULL, mem, len);
+  if (mr) {
+    mr->mem_own = own;
+    if (own == 2) stat_add(&mr->stats, seeks, 2);
+  }
+  else unmap_file(mem, len, own);
+
+  return mr;
+}
+
+void mf_reader_close(mf_reader *mr)
+{
+  if (mr) {
+    if (mr->file)   fclose(mr->file);
+    if (mr->chrbuf) free(mr->chrbuf);
+    if (mr->feed)   free(mr->feed);
+    unmap_file(mr->mem, mr->mem_end - mr->mem, mr->mem_own);
+    free(mr);
+  }
+}
+
+int16_t mf_read( char          *fname      , mf_fn_error   fn_error   ,
+                 mf_fn_header   fn_header  , mf_fn_track   fn_track   ,
+                 mf_fn_midi_evt fn_midi_evt, mf_fn_sys_evt fn_sys_evt  )
 {
   int16_t ret = 0;
   mf_reader  *mr;
@@ -339,6 +1170,485 @@ int16_t mf_read( char          *fname      , mf_fn_error   fn_error   ,
   return ret;
 }
 
+/* == Scanning many files
+**
+** Each thread has its own reader, a copy of mb->mr made at the start of
+** mf_batch_run(), and scans with it all the files it takes. Small files
+** are read in the reader's chrbuf, which is kept (and only grows) from a
+** file to the next and from a run to the next. Larger files are mapped.
+** Files are taken from a shared counter, largest first, so a thread that
+** gets a long file doesn't leave the others waiting for it at the end.
+*/
+
+#define BATCH_MAP_MIN  (4L << 20)  /* files larger than this are mapped */
+
+typedef struct {
+  long    size;
+  int32_t file;
+} batch_ord;
+
+typedef struct {
+  mf_batch  *mb;
+  batch_ord *ord;  /* files, largest first */
+} batch_jobs;
+
+static int16_t batch_error(mf_reader *mr, int16_t err, char *msg) { return err; }
+static int16_t batch_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division) { return 0; }
+static int16_t batch_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen) { return 0; }
+static int16_t batch_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
+                                                int16_t data1, int16_t data2) { return 0; }
+static int16_t batch_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
+                                               int32_t len, uint8_t *data) { return 0; }
+
+static long batch_size(char *fname)
+{
+#ifndef MF_NO_MMAP
+  struct stat st;
+
+  if (stat(fname, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+  return st.st_size;
+#else
+  FILE *f;
+  long  len = -1;
+
+  if ((f = fopen(fname, "rb"))) {
+    if (fseek(f, 0, SEEK_END) == 0) len = ftell(f);
+    fclose(f);
+  }
+  return len;
+#endif
+}
+
+static int16_t batch_add(mf_batch *mb, char *fname, long size)
+{
+  void *t;
+  char *s;
+
+  if (mb->cnt >= mb->max) {
+    mb->max = mb->max ? 2 * mb->max : 64;
+    if (!(t = realloc(mb->fname, mb->max * sizeof(char *)))) return 908;
+    mb->fname = t;
+    if (!(t = realloc(mb->fsize, mb->max * sizeof(long)))) return 908;
+    mb->fsize = t;
+    if (!(t = realloc(mb->err, mb->max * sizeof(int16_t)))) return 908;
+    mb->err = t;
+  }
+  if (!(s = malloc(strlen(fname) + 1))) return 908;
+  strcpy(s, fname);
+  mb->fname[mb->cnt] = s;
+  mb->fsize[mb->cnt] = size;
+  mb->err[mb->cnt]   = 0;
+  mb->cnt++;
+  return 0;
+}
+
+mf_batch *mf_batch_new(int16_t nthreads)
+{
+  mf_batch *mb;
+
+  if (nthreads < 1) nthreads = 1;
+  mb = calloc(1, sizeof(mf_batch));
+  if (!mb) return NULL;
+
+  mb->nthreads = nthreads;
+  mb->mr  = reader_init(NULL, NULL, 0);
+  mb->thr = calloc(nthreads, sizeof(mf_reader));
+  if (!mb->mr || !mb->thr) {
+    mf_batch_close(mb);
+    return NULL;
+  }
+  mb->mr->on_error    = batch_error;
+  mb->mr->on_header   = batch_header;
+  mb->mr->on_track    = batch_track;
+  mb->mr->on_midi_evt = batch_midi_evt;
+  mb->mr->on_sys_evt  = batch_sys_evt;
+  return mb;
+}
+
+void mf_batch_close(mf_batch *mb)
+{
+  int32_t k;
+
+  if (!mb) return;
+  for (k=0; k<mb->cnt; k++) free(mb->fname[k]);
+  if (mb->fname) free(mb->fname);
+  if (mb->fsize) free(mb->fsize);
+  if (mb->err)   free(mb->err);
+  for (k=0; mb->thr && k<mb->nthreads; k++)
+    if (mb->thr[k].chrbuf) free(mb->thr[k].chrbuf);
+  if (mb->thr) free(mb->thr);
+  if (mb->mr) mf_reader_close(mb->mr);
+  free(mb);
+}
+
+int16_t mf_batch_add(mf_batch *mb, char *fname)
+{
+  long size;
+
+  if (!mb || !fname) return 909;
+  if ((size = batch_size(fname)) < 0) return 907;
+  return batch_add(mb, fname, size);
+}
+
+#ifndef MF_NO_MMAP
+static int16_t batch_ext(char *name)
+{
+  static char *ext[] = {"mid", "midi", "smf", "kar", NULL};
+  char   *dot = strrchr(name, '.');
+  int16_t k, n;
+
+  if (!dot) return 0;
+  for (k=0; ext[k]; k++) {
+    for (n=0; ext[k][n] && tolower((uint8_t)dot[n+1]) == ext[k][n]; n++) ;
+    if (ext[k][n] == '\0' && dot[n+1] == '\0') return 1;
+  }
+  return 0;
+}
+#endif
+
+/* Adds the MIDI files (by extension) in dir and, recursively, in its
+** subdirectories. Hidden entries and links to directories are skipped.
+*/
+int16_t mf_batch_dir(mf_batch *mb, char *dir)
+{
+#ifndef MF_NO_MMAP
+  DIR           *d;
+  struct dirent *de;
+  struct stat    st;
+  char          *path;
+  int16_t        ret = 0;
+
+  if (!mb || !dir) return 909;
+  if (!(d = opendir(dir))) return 907;
+
+  while (!ret && (de = readdir(d))) {
+    if (de->d_name[0] == '.') continue;
+    path = malloc(strlen(dir) + strlen(de->d_name) + 2);
+    if (!path) { ret = 908; break; }
+    sprintf(path, "%s/%s", dir, de->d_name);
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      ret = mf_batch_dir(mb, path);
+      if (ret == 907) ret = 0;  /* unreadable subdirectories are skipped */
+    }
+    else if (batch_ext(de->d_name) && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+      ret = batch_add(mb, path, st.st_size);
+    free(path);
+  }
+  closedir(d);
+  return ret;
+#else
+  return 906;
+#endif
+}
+
+static int16_t batch_open(mf_reader *rd, char *fname, long size, long *len)
+{
+  FILE    *f;
+  uint8_t *mem = NULL;
+  int16_t  own = 0;
+
+  if (size <= BATCH_MAP_MIN && chrbuf_set(rd, size+1) && rd->chrbuf_sz > size) {
+    if (!(f = fopen(fname, "rb"))) return 79;
+    *len = fread(rd->chrbuf, 1, size+1, f);
+    fclose(f);
+    if (*len <= size) mem = rd->chrbuf;  /* otherwise it has grown since it was added */
+  }
+  if (!mem && !(mem = map_file(fname, len, &own))) return 79;
+
+  rd->mem     = mem;
+  rd->mem_cur = mem;
+  rd->mem_end = mem + *len;
+  rd->mem_own = own;
+  return 0;
+}
+
+static void batch_job(void *arg, uint32_t job, int16_t thread)
+{
+  batch_jobs *bj = arg;
+  mf_batch   *mb = bj->mb;
+  mf_reader  *rd = &mb->thr[thread];
+  int32_t     f  = bj->ord[job].file;
+  long        len = 0;
+  int16_t     err;
+  stat_time(t0);
+
+  rd->filenum = f;
+  rd->track   = 0;
+  rd->err_pos = 0;
+  rd->err_cnt = 0;
+
+  err = batch_open(rd, mb->fname[f], mb->fsize[f], &len);
+  if (err) rd->on_error(rd, err, mb->fname[f]);
+  else err = mf_scan(rd);
+
+  mb->err[f] = err;
+  if (mb->on_file) mb->on_file(rd, f, mb->fname[f], err);
+
+  unmap_file(rd->mem, len, rd->mem_own);
+  rd->mem = rd->mem_cur = rd->mem_end = NULL;
+  rd->mem_own = 0;
+  stat_trace("file", f, thread, t0);
+}
+
+static int batch_cmp(const void *a, const void *b)
+{
+  long sa = ((const batch_ord *)a)->size;
+  long sb = ((const batch_ord *)b)->size;
+
+  if (sa != sb) return sa > sb ? -1 : 1;
+  return ((const batch_ord *)a)->file - ((const batch_ord *)b)->file;
+}
+
+int16_t mf_batch_run(mf_batch *mb)
+{
+  batch_jobs bj;
+  batch_ord *ord;
+  mf_reader *rd;
+  uint8_t   *chr;
+  uint32_t   chr_sz;
+  int32_t    k;
+  int16_t    ERROR = 0;
+
+  if (!mb) return 909;
+  if (mb->cnt == 0) return 0;
+
+  ord = malloc(mb->cnt * sizeof(batch_ord));
+  if (!ord) return 908;
+  for (k=0; k<mb->cnt; k++) {
+    ord[k].size = mb->fsize[k];
+    ord[k].file = k;
+  }
+  qsort(ord, mb->cnt, sizeof(batch_ord), batch_cmp);
+
+  for (k=0; k<mb->nthreads; k++) {
+    rd = &mb->thr[k];
+    chr = rd->chrbuf; chr_sz = rd->chrbuf_sz;
+    *rd = *mb->mr;
+    rd->file    = NULL;
+    rd->feed    = NULL;
+    rd->mem     = rd->mem_cur = rd->mem_end = NULL;
+    rd->mem_own = 0;
+    rd->chrbuf  = chr;
+    rd->chrbuf_sz = chr_sz;
+    rd->thread  = k;
+    memset(&rd->stats, 0, sizeof(mf_stats));
+  }
+
+  bj.mb  = mb;
+  bj.ord = ord;
+  run_jobs(batch_job, &bj, mb->cnt, mb->nthreads);
+
+#ifdef MF_STATS
+  for (k=0; k<mb->nthreads; k++) stat_merge(&mb->mr->stats, &mb->thr[k].stats);
+#endif
+
+  free(ord);
+
+  for (k=0; k<mb->cnt && !ERROR; k++) ERROR = mb->err[k];
+  return ERROR;
+}
+
+/* == Push parser
+**
+** A reader created with mf_reader_push() has no source: bytes are pushed
+** into it with mf_feed(), in chunks of any size, and callbacks are called
+** as soon as each element (header, track start or event) is complete.
+**
+** Elements are parsed straight from the pushed bytes with the same
+** readnum()/readvar() used for in-memory sources. If the chunk ends in the
+** middle of an element, the parser rolls back to the start of the element
+** and keeps its bytes in chrbuf. The next calls to mf_feed() append to it
+** only the bytes needed to complete the element (as far as they are known:
+** e.g. the length of a sysex can only be known after its varlen is read).
+** Nothing else is buffered, so memory is bounded by the largest element
+** (usually a sysex). Data passed to on_sys_evt() is only valid during the
+** callback.
+**
+** mf_feed_end() must be called at the end of the stream to check that
+** nothing is missing.
+*/
+
+#define FEED_HEADER 0
+#define FEED_MTRK   1
+#define FEED_EVENT  2
+#define FEED_DONE   3
+
+#define FEED_MORE  -1
+
+typedef struct {
+  int16_t  state;
+  int16_t  error;
+  int32_t  status;      /* running status */
+  uint32_t track_time;
+  int32_t  ntracks;
+  int32_t  curtrack;
+  uint32_t need;        /* bytes needed to complete the element in chrbuf */
+  uint32_t cnt;         /* bytes of the element in chrbuf */
+} feed_state;
+
+#define feed_more(n) do { fs->need = (n); mr->mem_cur = start; return FEED_MORE; } while (0)
+
+/* Parse one element from mem_cur. Callbacks are only called once the
+** element is complete. */
+static int16_t feed_elem(mf_reader *mr, feed_state *fs)
+{
+  const uint8_t *start = mr->mem_cur;
+  uint32_t       avail = mr->mem_end - start;
+  const uint8_t *msg;
+  int32_t        delta, status, len;
+  int32_t        v1, v2;
+
+  switch (fs->state) {
+    case FEED_HEADER:
+      if (avail < 8) feed_more(8);
+      if (readnum(mr,4) != MThd) return 110;
+      len = readnum(mr,4);
+      if (len < 6) return 111;
+      if (avail - 8 < (uint32_t)len) feed_more(8 + (uint32_t)len);
+      v1 = readnum(mr,2);
+      fs->ntracks = readnum(mr,2);
+      v2 = readnum(mr,2);
+      mr->mem_cur = start + 8 + len;
+      fs->state = fs->ntracks > 0 ? FEED_MTRK : FEED_DONE;
+      return mr->on_header(mr, v1, fs->ntracks, v2);
+
+    case FEED_MTRK:
+      if (avail < 8) feed_more(8);
+      if (readnum(mr,4) != MTrk) return 120;
+      len = readnum(mr,4);
+      if (len < 0) return 121;
+      mr->track = ++fs->curtrack;
+      fs->track_time = 0;
+      fs->status = 0;
+      fs->state = FEED_EVENT;
+      return mr->on_track(mr, 0, fs->curtrack, len);
+
+    case FEED_EVENT:
+      if ((delta = readvar(mr)) < -1) return 211;
+      if (delta < 0) feed_more(avail+1);
+      if ((status = readbyte(mr)) == EOF) feed_more(avail+1);
+
+      v1 = -1;
+      if ((status & 0x80) == 0) {
+        if (fs->status == 0) return 223;  /* running status not allowed! */
+        v1 = status;
+        status = fs->status;
+      }
+      else if (status > 0xF0 && status != 0xF7 && status != 0xFF) return 543;
+      else if (status < 0xF0 && (v1 = readbyte(mr)) == EOF) feed_more(avail+1);
+
+      if (status < 0xF0) {
+        v2 = -1;
+        if (mf_numparms(status) == 2 && (v2 = readbyte(mr)) == EOF) feed_more(avail+1);
+        fs->track_time += delta;
+        fs->status = status;
+        return mr->on_midi_evt(mr, fs->track_time, status & 0xF0, 1+(status & 0x0F), v1, v2);
+      }
+
+      if (status == 0xFF && (v1 = readbyte(mr)) == EOF) feed_more(avail+1);
+      if ((len = readvar(mr)) < -1) return 215;
+      if (len < 0) feed_more(avail+1);
+      if ((uint32_t)(mr->mem_end - mr->mem_cur) < (uint32_t)len)
+        feed_more((uint32_t)(mr->mem_cur - start) + len);
+      msg = mr->mem_cur;
+      mr->mem_cur += len;
+
+      fs->track_time += delta;
+      fs->status = 0;
+      if (v1 == mf_me_end_of_track) {
+        fs->state = fs->curtrack < fs->ntracks ? FEED_MTRK : FEED_DONE;
+        return mr->on_track(mr, 1, fs->curtrack, fs->track_time);
+      }
+      return mr->on_sys_evt(mr, fs->track_time, status, v1, len, (uint8_t *)msg);
+  }
+  return 0;
+}
+
+mf_reader *mf_reader_push(void)
+{
+  mf_reader *mr;
+
+  mr = reader_init(NULL, NULL, 0);
+  if (mr) {
+    mr->feed = calloc(1, sizeof(feed_state));
+    if (!mr->feed) { free(mr); mr = NULL; }
+  }
+  return mr;
+}
+
+static int16_t feed_fail(mf_reader *mr, feed_state *fs, int16_t err)
+{
+  if (err < 0) err = -err;
+  fs->error = err;
+  mr->on_error(mr, err, NULL);
+  return err;
+}
+
+int16_t mf_feed(mf_reader *mr, const uint8_t *bytes, uint32_t n)
+{
+  feed_state *fs;
+  uint32_t    take;
+  int16_t     ret = 0;
+
+  if (!mr || !mr->feed) return 139;
+  fs = mr->feed;
+  if (fs->error) return fs->error;
+
+  while (n > 0 && !ret) {
+    if (fs->cnt > 0) {
+      /* Complete the element left by the previous calls */
+      take = fs->need - fs->cnt;
+      if (take > n) take = n;
+      if (chrbuf_set(mr, fs->cnt + take) == NULL || mr->chrbuf_sz < fs->cnt + take) {
+        ret = 138; break;
+      }
+      memcpy(mr->chrbuf + fs->cnt, bytes, take);
+      fs->cnt += take; bytes += take; n -= take;
+      if (fs->cnt < fs->need) break;
+
+      mr->mem = mr->mem_cur = mr->chrbuf;
+      mr->mem_end = mr->chrbuf + fs->cnt;
+      ret = feed_elem(mr, fs);
+      if (ret == FEED_MORE) ret = 0;  /* need has grown */
+      else fs->cnt = 0;
+      continue;
+    }
+
+    if (fs->state == FEED_DONE) break;  /* trailing bytes are ignored */
+
+    mr->mem = mr->mem_cur = bytes;
+    mr->mem_end = bytes + n;
+    while (fs->state != FEED_DONE && (ret = feed_elem(mr, fs)) == 0) ;
+    take = mr->mem_cur - bytes;
+    bytes += take; n -= take;
+
+    if (ret == FEED_MORE) {
+      /* Keep the incomplete element (n < fs->need), if it has started */
+      if (n > 0) {
+        if (chrbuf_set(mr, n) == NULL || mr->chrbuf_sz < n) { ret = 138; break; }
+        memcpy(mr->chrbuf, bytes, n);
+      }
+      fs->cnt = n; n = 0;
+      ret = 0;
+    }
+  }
+
+  mr->mem = mr->mem_cur = mr->mem_end = NULL;
+  if (ret) return feed_fail(mr, fs, ret);
+  return 0;
+}
+
+int16_t mf_feed_end(mf_reader *mr)
+{
+  feed_state *fs;
+
+  if (!mr || !mr->feed) return 139;
+  fs = mr->feed;
+  if (fs->error) return fs->error;
+  if (fs->state != FEED_DONE || fs->cnt > 0) return feed_fail(mr, fs, 130);
+  return 0;
+}
+
 
 /* ****************************************************************************
      oooooo   oooooo     oooo ooooooooo.   ooooo ooooooooooooo oooooooooooo
@@ -349,7 +1659,50 @@ int16_t mf_read( char          *fname      , mf_fn_error   fn_error   ,
           `888'    `888'       888  `88b.   888       888       888       o
            `8'      `8'       o888o  o888o o888o     o888o     o888ooooood8
 ** ***************************************************************************/
-#define eputc(c)  (mw->trk_len++, fputc(c,mw->file))
+
+/* == Buffered output
+**
+** Each track is encoded in memory (mw->buf) and, once completed, it is
+** emitted with a single write together with its "MTrk" header and length.
+** The first 14 bytes of the buffer are reserved for the header chunk.
+**
+** If the number of tracks is known in advance (see mf_set_ntracks()) each
+** track is sent to the output as soon as it ends, otherwise all the tracks
+** are kept in memory until mf_close(). No seek is ever needed, so the output
+** can be a pipe, a socket or a user defined sink function.
+*/
+
+#define MF_HDR_LEN 14
+
+#define eputc(c)  (mw->buf[mw->buf_cnt++] = (uint8_t)(c))
+
+static int16_t wbuf_chk(mf_writer *mw, uint32_t n)
+{
+  uint32_t newsize;
+  uint8_t *buf;
+
+  if (n <= mw->buf_max - mw->buf_cnt) return 0;
+
+  newsize = mw->buf_max;
+  if (newsize < 256) newsize = 256;
+  while (n > newsize - mw->buf_cnt)
+    newsize += newsize / 2;
+
+  buf = realloc(mw->buf, newsize);
+  if (!buf) return 380;
+  mw->buf = buf;
+  mw->buf_max = newsize;
+  return 0;
+}
+
+static int16_t wbuf_out(mf_writer *mw, uint8_t *data, uint32_t len)
+{
+  if (len == 0) return 0;
+  stat_add(&mw->stats, bytes, len);
+  if (mw->sink) return mw->sink(mw->sink_aux, data, len) ? 382 : 0;
+  if (mw->file) return fwrite(data, 1, len, mw->file) != len ? 381 : 0;
+  return 0;
+}
 
 static void f_write8(mf_writer *mw, uint8_t n)    {eputc(n);}
 
@@ -361,25 +1714,14 @@ static void f_write32(mf_writer *mw, uint32_t n)  {eputc((n >> 24)       );  epu
                                                    eputc((n >>  8) & 0xFF);  eputc((n      ) & 0xFF); }
 
 static void f_writemsg(mf_writer *mw,
-                     int32_t len, uint8_t *data)  {while(len-- > 0) eputc(*data++);}
+                     int32_t len, uint8_t *data)  {if (len > 0) memcpy(mw->buf+mw->buf_cnt, data, len);
+                                                   mw->buf_cnt += len;}
 
 static void f_writevar(mf_writer *mw, uint32_t n)
 {
-  uint32_t buf;
-
-  n &= 0x0FFFFFFF;
-  _dbgmsg("vardata: %08lX -> ", n);
-
-  buf = n & 0x7F;
-  while ((n >>= 7) != 0) {
-    buf = (buf << 8) | (n & 0x7F) | 0x80;
-  }
-  _dbgmsg("%08lX\n", buf);
-  while (1) {
-    eputc(buf & 0xFF);
-    if ((buf & 0x80) == 0) break;
-    buf >>= 8;
-  }
+  /* callers have checked that there is room for at least four bytes */
+  stat_add(&mw->stats, varlen, 1);
+  mw->buf_cnt += mf_vlq_put(mw->buf + mw->buf_cnt, n);
 }
 
 #if 0  /* Not needed */
@@ -390,52 +1732,140 @@ static void f_write14(mf_writer *mw, uint16_t n)
 }
 #endif
 
+/* Write the header chunk in the space reserved at the beginning of the buffer */
+static void f_header(mf_writer *mw, int16_t ntracks)
+{
+  uint32_t pos = mw->buf_cnt;
 
-mf_writer *mf_new(char *fname, int16_t division)
+  mw->buf_cnt = 0;
+  f_write32(mw, MThd);
+  f_write32(mw, 6);
+  f_write16(mw, mw->format >= 0 ? mw->format : (ntracks > 1 ? 1 : 0));
+  f_write16(mw, ntracks);
+  f_write16(mw, mw->division);
+  mw->buf_cnt = pos;
+}
+
+static mf_writer *writer_init(FILE *f, mf_fn_sink sink, void *aux, int16_t division)
 {
   mf_writer *mw = NULL;
 
   mw = malloc(sizeof(mf_writer));
   if (!mw) return NULL;
 
-  mw->file = fopen(fname, "wb");
+  mw->type     = mf_type_file;
+  mw->file     = f;
+  mw->own      = 0;
+  mw->sink     = sink;
+  mw->sink_aux = aux;
+  mw->buf      = NULL;
+  mw->buf_cnt  = 0;
+  mw->buf_max  = 0;
+  mw->trk_pos  = 0;
+  mw->trk_len  = 0;
+  mw->trk_cnt  = 0;
+  mw->trk_num  = 0;
+  mw->trk_in   = 0;
+  mw->hdr_out  = 0;
+  mw->flags    = 0;
+  mw->status   = 0;
+  mw->chan     = 0;
+  mw->division = division;
+  mw->format   = -1;
+  memset(&mw->stats, 0, sizeof(mf_stats));
+
+  /* Reserve space for the header chunk (to be written later) */
+  if (wbuf_chk(mw, MF_HDR_LEN)) { free(mw); return NULL; }
+  mw->buf_cnt = MF_HDR_LEN;
+
+  return mw;
+}
 
-  if (!mw->file) {  free (mw); return NULL; }
+mf_writer *mf_new(char *fname, int16_t division)
+{
+  mf_writer *mw = NULL;
+  FILE      *f;
 
-  mw->type    = mf_type_file;
-  mw->len_pos = 0;
-  mw->trk_len = 0;
-  mw->trk_cnt = 0;
-  mw->trk_in  = 0;
-  mw->division  = division;
+  f = fopen(fname, "wb");
+  if (!f) return NULL;
 
-  /* Write Header chunk (to be rewrite at the end) */
-  f_write32(mw, MThd);
-  f_write32(mw, 6);
-  f_write16(mw, 0);
-  f_write16(mw, 1);
-  f_write16(mw, division);
+  mw = writer_init(f, NULL, NULL, division);
+  if (!mw) { fclose(f); return NULL; }
+  mw->own = 1;
 
   return mw;
 }
 
+/* Write to an already opened file (it will not be closed by mf_close()).
+** The file needs not to be seekable (e.g. stdout or fdopen() of a pipe).
+*/
+mf_writer *mf_new_file(FILE *f, int16_t division)
+{
+  if (!f) return NULL;
+  return writer_init(f, NULL, NULL, division);
+}
+
+/* Send the output to a user function (it must return 0 on success) */
+mf_writer *mf_new_sink(mf_fn_sink sink, void *aux, int16_t division)
+{
+  if (!sink) return NULL;
+  return writer_init(NULL, sink, aux, division);
+}
+
+/* Running status: omit the status byte if it's the same of the previous
+** event in the track. Note offs (with zero release velocity) are written
+** as note on with velocity 0 if this allows to extend the run.
+*/
+int16_t mf_set_running(mf_writer *mw, int16_t on)
+{
+  if (!mw) return 359;
+  if (on) mw->flags |= MF_RUNNING_STATUS;
+  else    mw->flags &= ~MF_RUNNING_STATUS;
+  mw->status = 0;
+  return 0;
+}
+
+int16_t mf_set_ntracks(mf_writer *mw, int16_t ntracks)
+{
+  if (!mw) return 369;
+  if (mw->hdr_out || ntracks < 0 || (mw->format == 0 && ntracks > 1)) return 361;
+  mw->trk_num = ntracks;
+  return 0;
+}
+
+/* Format 2 files are a collection of independent patterns (one per
+** track), format 0 files must have a single track.
+*/
+int16_t mf_set_format(mf_writer *mw, int16_t format)
+{
+  if (!mw) return 379;
+  if (mw->hdr_out || format < -1 || format > 2) return 371;
+  if (format == 0 && (mw->trk_num > 1 || mw->trk_cnt > 1)) return 371;
+  mw->format = format;
+  return 0;
+}
+
 int16_t mf_track_start (mf_writer *mw)
 {
-  if (!mw || !mw->file ) { return 309; }
+  int16_t ret = 0;
+
+  if (!mw) { return 309; }
+  if (mw->format == 0 && mw->trk_cnt > 0) return 302;
+
+  if (mw->trk_in) ret = mf_track_end(mw);
+  if (ret) return ret;
 
-  if (mw->trk_in) mf_track_end(mw);
+  if (wbuf_chk(mw, 8)) return 301;
 
   mw->trk_cnt++;
   mw->trk_in  = 1;
   mw->chan    = 0;
+  mw->status  = 0;
 
   f_write32(mw, MTrk);
-
-  /* Save current position for later */
-  if ((mw->len_pos = ftell(mw->file)) <  0) { return 301; }
-
   f_write32(mw, 0);  /* just a place-holder for now */
 
+  mw->trk_pos = mw->buf_cnt;
   mw->trk_len = 0;
   return 0;
 }
@@ -443,20 +1873,65 @@ int16_t mf_track_start (mf_writer *mw)
 int16_t mf_track_end(mf_writer *mw)
 {
   uint32_t pos_cur;
+  int16_t  ret = 0;
 
-  if (!mw || !mw->file || !mw->trk_in) { return 329; }
+  if (!mw || !mw->trk_in) { return 329; }
 
-  f_writevar(mw, 0);  f_write8(mw, 0xFF);  f_write8(mw, 0x2F);  f_write8(mw, 0x00);
+  if (wbuf_chk(mw, 4)) return 322;
 
-  if ((pos_cur = ftell(mw->file)) <  0) {  return 322; }
+  f_writevar(mw, 0);  f_write8(mw, 0xFF);  f_write8(mw, 0x2F);  f_write8(mw, 0x00);
 
-  if (fseek(mw->file, mw->len_pos, SEEK_SET) < 0) {  return 323; }
+  mw->trk_len = mw->buf_cnt - mw->trk_pos;
 
+  pos_cur = mw->buf_cnt;
+  mw->buf_cnt = mw->trk_pos - 4;
   f_write32(mw, mw->trk_len);
+  mw->buf_cnt = pos_cur;
 
-  if (fseek(mw->file, pos_cur, SEEK_SET) < 0) { return 324; }
   mw->trk_in = 0;
-  return 0;
+
+  /* Number of tracks is known: emit the track right now */
+  if (mw->trk_num > 0) {
+    if (!mw->hdr_out) f_header(mw, mw->trk_num);
+    mw->hdr_out = 1;
+    ret = wbuf_out(mw, mw->buf, mw->buf_cnt);
+    mw->buf_cnt = 0;
+  }
+  return ret;
+}
+
+/* Append the track encoded (in memory) by the writer tw */
+static int16_t writer_add_track(mf_writer *mw, mf_writer *tw)
+{
+  uint32_t len;
+  int16_t  ret = 0;
+
+  if (mw->trk_in) ret = mf_track_end(mw);
+  if (ret) return ret;
+
+  if (mw->format == 0 && mw->trk_cnt > 0) return 302;
+
+  len = tw->buf_cnt - MF_HDR_LEN;
+  mw->trk_cnt++;
+#ifdef MF_STATS
+  stat_merge(&mw->stats, &tw->stats);
+#endif
+
+  if (mw->trk_num > 0) {
+    if (!mw->hdr_out) {
+      f_header(mw, mw->trk_num);
+      mw->hdr_out = 1;
+      ret = wbuf_out(mw, mw->buf, mw->buf_cnt);
+      mw->buf_cnt = 0;
+    }
+    if (!ret) ret = wbuf_out(mw, tw->buf + MF_HDR_LEN, len);
+  }
+  else {
+    if (wbuf_chk(mw, len)) return 380;
+    memcpy(mw->buf + mw->buf_cnt, tw->buf + MF_HDR_LEN, len);
+    mw->buf_cnt += len;
+  }
+  return ret;
 }
 
 int16_t mf_midi_evt (mf_writer *mw, uint32_t delta, int16_t type, int16_t chan,
@@ -464,16 +1939,29 @@ int16_t mf_midi_evt (mf_writer *mw, uint32_t delta, int16_t type, int16_t chan,
 {
   uint8_t st;
 
-  if (!mw || !mw->file || !mw->trk_in) { return 319; }
+  if (!mw || !mw->trk_in) { return 319; }
 
   st = (type & 0xF0);
 
   if (st == mf_st_system_exclusive)  {return 318; }  /* No sysex accepted here! */
 
+  if (wbuf_chk(mw, 8)) return 317;
+  stat_evt(&mw->stats, st);
+
   if (st == mf_st_note_on && data2 == 0) st = mf_st_note_off;
 
+  st |= (chan & 0x0F);
+
   f_writevar(mw, delta);
-  f_write8(mw, st | (chan & 0x0F));
+  if (mw->flags & MF_RUNNING_STATUS) {
+    if ((st & 0xF0) == mf_st_note_off && (data2 & 0x7F) == 0 &&
+        mw->status == (mf_st_note_on | (st & 0x0F))) {
+      st = mw->status;
+    }
+    if (st != mw->status) f_write8(mw, st);
+    mw->status = st;
+  }
+  else f_write8(mw, st);
   f_write7(mw, data1);
   if (mf_numparms(st) > 1)  f_write7(mw, data2);
   mw->chan = chan;
@@ -485,7 +1973,13 @@ int16_t mf_sys_evt(mf_writer *mw, uint32_t delta,
                               int16_t type, int16_t aux,
                               int32_t len, uint8_t *data)
 {
-  if (!mw || !mw->file || !mw->trk_in) { return 349; }
+  if (!mw || !mw->trk_in) { return 349; }
+
+  if (len < 0 || wbuf_chk(mw, 16 + len)) return 348;
+
+  mw->status = 0;  /* sysex and meta events cancel running status */
+  stat_evt(&mw->stats, type);
+  stat_add(&mw->stats, sys_bytes, len);
 
   f_writevar(mw, delta);
   f_write8(mw, type);
@@ -501,37 +1995,38 @@ int16_t mf_text_evt(mf_writer *mw, uint32_t delta, int16_t type, char *str)
   return mf_sys_evt(mw, delta, mf_st_meta_event, type & 0x0F, strlen(str), (uint8_t *)str);
 }
 
-int16_t mf_close (mf_writer *mw)
+/* The writer statistics are added to st (if not NULL) before freeing it */
+static int16_t writer_close(mf_writer *mw, mf_stats *st)
 {
   int16_t ret = 0;
-  int16_t format = 0;
-  uint32_t pos_cur;
 
-  if (!mw || !mw->file) { return 399; }
+  if (!mw) { return 399; }
 
   if (mw->trk_in) ret = mf_track_end(mw);
 
-  if (mw->trk_cnt > 1) format = 1;
-
-  if ((pos_cur = ftell(mw->file)) <  0) {  return 392; }
-
-  if (fseek(mw->file, 0, SEEK_SET) < 0) {  return 393; }
-
-  f_write32(mw, MThd);
-  f_write32(mw, 6);
-  f_write16(mw, format);
-  f_write16(mw, mw->trk_cnt);
-  f_write16(mw, mw->division);
-
-  if (fseek(mw->file, pos_cur, SEEK_SET) < 0) { return 394; }
+  if (!mw->hdr_out) {
+    f_header(mw, mw->trk_cnt);
+    if (!ret) ret = wbuf_out(mw, mw->buf, mw->buf_cnt);
+  }
+  else if (!ret && mw->trk_cnt != mw->trk_num) ret = 395;
 
-  fclose(mw->file);
+  if (mw->file && !ret && fflush(mw->file) != 0) ret = 381;
+  if (mw->own) fclose(mw->file);
+  if (mw->buf) free(mw->buf);
+#ifdef MF_STATS
+  if (st) stat_merge(st, &mw->stats);
+#endif
   free(mw);
 
   return ret;
 }
 
-int16_t mf_pitch_bend(mf_writer *mw, uint32_t delta, uint8_t chan, int16_t bend)
+int16_t mf_close(mf_writer *mw)
+{
+  return writer_close(mw, NULL);
+}
+
+int16_t mf_pitch_bend(mf_writer *mw, uint32_t delta, uint8_t chan, int16_t bend)
 {/* bend is in the range  -8192 .. 8191 */
 
   if (bend < -8192) bend = -8192;
@@ -598,9 +2093,102 @@ uint8_t mf_pitch_str(char *s)
 ** ******************************************* */
 
 
-mf_seq *mf_seq_new (char *fname, uint16_t division)
+/* == Memory
+**
+** The buffers of a sequence (buf, evt, sys) and the scratch areas used
+** for sorting are obtained through ms->alloc. By default it's a wrapper
+** around realloc()/free() but it can be replaced with mf_seq_set_alloc()
+** (e.g. with an arena) before anything is added to the sequence.
+**
+** mf_seq_reset() clears the sequence without releasing its memory so
+** that a sequence can be reused for many (short) songs without paying
+** for the allocations each time. For the same reason the scratch area
+** used by mf_seq_bytick() is kept unless it's larger than SEQ_KEEP_TMP.
+*/
+
+#define SEQ_KEEP_TMP (1024*1024)
+
+static void *seq_std_alloc(void *aux, void *ptr, size_t old_sz, size_t sz)
+{
+  if (sz == 0) { free(ptr); return NULL; }
+  return realloc(ptr, sz);
+}
+
+#define seq_alloc(ms,p,o,n) ((ms)->alloc((ms)->alloc_aux, p, o, n))
+
+#ifndef MF_NO_MMAP
+typedef struct {
+  void   *mem;
+  size_t  len;
+} seq_map;
+
+/* A sequence mapped from a snapshot (see mf_seq_snap_load()) never
+** reallocates or frees its arrays: they are unmapped on close. Any other
+** memory (a sorted copy of the events to write them) is allocated as
+** usual. */
+static void *seq_ro_alloc(void *aux, void *ptr, size_t old_sz, size_t sz)
+{
+  seq_map *map = aux;
+  uint8_t *p = ptr;
+
+  if (p >= (uint8_t *)map->mem && p < (uint8_t *)map->mem + map->len) return NULL;
+  return seq_std_alloc(NULL, ptr, old_sz, sz);
+}
+#endif
+
+/* Ensure there's room for n more elements (of size sz) in the array */
+static int16_t chkarr(mf_seq *ms, void **arr, uint32_t cnt, uint32_t *max, uint32_t n, uint32_t sz)
+{
+   uint32_t newsize;
+   void *a = NULL;
+
+   if (ms->flags & MF_READONLY) return 1;
+   if (n == 0) return 0;
+
+   newsize = *max;
+   if (newsize == 0) newsize = n+1;
+   
+   while (n >= (newsize - cnt))
+      newsize += newsize/2;
+
+   if (newsize > *max) {
+      a = seq_alloc(ms, *arr, (size_t)*max * sz, (size_t)newsize * sz);
+      if (!a) return 1;
+      *arr = a;
+      *max = newsize;
+   }
+   return 0;
+}
+
+static void seq_init(mf_seq *ms, char *fname, uint16_t division)
 {
   int16_t k;
+
+  ms->flags   &= MF_RUNNING_STATUS;
+  ms->buf_cnt  = 0;
+  ms->evt_cnt  = 0;
+  ms->sys_cnt  = 0;
+
+  ms->fname    = fname;
+  if (division == 0) division = (2*2*2*2)*(3*3)*5*7; /* 5040 */
+  ms->division = division;
+  ms->format   = -1;
+  ms->curtrack = 0;
+  for (k=0; k < MF_MAX_TRACKS;k++) {
+     ms->curtick[k]=0;
+     ms->curchan[k]=0;
+     ms->curvel[k]=80;
+     ms->curnote[k]=60;
+     ms->curdur[k] = mf_div_quarter(division);
+  }
+  for (k=0; k<MF_MAX_SAV; k++)
+     ms->savtick[k]=0;
+  ms->cursav = 0;
+  ms->curevt = MF_NO_EVENT;
+}
+
+mf_seq *mf_seq_new (char *fname, uint16_t division)
+{
   mf_seq *ms = NULL;
 
   ms = malloc(sizeof(mf_seq));
@@ -611,207 +2199,723 @@ mf_seq *mf_seq_new (char *fname, uint16_t division)
     
     ms->buf = NULL; ms->buf_cnt = 0; ms->buf_max = 0;
     ms->evt = NULL; ms->evt_cnt = 0; ms->evt_max = 0;
-
-    ms->fname    = fname;
-    if (division == 0) division = (2*2*2*2)*(3*3)*5*7; /* 5040 */
-    ms->division = division;
-    ms->curtrack = 0;
-    for (k=0; k < MF_MAX_TRACKS;k++) {
-       ms->curtick[k]=0;
-       ms->curchan[k]=0;
-       ms->curvel[k]=80;
-       ms->curnote[k]=60;
-       ms->curdur[k] = division;
-    }
-    for (k=0; k<MF_MAX_SAV; k++)
-       ms->savtick[k]=0;
-    ms->cursav = 0;
-    ms->curevt = MF_NO_EVENT;
+    ms->sys = NULL; ms->sys_cnt = 0; ms->sys_max = 0;
+    ms->tmp = NULL; ms->tmp_max = 0;
+
+    ms->nthreads  = 1;
+    ms->alloc     = seq_std_alloc;
+    ms->alloc_aux = NULL;
+    memset(&ms->stats, 0, sizeof(mf_stats));
+    seq_init(ms, fname, division);
   }
   return ms;
 }
 
-#define getlong(q)  ((q)[0] << 24 | (q)[1] << 16 | (q)[2] << 8 | (q)[3])
+int16_t mf_seq_reset(mf_seq *ms, char *fname, uint16_t division)
+{
+  if (!ms) return 709;
+  if (ms->flags & MF_READONLY) return 708;
+  seq_init(ms, fname, division);
+  return 0;
+}
 
-#if 0
-static void dmp_evts(mf_seq *ms)
+/* The allocator can only be changed while no memory is allocated */
+int16_t mf_seq_set_alloc(mf_seq *ms, mf_fn_alloc fn, void *aux)
 {
-  uint32_t k;
-  uint8_t *p;
-  int32_t l;
+  if (!ms) return 759;
+  if (ms->buf || ms->evt || ms->sys || ms->tmp || (ms->flags & MF_READONLY)) return 758;
+  ms->alloc     = fn ? fn  : seq_std_alloc;
+  ms->alloc_aux = fn ? aux : NULL;
+  return 0;
+}
+
+#define getlong(q)  ((uint32_t)(q)[0] << 24 | (q)[1] << 16 | (q)[2] << 8 | (q)[3])
+
+/* == Events representation
+**
+** Each event is a 64 bit word in ms->evt. From the most significant bit:
+**
+**    63     56 55                        24 23  21 20                0
+**   +---------+----------------------------+------+-------------------+
+**   |  track  |           tick             | class|      payload      |
+**   +---------+----------------------------+------+-------------------+
+**
+** The class identifies the status (see evt_ord below). For channel events
+** the payload holds the channel (4 bits) and the two data bytes (7 bits
+** each). For sysex and meta events (class 1) the payload is an index in
+** ms->sys that gives the offset in ms->buf of the record:
+**
+**   type (1 byte) aux (1 byte) len (4 bytes) data (len bytes)
+**
+** Since the upper 43 bits are the sort key, events can be sorted by
+** track, tick and status just sorting the words.
+*/
 
-  if (!ms) return;
+      /* Status Byte:   89ABCDEF */
+static char *evt_ord = "\0\6\7\5\4\3\2\1";
+      /* Sort order (NoteOff is always first!) */
 
+static uint8_t evt_st[] = {0x80, 0xF0, 0xE0, 0xD0, 0xC0, 0xB0, 0x90, 0xA0};
 
-  for (k=0; k< ms->evt_cnt; k++) {
-    p = ms->evt[k].p;
+#define evt_cls(x) (evt_ord[((x)>>4) & 0x07])
 
-    printf("%02X %02X%02X%02X%02X ", p[0], p[1],p[2],p[3],p[4]);
-    printf("%02X %02X ", p[5], p[6]);
+#define EVT_SYS      1
+#define EVT_MAX_SYS  MF_SEQ_MAX_SYS
 
-    if (p[5] < 0xF0) {
-      printf("%02X %02X", p[7], p[8]);
-    } else {
-      l = getlong(p+7);
-      printf("%08X ", l);
-      p = p+11;
-      /*printf("** %d **",l);*/
-       while (l--) printf("%02X", *p++);
+#define evt_word(trk,tick,st,pl) (((uint64_t)(trk) << 56) | ((uint64_t)(uint32_t)(tick) << 24) | \
+                                  ((uint64_t)evt_cls(st) << 21) | (pl))
+
+#define evt_track(w)  ((uint8_t)((w) >> 56))
+#define evt_tick(w)   ((uint32_t)((w) >> 24))
+#define evt_class(w)  ((uint8_t)(((w) >> 21) & 0x07))
+#define evt_status(w) (evt_st[evt_class(w)])
+#define evt_chan(w)   ((uint8_t)(((w) >> 14) & 0x0F))
+#define evt_data1(w)  ((uint8_t)(((w) >> 7) & 0x7F))
+#define evt_data2(w)  ((uint8_t)((w) & 0x7F))
+#define evt_sysidx(w) ((uint32_t)((w) & 0x1FFFFF))
+
+#define evt_key(w)    ((w) >> 21)
+
+/* == Sorting events
+**
+** The words are sorted on their upper 43 bits with a stable LSD radix sort
+** (11 bits per pass) that uses a scratch area allocated for each sort and
+** no global state, so that different sequences can be sorted at the same
+** time. Being stable, events with the same key keep the order in which
+** they have been added.
+*/
+
+#define SORT_BITS   11
+#define SORT_DIGITS  4
+#define SORT_RADIX  (1 << SORT_BITS)
+#define SORT_MASK   (SORT_RADIX - 1)
+#define SORT_SMALL  64
+
+#define sort_digit(w,d) ((uint32_t)(evt_key(w) >> ((d) * SORT_BITS)) & SORT_MASK)
+
+static int16_t evt_sort(mf_seq *ms, uint64_t *evt, uint32_t n)
+{
+  uint64_t *tmp, *src, *dst, *swp, w;
+  uint32_t *cnt;
+  uint32_t  i, j, pos, c;
+  size_t    sz;
+  int16_t   d, sorted = 1;
+
+  if (n < 2) return 0;
+
+  for (i=1; i<n && sorted; i++)
+    if (evt_key(evt[i]) < evt_key(evt[i-1])) sorted = 0;
+
+  if (sorted) return 0;
+
+  if (n < SORT_SMALL) {  /* Insertion sort is enough */
+    for (i=1; i<n; i++) {
+      w = evt[i];
+      for (j=i; j>0 && evt_key(evt[j-1]) > evt_key(w); j--)
+        evt[j] = evt[j-1];
+      evt[j] = w;
     }
-    printf("\n");
+    return 0;
   }
-}
-#endif
 
-      /* Status Byte:   89ABCDEF */
-static char *evt_ord = "71023456";
-      /* Sort order (NoteOff is always first!) */
+  sz  = n * sizeof(uint64_t) + SORT_DIGITS * SORT_RADIX * sizeof(uint32_t);
+  tmp = seq_alloc(ms, NULL, 0, sz);
+  if (!tmp) return 815;
 
-#define evt_cmp_st(x) (evt_ord[((x)>>4) & 0x07])
+  cnt = (uint32_t *)(tmp + n);
+  memset(cnt, 0, SORT_DIGITS * SORT_RADIX * sizeof(uint32_t));
 
-static uint8_t *evt_base;
-static int evt_cmp_bytrack(const void *a, const void *b)
-{
-  int      ret = 0;
-  uint8_t *pa = evt_base + *((uint32_t *)a);
-  uint8_t *pb = evt_base + *((uint32_t *)b);
+  for (i=0; i<n; i++) {
+    for (d=0; d < SORT_DIGITS; d++)
+      cnt[d * SORT_RADIX + sort_digit(evt[i],d)]++;
+  }
+
+  src = evt; dst = tmp;
+  for (d=0; d < SORT_DIGITS; d++) {
+    uint32_t *h = cnt + d * SORT_RADIX;
 
-  /* This works only because we represented ticks in a special way*/
-  if (!(ret = pa[0]-pb[0]))
-  if (!(ret = pa[1]-pb[1]))
-  if (!(ret = pa[2]-pb[2]))
-  if (!(ret = pa[3]-pb[3]))
-  if (!(ret = pa[4]-pb[4])) {
-    ret = evt_cmp_st(pb[5]) - evt_cmp_st(pa[5]);  
+    /* Skip the digits that are the same for all the keys */
+    if (h[sort_digit(src[0],d)] == n) continue;
+
+    for (pos=0, j=0; j < SORT_RADIX; j++) {
+      c = h[j]; h[j] = pos; pos += c;
+    }
+    for (i=0; i<n; i++)
+      dst[h[sort_digit(src[i],d)]++] = src[i];
+
+    swp = src; src = dst; dst = swp;
   }
-  
-  return ret;
+
+  if (src != evt) memcpy(evt, src, n * sizeof(uint64_t));
+  seq_alloc(ms, tmp, sz, 0);
+  return 0;
 }
 
 int16_t mf_seq_bytrack(mf_seq *ms)
 {
+  int16_t ret = 0;
+  stat_time(t0);
 
-  /*
-  dbgmsg("Events: %d\n", ms->evt_cnt);
-  dmp_evts(ms);
-  */
   if (!ms) return 814;
 
-  evt_base = ms->buf;
-  qsort(ms->evt, ms->evt_cnt,sizeof(uint32_t), evt_cmp_bytrack);
+  if (ms->flags & MF_SORTED_BYTRACK) return 0;
+  if (ms->flags & MF_READONLY) return 813;
+
+  ret = evt_sort(ms, ms->evt, ms->evt_cnt);
+  stat_span(&ms->stats, ns_sort, t0);
+  stat_trace("sort by track", ms->evt_cnt, 0, t0);
+  if (ret) return ret;
+
   ms->flags &= ~(MF_SORTED_BYTICK | MF_SORTED_BYTRACK);
   ms->flags |= MF_SORTED_BYTRACK;
 
-  /*
-  dbgmsg("Events: %d\n", ms->evt_cnt);
-  dmp_evts(ms);
-  */
   return 0;
 }
 
-uint8_t *mf_evt_first(mf_seq *ms)
+/* == Sorting by tick
+**
+** Events are usually added in (almost) sorted order within each track.
+** The events are first grouped by track (this is a no-op if they are
+** already sorted by track) and each track that is not in order is sorted
+** on its own. The sorted runs are then merged with a binary heap keyed
+** by tick, order class and track.
+*/
+
+#define run_key(w,t) (((evt_key(w) & 0x7FFFFFFFFULL) << 8) | (t))
+
+static void heap_down(uint64_t *heap, int16_t n, int16_t k)
+{
+  uint64_t x = heap[k];
+  int16_t  c;
+
+  while ((c = 2*k+1) < n) {
+    if (c+1 < n && heap[c+1] < heap[c]) c++;
+    if (x <= heap[c]) break;
+    heap[k] = heap[c];
+    k = c;
+  }
+  heap[k] = x;
+}
+
+int16_t mf_seq_bytick(mf_seq *ms)
+{
+  uint32_t  run_beg[256];
+  uint32_t  run_end[256];
+  uint64_t  heap[256];
+  uint64_t *tmp;
+  uint32_t  k, n, pos, c;
+  int16_t   t, nheap, ret = 0;
+  stat_time(t0);
+
+  if (!ms) return 816;
+  if (ms->flags & MF_SORTED_BYTICK) return 0;
+  if (ms->flags & MF_READONLY) return 818;
+
+  n = ms->evt_cnt;
+
+  if (chkarr(ms, (void **)&ms->tmp, 0, &ms->tmp_max, n+1, sizeof(uint64_t))) return 817;
+  tmp = ms->tmp;
+
+  /* Group events by track (stable) */
+  for (t=0; t<256; t++) run_beg[t] = 0;
+  for (k=0; k<n; k++) run_beg[evt_track(ms->evt[k])]++;
+  for (pos=0, t=0; t<256; t++) {
+    c = run_beg[t]; run_beg[t] = run_end[t] = pos; pos += c;
+  }
+  for (k=0; k<n; k++) tmp[run_end[evt_track(ms->evt[k])]++] = ms->evt[k];
+
+  /* Sort the runs that are not in order */
+  if (!(ms->flags & MF_SORTED_BYTRACK)) {
+    for (t=0; t<256 && !ret; t++)
+      ret = evt_sort(ms, tmp+run_beg[t], run_end[t]-run_beg[t]);
+  }
+
+  /* k-way merge */
+  if (!ret) {
+    nheap = 0;
+    for (t=0; t<256; t++)
+      if (run_beg[t] < run_end[t]) heap[nheap++] = run_key(tmp[run_beg[t]], t);
+
+    for (t=nheap/2-1; t>=0; t--) heap_down(heap, nheap, t);
+
+    k = 0;
+    while (nheap > 0) {
+      t = heap[0] & 0xFF;
+      ms->evt[k++] = tmp[run_beg[t]++];
+      if (run_beg[t] < run_end[t]) heap[0] = run_key(tmp[run_beg[t]], t);
+      else heap[0] = heap[--nheap];
+      heap_down(heap, nheap, 0);
+    }
+
+    ms->flags &= ~(MF_SORTED_BYTICK | MF_SORTED_BYTRACK);
+    ms->flags |= MF_SORTED_BYTICK;
+  }
+
+  if ((size_t)ms->tmp_max * sizeof(uint64_t) > SEQ_KEEP_TMP) {
+    seq_alloc(ms, ms->tmp, (size_t)ms->tmp_max * sizeof(uint64_t), 0);
+    ms->tmp = NULL; ms->tmp_max = 0;
+  }
+  stat_span(&ms->stats, ns_sort, t0);
+  stat_trace("sort by tick", n, 0, t0);
+  return ret;
+}
+
+/* == Events view
+**
+** Events are decoded from their internal representation in a read only
+** view (mf_evt). Data of sysex and meta events is not copied: it points
+** directly into the sequence buffer.
+*/
+
+static mf_evt *evt_decode(mf_seq *ms, uint32_t n, mf_evt *e)
+{
+  uint64_t w = ms->evt[n];
+  uint8_t *p;
+
+  e->track  = evt_track(w);
+  e->tick   = evt_tick(w);
+  if (evt_class(w) != EVT_SYS) {
+    e->status = evt_status(w);
+    e->chan   = evt_chan(w);
+    e->data1  = evt_data1(w);
+    e->data2  = evt_data2(w);
+    e->len    = 0;
+    e->data   = NULL;
+  }
+  else {
+    p = ms->buf + ms->sys[evt_sysidx(w)];
+    e->status = p[0];
+    e->chan   = p[1];
+    e->data1  = 0;
+    e->data2  = 0;
+    e->len    = getlong(p+2);
+    e->data   = p+6;
+  }
+  return e;
+}
+
+int16_t mf_evt_get(mf_seq *ms, uint32_t n, mf_evt *e)
+{
+  if (!ms || !e) return 829;
+  if (n >= ms->evt_cnt) return 828;
+  evt_decode(ms, n, e);
+  return 0;
+}
+
+/* Decode up to n events (starting from the first one) into the arrays of
+** the batch (that must have room for n elements).
+** Returns the number of decoded events.
+*/
+uint32_t mf_evt_batch(mf_seq *ms, uint32_t first, uint32_t n, mf_evt_soa *b)
+{
+  uint32_t k;
+  uint64_t w;
+  uint8_t *p;
+
+  if (!ms || !b || first >= ms->evt_cnt) return 0;
+  if (n > ms->evt_cnt - first) n = ms->evt_cnt - first;
+
+  for (k=0; k<n; k++) {
+    w = ms->evt[first+k];
+    b->tick[k]  = evt_tick(w);
+    b->track[k] = evt_track(w);
+    if (evt_class(w) != EVT_SYS) {
+      b->status[k] = evt_status(w);
+      b->chan[k]   = evt_chan(w);
+      b->data1[k]  = evt_data1(w);
+      b->data2[k]  = evt_data2(w);
+    }
+    else {
+      p = ms->buf + ms->sys[evt_sysidx(w)];
+      b->status[k] = p[0];
+      b->chan[k]   = p[1];
+      b->data1[k]  = 0;
+      b->data2[k]  = 0;
+    }
+  }
+  b->cnt = n;
+  return n;
+}
+
+mf_evt *mf_evt_first(mf_seq *ms)
 {
-  if (!ms || !mf_seq_sorted(ms) || ms->evt_cnt == 0) {
+  if (!ms) return NULL;
+  if (!mf_seq_sorted(ms) || ms->evt_cnt == 0) {
     ms->curevt = MF_NO_EVENT;
     return NULL;
   }
   ms->curevt=0;
-  return ms->buf+ms->evt[ms->curevt];
+  return evt_decode(ms, ms->curevt, &ms->view);
 }
 
-uint8_t *mf_evt_next(mf_seq *ms)
+mf_evt *mf_evt_next(mf_seq *ms)
 {
-  if (!ms || !mf_seq_sorted(ms) || ms->evt_cnt == 0 ||
+  if (!ms) return NULL;
+  if (!mf_seq_sorted(ms) || ms->evt_cnt == 0 ||
       (ms->curevt+1) >= ms->evt_cnt || ms->curevt == MF_NO_EVENT) {
     ms->curevt = MF_NO_EVENT;
     return NULL;
   }
   ms->curevt++;
-  return ms->buf+ms->evt[ms->curevt];
+  return evt_decode(ms, ms->curevt, &ms->view);
 }
 
-uint8_t *mf_evt_prev(mf_seq *ms)
+mf_evt *mf_evt_prev(mf_seq *ms)
 {
-  if (!ms || !mf_seq_sorted(ms) || ms->evt_cnt == 0 ||
+  if (!ms) return NULL;
+  if (!mf_seq_sorted(ms) || ms->evt_cnt == 0 ||
       ms->curevt == 0 || ms->curevt == MF_NO_EVENT) {
     ms->curevt = MF_NO_EVENT;
     return NULL;
   }
   ms->curevt--;
-  return ms->buf+ms->evt[ms->curevt];
+  return evt_decode(ms, ms->curevt, &ms->view);
 }
 
 uint32_t mf_evt_count(mf_seq *ms)
 {  return (ms?ms->evt_cnt:0); }
 
-uint8_t mf_evt_track(uint8_t *e)
-{ return e?*e:0; }
+/* == Writing the sequence
+**
+** Tracks are independent, so each of them can be encoded in its own
+** memory buffer on a different thread (see mf_seq_set_threads()).
+** The buffers are then written in track order.
+**
+** Writing doesn't consume the sequence (it's only sorted by track), so
+** it can be saved to ms->fname with mf_seq_save() or rendered to memory
+** with mf_seq_render() as many times as needed, possibly selecting a
+** subset of the tracks. mf_seq_close() only releases the sequence.
+*/
 
-uint32_t mf_evt_tick(uint8_t *e)
-{ return e?getlong(e+1):0;}
+static int16_t seq_encode(mf_seq *ms, mf_writer *mw, uint32_t beg, uint32_t end, int16_t thread)
+{
+  uint32_t tick = 0;
+  uint32_t delta;
+  uint32_t k;
+  int16_t  ret;
+  mf_evt   e;
+  stat_time(t0);
+
+  ret = mf_track_start(mw);
+  for (k = beg; k < end && !ret; k++) {
+    evt_decode(ms, k, &e);
+    delta = e.tick - tick;
+    _dbgmsg("DELTA: (%d-%d) = %d\n", e.tick,tick,delta);
+    tick = e.tick;
+    if (mf_evt_is_midi(&e)) {
+      ret = mf_midi_evt(mw, delta, e.status, e.chan, e.data1, e.data2);
+    } else {
+      ret = mf_sys_evt(mw, delta, e.status, e.chan, e.len, (uint8_t *)e.data);
+    }
+  }
+  if (!ret) ret = mf_track_end(mw);
+  stat_trace("encode track", evt_track(ms->evt[beg]), thread, t0);
+  return ret;
+}
 
-uint8_t *mf_evt_data(uint8_t *e)
-{ return e? e+5: NULL;}
+typedef struct {
+  mf_seq     *ms;
+  mf_writer **trk;
+  uint32_t   *beg;
+  uint32_t   *end;
+  int16_t    *err;
+} seq_jobs;
 
-uint32_t mf_evt_status(uint8_t *e)
-{ return e? e[5] & 0xF0:0;}
+static void seq_encode_job(void *arg, uint32_t job, int16_t thread)
+{
+  seq_jobs *sj = arg;
 
-uint32_t mf_evt_channel(uint8_t *e)
-{ return e? e[5] & 0x0F:0;}
+  sj->err[job] = seq_encode(sj->ms, sj->trk[job], sj->beg[job], sj->end[job], thread);
+}
 
-int16_t mf_seq_close(mf_seq *ms)
+static int16_t seq_encode_mt(mf_seq *ms, mf_writer *mw, uint32_t *beg, uint32_t *end, int16_t ntrk)
 {
-  int16_t  k;
-  int16_t  trk = -1;
-  uint32_t tick=0;
-  uint32_t delta;
-  uint32_t nxtk;
-  uint8_t *p;
-  uint8_t *d;
+  seq_jobs  sj;
+  int16_t   k, ret = 0;
 
-  mf_writer *mw;
+  sj.ms  = ms;
+  sj.beg = beg;
+  sj.end = end;
+  sj.trk = calloc(ntrk, sizeof(mf_writer *));
+  sj.err = calloc(ntrk, sizeof(int16_t));
 
-  if (!ms) return 799;
+  if (!sj.trk || !sj.err) ret = 798;
+
+  for (k=0; k<ntrk && !ret; k++) {
+    sj.trk[k] = writer_init(NULL, NULL, NULL, ms->division);
+    if (!sj.trk[k]) ret = 798;
+    else sj.trk[k]->flags = mw->flags;
+  }
+
+  if (!ret) run_jobs(seq_encode_job, &sj, ntrk, ms->nthreads);
+
+  for (k=0; k<ntrk && !ret; k++) {
+    ret = sj.err[k];
+    if (!ret) ret = writer_add_track(mw, sj.trk[k]);
+  }
+
+  for (k=0; sj.trk && k<ntrk; k++) {
+    if (sj.trk[k]) {
+      if (sj.trk[k]->buf) free(sj.trk[k]->buf);
+      free(sj.trk[k]);
+    }
+  }
+  if (sj.trk) free(sj.trk);
+  if (sj.err) free(sj.err);
+  return ret;
+}
+
+int16_t mf_seq_set_threads(mf_seq *ms, int16_t nthreads)
+{
+  if (!ms) return 797;
+  if (nthreads < 1) nthreads = 1;
+  ms->nthreads = nthreads;
+  return 0;
+}
+
+/* Format of the file to write. In format 2 each track is a pattern on
+** its own; format 0 requires the events to be in a single track.
+*/
+int16_t mf_seq_set_format(mf_seq *ms, int16_t format)
+{
+  if (!ms) return 718;
+  if (format < -1 || format > 2) return 717;
+  ms->format = format;
+  return 0;
+}
+
+static void seq_free(mf_seq *ms)
+{
+  if (ms->buf) seq_alloc(ms, ms->buf, ms->buf_max, 0);
+  if (ms->evt) seq_alloc(ms, ms->evt, (size_t)ms->evt_max * sizeof(uint64_t), 0);
+  if (ms->sys) seq_alloc(ms, ms->sys, (size_t)ms->sys_max * sizeof(uint32_t), 0);
+  if (ms->tmp) seq_alloc(ms, ms->tmp, (size_t)ms->tmp_max * sizeof(uint64_t), 0);
+  free(ms);
+}
 
-  mf_seq_bytrack(ms);
+/* A read only sequence can't be sorted in place: if it's not sorted by
+** track it's written from a sorted copy of its events. The mapped array
+** is saved in *ro and put back by seq_wr_done().
+*/
+static int16_t seq_wr_sort(mf_seq *ms, uint64_t **ro)
+{
+  uint64_t *evt;
+  size_t    sz;
+  int16_t   ret;
+
+  *ro = NULL;
+  if (!(ms->flags & MF_READONLY)) return mf_seq_bytrack(ms);
+  if ((ms->flags & MF_SORTED_BYTRACK) || ms->evt_cnt < 2) return 0;
+
+  sz  = (size_t)ms->evt_cnt * sizeof(uint64_t);
+  evt = seq_alloc(ms, NULL, 0, sz);
+  if (!evt) return 815;
+  memcpy(evt, ms->evt, sz);
+  ret = evt_sort(ms, evt, ms->evt_cnt);
+  if (ret) { seq_alloc(ms, evt, sz, 0); return ret; }
+
+  *ro = ms->evt;
+  ms->evt = evt;
+  return 0;
+}
 
-  mw = mf_new(ms->fname, ms->division);
+static void seq_wr_done(mf_seq *ms, uint64_t *ro)
+{
+  if (!ro) return;
+  seq_alloc(ms, ms->evt, (size_t)ms->evt_cnt * sizeof(uint64_t), 0);
+  ms->evt = ro;
+}
 
-  if (mw) {
+/* Find the tracks listed in tracks (all of them if NULL) in that order.
+** Tracks with no events are skipped. The sequence must be sorted by track.
+** This is done before creating the file, so that nothing is written if
+** the tracks can't be.
+*/
+static int16_t seq_tracks(mf_seq *ms, uint8_t *tracks, int16_t ntracks,
+                          uint32_t *beg, uint32_t *end, int16_t *ntrk)
+{
+  uint32_t trk_beg[256], trk_end[256];
+  uint32_t k;
+  int16_t  t;
+
+  *ntrk = 0;
+  if (!tracks) ntracks = 256;
+  if (ntracks < 0 || ntracks > 256) return 727;
+
+  /* Find where each track begins and ends */
+  for (t=0; t<256; t++) trk_beg[t] = trk_end[t] = 0;
+  for (k=0; k < ms->evt_cnt; k++) {
+    t = evt_track(ms->evt[k]);
+    if (k == 0 || t != evt_track(ms->evt[k-1])) trk_beg[t] = k;
+    trk_end[t] = k+1;
+  }
 
-    if (mf_evt_count(ms) == 0) {
-         mf_track_start(mw);
-         mf_sys_evt(mw, 0, mf_st_meta_event, mf_me_text, 5, (uint8_t *)"Empty");
+  for (k=0; k < (uint32_t)ntracks; k++) {
+    t = tracks ? tracks[k] : k;
+    if (trk_beg[t] < trk_end[t]) {
+      beg[*ntrk] = trk_beg[t]; end[*ntrk] = trk_end[t]; (*ntrk)++;
     }
-    else for (p = mf_evt_first(ms); p ; p=mf_evt_next(ms)) {
-       // p = ms->buf+ms->evt[k];
-
-       if (mf_evt_track(p) != trk) {  /* Start a new track */
-         mf_track_start(mw);
-         trk = mf_evt_track(p);
-         tick = 0;
-       }
-
-       nxtk = mf_evt_tick(p);
-       delta = nxtk - tick;
-       _dbgmsg("DELTA: (%d-%d) = %d\n", nxtk,tick,delta);
-       tick = nxtk;
-       d = mf_evt_data(p);
-       if (d && mf_evt_status(p) < 0xF0) {
-         mf_midi_evt(mw, delta, d[0], d[1], d[2],d[3]);
-       } else {
-         mf_sys_evt(mw, delta, d[0], d[1], getlong(d+2), d+6);
-       }
+  }
+
+  if (ms->format == 0 && *ntrk > 1) return 723;
+  return 0;
+}
+
+/* Write the tracks found by seq_tracks() */
+static int16_t seq_write(mf_seq *ms, mf_writer *mw, uint32_t *beg, uint32_t *end, int16_t ntrk)
+{
+  int16_t  t;
+  int16_t  ret = 0;
+  stat_time(t0);
+
+  if (ms->flags & MF_RUNNING_STATUS) mf_set_running(mw, 1);
+
+  ret = mf_set_format(mw, ms->format);
+  if (ret) return ret;
+
+  /* Tracks are streamed out as soon as they are completed */
+  mf_set_ntracks(mw, ntrk > 0 ? ntrk : 1);
+
+  if (ntrk == 0) {
+    ret = mf_track_start(mw);
+    if (!ret) ret = mf_sys_evt(mw, 0, mf_st_meta_event, mf_me_text, 5, (uint8_t *)"Empty");
+  }
+  else if (ms->nthreads > 1 && ntrk > 1) {
+    ret = seq_encode_mt(ms, mw, beg, end, ntrk);
+  }
+  else {
+    for (t=0; t < ntrk && !ret; t++)
+      ret = seq_encode(ms, mw, beg[t], end[t], 0);
+  }
+  stat_span(&ms->stats, ns_encode, t0);
+  return ret;
+}
+
+int16_t mf_seq_save(mf_seq *ms)
+{
+  uint32_t   beg[256], end[256];
+  uint64_t  *ro;
+  mf_writer *mw;
+  int16_t    ntrk;
+  int16_t    ret, err;
+
+  if (!ms) return 729;
+  if (!ms->fname) return 726;
+
+  ret = seq_wr_sort(ms, &ro);
+  if (ret) return ret;
+
+  ret = seq_tracks(ms, NULL, 0, beg, end, &ntrk);
+  if (!ret) {
+    mw = mf_new(ms->fname, ms->division);
+    if (!mw) ret = 725;
+    else {
+      ret = seq_write(ms, mw, beg, end, ntrk);
+      err = writer_close(mw, &ms->stats);
+      if (!ret) ret = err;
     }
+  }
+  seq_wr_done(ms, ro);
+  return ret;
+}
 
-    mf_close(mw);
+typedef struct {
+  uint8_t *buf;
+  uint32_t cnt;
+  uint32_t max;
+  int16_t  own;  /* 1: buf is allocated (and grown) by the library */
+} seq_render;
+
+/* If the caller's buffer is too small the output is only counted */
+static int16_t render_sink(void *aux, uint8_t *data, uint32_t len)
+{
+  seq_render *rs = aux;
+  uint32_t    newsize;
+  uint8_t    *buf;
+
+  if (len > UINT32_MAX - rs->cnt) return 1;
+
+  if (rs->cnt + len > rs->max && rs->own) {
+    newsize = rs->max + rs->max/2;
+    if (newsize < rs->cnt + len) newsize = rs->cnt + len;
+    buf = realloc(rs->buf, newsize);
+    if (!buf) return 1;
+    rs->buf = buf;
+    rs->max = newsize;
   }
 
-  /* Clean up */
-  if (ms->buf) free(ms->buf);
-  if (ms->evt) free(ms->evt);
-  free(ms);
+  if (rs->cnt + len <= rs->max) memcpy(rs->buf + rs->cnt, data, len);
+  rs->cnt += len;
+  return 0;
+}
+
+/* Render the sequence in memory. If *buf is NULL, a buffer is allocated
+** (to be released with free()), otherwise *buf must have room for *len
+** bytes. On return *len is the size of the file; if it doesn't fit in the
+** caller's buffer, 728 is returned and *len is the size needed.
+*/
+int16_t mf_seq_render(mf_seq *ms, uint8_t *tracks, int16_t ntracks, uint8_t **buf, uint32_t *len)
+{
+  uint32_t   beg[256], end[256];
+  uint64_t  *ro;
+  seq_render rs;
+  mf_writer *mw;
+  int16_t    ntrk;
+  int16_t    ret, err;
+
+  if (!ms || !buf || !len) return 729;
+
+  ret = seq_wr_sort(ms, &ro);
+  if (ret) return ret;
+  ret = seq_tracks(ms, tracks, ntracks, beg, end, &ntrk);
+  if (ret) { seq_wr_done(ms, ro); return ret; }
+
+  rs.buf = *buf;
+  rs.cnt = 0;
+  rs.max = *buf ? *len : 0;
+  rs.own = (*buf == NULL);
+
+  if (rs.own) {
+    /* Rough guess: four bytes for each channel event */
+    rs.max = MF_HDR_LEN + 8 + ms->buf_cnt + 4 * ms->evt_cnt;
+    rs.buf = malloc(rs.max);
+    if (!rs.buf) { seq_wr_done(ms, ro); return 724; }
+  }
+
+  mw = mf_new_sink(render_sink, &rs, ms->division);
+  if (!mw) ret = 724;
+  else {
+    ret = seq_write(ms, mw, beg, end, ntrk);
+    err = writer_close(mw, &ms->stats);
+    if (!ret) ret = err;
+  }
+  seq_wr_done(ms, ro);
 
+  if (!ret && rs.cnt > rs.max) ret = 728;
+  if (ret && rs.own) { free(rs.buf); rs.buf = NULL; }
+
+  if (rs.own) *buf = rs.buf;
+  *len = (ret && ret != 728) ? 0 : rs.cnt;
+  return ret;
+}
+
+int16_t mf_seq_close(mf_seq *ms)
+{
+#ifndef MF_NO_MMAP
+  seq_map *map = NULL;
+#endif
+
+  if (!ms) return 799;
+#ifndef MF_NO_MMAP
+  if (ms->flags & MF_READONLY) map = ms->alloc_aux;
+#endif
+  seq_free(ms);  /* the mapped arrays are left to munmap() */
+#ifndef MF_NO_MMAP
+  if (map) {
+    munmap(map->mem, map->len);
+    free(map);
+  }
+#endif
   return 0;
 }
 
@@ -832,7 +2936,7 @@ static int16_t chkbuf(mf_seq *ms, uint32_t spc)
       newsize += (newsize /2);
 
    if (newsize > ms->buf_max) {
-      buf = realloc(ms->buf, newsize);
+      buf = seq_alloc(ms, ms->buf, ms->buf_max, newsize);
       if (!buf) return 730;
       ms->buf = buf;
       ms->buf_max = newsize;
@@ -844,30 +2948,28 @@ static int16_t chkbuf(mf_seq *ms, uint32_t spc)
 
 static int16_t chkevt(mf_seq *ms, uint32_t n)
 {
-   uint32_t newsize;
-   uint32_t *evt = NULL;
-
    if (!ms) return 749;
-   if (n == 0) return 0;
-
    _dbgmsg("CHKEVT(: evt:%p cnt:%d max:%d need:%d\n", ms->evt, ms->evt_cnt, ms->evt_max,n);
-   newsize = ms->evt_max;
-   if (newsize == 0) newsize = n+1;
-   
-   while (n >= (newsize - ms->evt_cnt))
-      newsize += newsize/2;
-
-   if (newsize > ms->evt_max) {
-      evt = realloc(ms->evt, newsize * sizeof(uint32_t));
-      if (!evt) return 740;
-      ms->evt = evt;
-      ms->evt_max = newsize;
-   }
+   if (chkarr(ms, (void **)&ms->evt, ms->evt_cnt, &ms->evt_max, n, sizeof(uint64_t))) return 740;
+   return 0;
+}
 
-   _dbgmsg("CHKEVT): evt:%p cnt:%d max:%d need:%d\n", ms->evt, ms->evt_cnt, ms->evt_max,n);
+static int16_t chksys(mf_seq *ms, uint32_t n)
+{
+   if (!ms) return 748;
+   if (ms->sys_cnt + n > EVT_MAX_SYS) return 747;
+   if (chkarr(ms, (void **)&ms->sys, ms->sys_cnt, &ms->sys_max, n, sizeof(uint32_t))) return 746;
    return 0;
 }
 
+/* Make room for nevt more events and nbytes of sysex/meta data */
+int16_t mf_seq_reserve(mf_seq *ms, uint32_t nevt, uint32_t nbytes)
+{
+  if (!ms) return 779;
+  if (chkevt(ms, nevt) || chkbuf(ms, nbytes)) return 778;
+  return 0;
+}
+
 int16_t mf_seq_set_track(mf_seq *ms, int16_t track)
 {
   if (!ms) return 719;
@@ -889,15 +2991,15 @@ int16_t mf_seq_track(mf_seq *ms, uint16_t track)
 }
 
 
-#define add_evt(ms)    (ms->evt[ms->evt_cnt++] = ms->buf_cnt)
+#define add_evt(ms,w)  (ms->flags &= ~(MF_SORTED_BYTICK | MF_SORTED_BYTRACK), \
+                        ms->evt[ms->evt_cnt++] = (w))
 #define add_byte(ms,b) (ms->buf[ms->buf_cnt++] = (uint8_t)(b))
 
 static void add_data(mf_seq *ms, int32_t l, uint8_t *d)
-{  if (ms) while (l--) add_byte(ms,*d++); }
+{  if (ms && l > 0) { memcpy(ms->buf+ms->buf_cnt, d, l); ms->buf_cnt += l; } }
 
 /* this forces the 32 bit number 0xFE12AB34 to be stored as a sequence of four
-   bytes {0xFE,0x12,0xAB,0x23} rather than according the CPU representations.
-   This is used when sorting the array of the events. */
+   bytes {0xFE,0x12,0xAB,0x23} rather than according the CPU representations. */
 static void add_ulong(mf_seq *ms, uint32_t l)
 {
   add_byte(ms,(l >>24) & 0xFF);
@@ -906,14 +3008,7 @@ static void add_ulong(mf_seq *ms, uint32_t l)
   add_byte(ms,(l     ) & 0xFF);
 }
 
-/*
-static void add_str(mf_seq *ms, char *s)
-{
-  add_data(ms,strlen(s),(uint8_t *)s);
-}
-*/
-
-int16_t mf_seq_evt (mf_seq *ms, uint32_t tick, uint16_t type, uint16_t chan, uint16_t data1, uint16_t data2)
+int16_t mf_seq_evt (mf_seq *ms, uint32_t tick, uint16_t type, uint16_t chan, uint16_t data1, uint16_t data2)
 {
   int16_t ret = 0;
 
@@ -921,20 +3016,14 @@ int16_t mf_seq_evt (mf_seq *ms, uint32_t tick, uint16_t type, uint16_t chan, uin
   _dbgmsg("SEQ EVT\n");
 
   if (!ms)  ret = 759;
-  if (!ret) ret = chkbuf(ms,32);
   if (!ret) ret = chkevt(ms,1);
   if (!ret) ret = type == 0xF0 ? 758 : 0;  /* no meta! */
+  if (!ret) ret = type < 0x80 ? 757 : 0;
   
   if (!ret) {
-    add_evt(ms);
-
-    add_byte(ms, ms->curtrack);
-    add_ulong(ms,tick);
-    ms->curtick[ms->curtrack] = tick;
-
     chan  &= 0x0F;
-    data1 &= 0xFF;
-    data2 &= 0xFF;
+    data1 &= 0x7F;
+    data2 &= 0x7F;
 
     if (type == mf_st_note_on) {
       if (data2 == 0) type = mf_st_note_off;
@@ -944,31 +3033,24 @@ int16_t mf_seq_evt (mf_seq *ms, uint32_t tick, uint16_t type, uint16_t chan, uin
       }
     }
 
-    add_byte(ms, type );
-    add_byte(ms, chan );
-    add_byte(ms, data1);
-    add_byte(ms, data2);
+    add_evt(ms, evt_word(ms->curtrack, tick, type, (chan << 14) | (data1 << 7) | data2));
+    ms->curtick[ms->curtrack] = tick;
   }
   return ret;
 }
 
-int16_t mf_seq_sys(mf_seq *ms, uint32_t tick, uint16_t type, uint16_t aux,
-                                               int32_t len, uint8_t *data)
+static int16_t add_sys(mf_seq *ms, uint32_t tick, uint16_t type, uint16_t aux,
+                                              int32_t len, uint8_t *data)
 {
   int16_t ret = 0;
 
-  if (!ms)  ret = 779;
-  if (len < 0) len = strlen(data);
-  if (!ret) ret = chkbuf(ms,32+len);
+  ret = chkbuf(ms,8+len);
   if (!ret) ret = chkevt(ms,1);
-  if (!ret) ret = (type >= 0xF0) ? 0 : 778;
+  if (!ret) ret = chksys(ms,1);
   if (!ret) {
     _dbgmsg("SEQSYS: %d %d\n",ms->curtrack, type);
-    add_evt(ms);
-
-    add_byte(ms, ms->curtrack);
-    add_ulong(ms,tick);
-    ms->curtick[ms->curtrack] = tick;
+    add_evt(ms, evt_word(ms->curtrack, tick, 0xF0, ms->sys_cnt));
+    ms->sys[ms->sys_cnt++] = ms->buf_cnt;
 
     add_byte(ms,type);
     add_byte(ms,aux);
@@ -976,6 +3058,19 @@ int16_t mf_seq_sys(mf_seq *ms, uint32_t tick, uint16_t type, uint16_t aux,
     add_ulong(ms,len);
     add_data(ms,len,data);
   }
+  return ret;
+}
+
+int16_t mf_seq_sys(mf_seq *ms, uint32_t tick, uint16_t type, uint16_t aux,
+                                               int32_t len, uint8_t *data)
+{
+  int16_t ret = 0;
+
+  if (!ms)  ret = 779;
+  if (len < 0) len = strlen((char *)data);
+  if (!ret) ret = (type >= 0xF0) ? 0 : 778;
+  if (!ret) ret = add_sys(ms, tick, type, aux, len, data);
+  if (!ret) ms->curtick[ms->curtrack] = tick;
 
   return ret;
 }
@@ -1110,3 +3205,1044 @@ uint32_t mf_seq_tick(mf_seq *ms, uint32_t mrk, uint32_t tick)
 }
 
 
+
+/* == Loading a file
+**
+** mf_seq_load() decodes a whole MIDI file into a sequence. The file is
+** memory mapped and room for the events is reserved upfront from the
+** length of the file (or of each track chunk), so that channel events
+** are appended with a single bound check instead of mf_seq_evt().
+** The first sysex or meta event that doesn't fit in buf reserves room for
+** the rest of its track chunk: the data of the track can't be longer.
+** Both reservations are upper bounds (a long sysex holds no events, a
+** track of notes has no data) and what is left unused is given back at
+** the end of the load.
+**
+** Tracks 1..n of the file become tracks 0..n-1 of the sequence and
+** events keep the order they have in the file. A note on with velocity 0
+** is stored as a note off, as mf_seq_evt() does. If the sequence was empty
+** and the file order is also the order of the sort key (events at the
+** same tick of a track are in class order: e.g. note offs before note
+** ons) it is marked as sorted by track: mf_seq_close() will not sort it
+** again and writes the tracks back as they were. Otherwise it will be
+** sorted as any other sequence. End of track events are not
+** stored (mf_seq_close() adds them) and the division and the format are
+** taken from the file.
+**
+** If more threads have been set with mf_seq_set_threads(), each track is
+** decoded in a sequence of its own by mf_scan_mt() and then copied in
+** place. Those sequences are filled concurrently and use the standard
+** allocator: the one set with mf_seq_set_alloc() is only called, from
+** the calling thread, for the sequence being loaded.
+*/
+
+#define LOAD_BYTES_PER_EVT 3  /* channel message with running status */
+
+typedef struct {
+  mf_seq  *ms;
+  mf_seq **trk;   /* a sequence for each track (parallel decoding) */
+  int32_t  ntracks;
+  int16_t  mt;
+  const uint8_t *trk_end;  /* end of the track chunk (decoding in place) */
+} seq_loader;
+
+/* Bytes left in the track chunk being decoded. When decoding in parallel
+** each reader only sees its own track. */
+static uint32_t load_left(mf_reader *mr)
+{
+  seq_loader *ld = mr->aux;
+  return (ld->trk ? mr->mem_end : ld->trk_end) - mr->mem_cur;
+}
+
+/* Give back the room reserved and not used */
+static void load_fit(mf_seq *ms)
+{
+  void *a;
+
+  if (ms->evt_cnt > 0 && ms->evt_max - ms->evt_cnt > ms->evt_cnt / 8) {
+    a = seq_alloc(ms, ms->evt, (size_t)ms->evt_max * sizeof(uint64_t), (size_t)ms->evt_cnt * sizeof(uint64_t));
+    if (a) { ms->evt = a; ms->evt_max = ms->evt_cnt; }
+  }
+  if (ms->buf_cnt > 0 && ms->buf_max - ms->buf_cnt > ms->buf_cnt / 8) {
+    a = seq_alloc(ms, ms->buf, ms->buf_max, ms->buf_cnt);
+    if (a) { ms->buf = a; ms->buf_max = ms->buf_cnt; }
+  }
+}
+
+static mf_seq *load_seq(mf_reader *mr)
+{
+  seq_loader *ld = mr->aux;
+  return ld->trk ? ld->trk[mr->track-1] : ld->ms;
+}
+
+static int16_t load_error(mf_reader *mr, int16_t err, char *msg)
+{ return err; }
+
+static int16_t load_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division)
+{
+  seq_loader *ld = mr->aux;
+
+  if (ntracks < 0 || ntracks > 256) return 767;
+  ld->ms->division = division;
+  ld->ms->format = (type >= 0 && type <= 2) ? type : -1;
+  ld->ntracks = ntracks;
+  if (ld->mt && ntracks > 0) {
+    ld->trk = calloc(ntracks, sizeof(mf_seq *));
+    if (!ld->trk) return 766;
+  }
+  /* Decoding in place: reserve space for all the tracks at once */
+  if (!ld->trk && mr->mem)
+    return chkevt(ld->ms, (mr->mem_end - mr->mem_cur) / LOAD_BYTES_PER_EVT);
+  return 0;
+}
+
+static int16_t load_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen)
+{
+  seq_loader *ld = mr->aux;
+  mf_seq     *ms;
+
+  if (eot) return 0;
+  if (tracknum > ld->ntracks) return 767;
+
+  if (ld->trk) {
+    ld->trk[tracknum-1] = mf_seq_new(NULL, ld->ms->division);
+    if (!ld->trk[tracknum-1]) return 766;
+  }
+  ms = load_seq(mr);
+  ms->curtrack = tracknum-1;
+
+  if (mr->mem && tracklen > (uint32_t)(mr->mem_end - mr->mem_cur))
+    tracklen = mr->mem_end - mr->mem_cur;
+  if (!ld->trk) ld->trk_end = mr->mem_cur + tracklen;
+  return chkevt(ms, tracklen / LOAD_BYTES_PER_EVT);
+}
+
+static int16_t load_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
+                                                            int16_t data1, int16_t data2)
+{
+  mf_seq  *ms = load_seq(mr);
+  int16_t  ret;
+
+  if (ms->evt_cnt >= ms->evt_max && (ret = chkevt(ms,1))) return ret;
+  if (data2 < 0) data2 = 0;
+  if (type == mf_st_note_on && (data2 & 0x7F) == 0) type = mf_st_note_off;  /* as mf_seq_evt() */
+  ms->evt[ms->evt_cnt++] = evt_word(ms->curtrack, tick, type,
+                              ((chan-1) << 14) | ((data1 & 0x7F) << 7) | (data2 & 0x7F));
+  return 0;
+}
+
+static int16_t load_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
+                                                           int32_t len, uint8_t *data)
+{
+  mf_seq  *ms = load_seq(mr);
+  int16_t  ret;
+
+  if (ms->buf_max - ms->buf_cnt < 8 + (uint32_t)len &&
+      (ret = chkbuf(ms, 8 + len + load_left(mr)))) return ret;
+  return add_sys(ms, tick, type, aux, len, data);
+}
+
+/* Append the tracks decoded in parallel, fixing the references to buf */
+static int16_t load_merge(mf_seq *ms, mf_seq **trk, int32_t ntracks)
+{
+  uint32_t nevt = 0, nsys = 0, nbuf = 0;
+  uint32_t k;
+  uint64_t w;
+  int32_t  t;
+  mf_seq  *m;
+  int16_t  ret;
+
+  for (t=0; t<ntracks; t++) {
+    if (!trk[t]) continue;
+    nevt += trk[t]->evt_cnt; nsys += trk[t]->sys_cnt; nbuf += trk[t]->buf_cnt;
+  }
+
+  ret = chkevt(ms, nevt);
+  if (!ret) ret = chksys(ms, nsys);
+  if (!ret) ret = chkbuf(ms, nbuf);
+  if (ret) return ret;
+
+  for (t=0; t<ntracks; t++) {
+    if (!(m = trk[t])) continue;
+    for (k=0; k < m->evt_cnt; k++) {
+      w = m->evt[k];
+      if (evt_class(w) == EVT_SYS) w += ms->sys_cnt;
+      ms->evt[ms->evt_cnt++] = w;
+    }
+    for (k=0; k < m->sys_cnt; k++)
+      ms->sys[ms->sys_cnt++] = m->sys[k] + ms->buf_cnt;
+    add_data(ms, m->buf_cnt, m->buf);
+  }
+  return 0;
+}
+
+int16_t mf_seq_load(mf_seq *ms, char *fname)
+{
+  mf_reader  *mr;
+  seq_loader  ld;
+  uint32_t    evt_cnt, k;
+  int16_t     curtrack;
+  int32_t     t;
+  int16_t     ret = 0;
+
+  if (!ms) return 769;
+  if (ms->flags & MF_READONLY) return 765;
+
+  mr = mf_reader_map(fname);
+  if (!mr) return 768;
+
+  ld.ms = ms; ld.trk = NULL; ld.ntracks = 0; ld.trk_end = NULL;
+  ld.mt = (ms->nthreads > 1);
+
+  mr->aux         = &ld;
+  mr->on_error    = load_error;
+  mr->on_header   = load_header;
+  mr->on_track    = load_track;
+  mr->on_midi_evt = load_midi_evt;
+  mr->on_sys_evt  = load_sys_evt;
+
+  evt_cnt  = ms->evt_cnt;
+  curtrack = ms->curtrack;
+
+  ret = ld.mt ? mf_scan_mt(mr, ms->nthreads) : mf_scan(mr);
+  if (!ret && ld.trk) ret = load_merge(ms, ld.trk, ld.ntracks);
+
+  for (t=0; ld.trk && t < ld.ntracks; t++)
+    if (ld.trk[t]) seq_free(ld.trk[t]);
+  if (ld.trk) free(ld.trk);
+  mf_reader_close(mr);
+
+  if (!ret) load_fit(ms);
+
+  ms->curtrack = curtrack;
+  ms->flags &= ~(MF_SORTED_BYTICK | MF_SORTED_BYTRACK);
+  if (!ret && evt_cnt == 0) {
+    for (k=1; k < ms->evt_cnt && evt_key(ms->evt[k-1]) <= evt_key(ms->evt[k]); k++) ;
+    if (k >= ms->evt_cnt) ms->flags |= MF_SORTED_BYTRACK;
+  }
+
+  return ret;
+}
+
+/* == Snapshots
+**
+** A snapshot is the sorted sequence as it is in memory: a header followed
+** by ms->evt, ms->sys and ms->buf. Nothing has to be decoded to load it.
+**
+**     0  "UMFS"           20  evt_cnt          48  evt[evt_cnt]
+**     4  version          24  sys_cnt              sys[sys_cnt]
+**     8  0x01020304       28  buf_cnt              buf[buf_cnt]
+**    12  flags            32  checksum (64 bits)
+**    14  division         40  reserved
+**    16  format
+**    18  padding
+**
+** This is the layout of seq_snap with no padding added by the compiler;
+** the build fails if the struct is not 48 bytes.
+**
+** Numbers are in the byte order of the machine that wrote the snapshot
+** (the 0x01020304 mark tells which one) and other machines reject it.
+** The checksum is a FNV-1a hash of the three arrays taken 8 bytes at a
+** time.
+**
+** With MF_SNAP_MAP the snapshot is mapped in memory and the sequence
+** points directly into it: loading takes the same time whatever the size
+** and the pages are shared by all the processes that map the same file.
+** Such a sequence is read only (MF_READONLY): events can't be added and
+** it can't be sorted in a different order (mf_seq_save() and
+** mf_seq_render() work on a sorted copy of the events). Without
+** MF_SNAP_MAP the arrays are read in memory allocated as usual.
+**
+** Only the size of the file is checked against the header, unless
+** MF_SNAP_VERIFY is given: then the checksum and the references from the
+** events to sys and buf are checked too (this reads the whole file).
+*/
+
+#define SNAP_MAGIC   0x534D4655  /* "UMFS" read as a little endian word */
+#define SNAP_VERSION 2
+#define SNAP_BOM     0x01020304
+
+typedef struct {
+  uint8_t  magic[4];
+  uint32_t version;
+  uint32_t bom;
+  uint16_t flags;
+  int16_t  division;
+  int16_t  format;
+  uint16_t pad;
+  uint32_t evt_cnt;
+  uint32_t sys_cnt;
+  uint32_t buf_cnt;
+  uint64_t checksum;
+  uint64_t reserved;
+} seq_snap;
+
+typedef char seq_snap_chk[sizeof(seq_snap) == 48 ? 1 : -1];
+
+#define snap_size(h) (sizeof(seq_snap) + (uint64_t)(h)->evt_cnt * sizeof(uint64_t) \
+                      + (uint64_t)(h)->sys_cnt * sizeof(uint32_t) + (h)->buf_cnt)
+
+static uint64_t snap_hash(uint64_t h, const uint8_t *p, uint64_t n)
+{
+  uint64_t w;
+
+  for (; n >= 8; n -= 8, p += 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0x100000001B3ULL;
+  }
+  while (n-- > 0) h = (h ^ *p++) * 0x100000001B3ULL;
+  return h;
+}
+
+static uint64_t snap_checksum(uint64_t *evt, uint32_t nevt, uint32_t *sys, uint32_t nsys,
+                                                             uint8_t *buf, uint32_t nbuf)
+{
+  uint64_t h = 0xCBF29CE484222325ULL;
+
+  h = snap_hash(h, (uint8_t *)evt, (uint64_t)nevt * sizeof(uint64_t));
+  h = snap_hash(h, (uint8_t *)sys, (uint64_t)nsys * sizeof(uint32_t));
+  h = snap_hash(h, buf, nbuf);
+  return h;
+}
+
+int16_t mf_seq_snap_save(mf_seq *ms, char *fname)
+{
+  seq_snap hdr;
+  FILE    *f;
+  int16_t  ret = 0;
+
+  if (!ms) return 796;
+  if (!fname) return 795;
+  if (!mf_seq_sorted(ms) && (ret = mf_seq_bytick(ms))) return ret;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, "UMFS", 4);
+  hdr.version  = SNAP_VERSION;
+  hdr.bom      = SNAP_BOM;
+  hdr.flags    = ms->flags & (MF_SORTED_BYTICK | MF_SORTED_BYTRACK | MF_RUNNING_STATUS);
+  hdr.division = ms->division;
+  hdr.format   = ms->format;
+  hdr.evt_cnt  = ms->evt_cnt;
+  hdr.sys_cnt  = ms->sys_cnt;
+  hdr.buf_cnt  = ms->buf_cnt;
+  hdr.checksum = snap_checksum(ms->evt, ms->evt_cnt, ms->sys, ms->sys_cnt, ms->buf, ms->buf_cnt);
+
+  f = fopen(fname, "wb");
+  if (!f) return 794;
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      (ms->evt_cnt && fwrite(ms->evt, sizeof(uint64_t), ms->evt_cnt, f) != ms->evt_cnt) ||
+      (ms->sys_cnt && fwrite(ms->sys, sizeof(uint32_t), ms->sys_cnt, f) != ms->sys_cnt) ||
+      (ms->buf_cnt && fwrite(ms->buf, 1, ms->buf_cnt, f) != ms->buf_cnt)) ret = 793;
+  if (fclose(f) != 0 && !ret) ret = 793;
+  return ret;
+}
+
+/* Checksum and references to sys and buf */
+static int16_t snap_verify(seq_snap *hdr, uint64_t *evt, uint32_t *sys, uint8_t *buf)
+{
+  uint32_t k, idx, len;
+
+  if (snap_checksum(evt, hdr->evt_cnt, sys, hdr->sys_cnt, buf, hdr->buf_cnt) != hdr->checksum)
+    return 1;
+  for (k=0; k < hdr->evt_cnt; k++) {
+    if (evt_class(evt[k]) != EVT_SYS) continue;
+    idx = evt_sysidx(evt[k]);
+    if (idx >= hdr->sys_cnt || sys[idx] > hdr->buf_cnt || hdr->buf_cnt - sys[idx] < 6) return 1;
+    len = getlong(buf + sys[idx] + 2);
+    if (len > hdr->buf_cnt - sys[idx] - 6) return 1;
+  }
+  return 0;
+}
+
+mf_seq *mf_seq_snap_load(char *fname, uint16_t flags)
+{
+  seq_snap hdr;
+  mf_seq  *ms;
+  FILE    *f;
+  uint64_t *evt;
+  uint32_t *sys;
+  uint8_t  *buf;
+  int16_t   err = 0;
+
+  f = fopen(fname, "rb");
+  if (!f) return NULL;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, "UMFS", 4) != 0 ||
+      hdr.version != SNAP_VERSION || hdr.bom != SNAP_BOM ||
+      fseek(f, 0, SEEK_END) != 0 || (uint64_t)ftell(f) != snap_size(&hdr)) {
+    fclose(f);
+    return NULL;
+  }
+
+  ms = mf_seq_new(NULL, hdr.division);
+  if (!ms) { fclose(f); return NULL; }
+  ms->format = hdr.format;
+
+#ifndef MF_NO_MMAP
+  if (flags & MF_SNAP_MAP) {
+    uint64_t len = snap_size(&hdr);
+    uint8_t *mem = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    seq_map *map = malloc(sizeof(seq_map));
+    if (mem == MAP_FAILED || !map) {
+      if (mem != MAP_FAILED) munmap(mem, len);
+      if (map) free(map);
+      fclose(f);
+      seq_free(ms);
+      return NULL;
+    }
+    map->mem = mem; map->len = len;
+    evt = (uint64_t *)(mem + sizeof(seq_snap));
+    sys = (uint32_t *)(evt + hdr.evt_cnt);
+    buf = (uint8_t  *)(sys + hdr.sys_cnt);
+    ms->alloc     = seq_ro_alloc;
+    ms->alloc_aux = map;
+    ms->flags    |= MF_READONLY;
+  }
+  else
+#endif
+  {
+    evt = hdr.evt_cnt ? seq_alloc(ms, NULL, 0, (size_t)hdr.evt_cnt * sizeof(uint64_t)) : NULL;
+    sys = hdr.sys_cnt ? seq_alloc(ms, NULL, 0, (size_t)hdr.sys_cnt * sizeof(uint32_t)) : NULL;
+    buf = hdr.buf_cnt ? seq_alloc(ms, NULL, 0, hdr.buf_cnt) : NULL;
+    ms->evt = evt; ms->sys = sys; ms->buf = buf;
+    ms->evt_max = evt ? hdr.evt_cnt : 0;
+    ms->sys_max = sys ? hdr.sys_cnt : 0;
+    ms->buf_max = buf ? hdr.buf_cnt : 0;
+    if ((hdr.evt_cnt && !evt) || (hdr.sys_cnt && !sys) || (hdr.buf_cnt && !buf) ||
+        fseek(f, sizeof(seq_snap), SEEK_SET) != 0 ||
+        fread(evt, sizeof(uint64_t), hdr.evt_cnt, f) != hdr.evt_cnt ||
+        fread(sys, sizeof(uint32_t), hdr.sys_cnt, f) != hdr.sys_cnt ||
+        fread(buf, 1, hdr.buf_cnt, f) != hdr.buf_cnt) err = 1;
+  }
+  fclose(f);
+
+  if (!err && (flags & MF_SNAP_VERIFY)) err = snap_verify(&hdr, evt, sys, buf);
+  if (err) {
+    mf_seq_close(ms);
+    return NULL;
+  }
+
+  ms->evt = evt; ms->evt_cnt = hdr.evt_cnt;
+  ms->sys = sys; ms->sys_cnt = hdr.sys_cnt;
+  ms->buf = buf; ms->buf_cnt = hdr.buf_cnt;
+  if (ms->flags & MF_READONLY) {
+    ms->evt_max = hdr.evt_cnt;
+    ms->sys_max = hdr.sys_cnt;
+    ms->buf_max = hdr.buf_cnt;
+  }
+  ms->flags |= hdr.flags & (MF_SORTED_BYTICK | MF_SORTED_BYTRACK | MF_RUNNING_STATUS);
+  return ms;
+}
+
+/* == Pairing notes
+**
+** mf_notes_new() pairs each note on with its note off in a single pass
+** over the sequence, sorted by track. For each channel and pitch of the
+** current track, the active table holds the FIFO of the notes that are
+** still sounding (linked through nxt[]) so that overlapping notes with
+** the same pitch are closed in the order they were started.
+** A note on with velocity 0 is a note off. Notes that are still on at
+** the end of the track end with the last event of the track.
+**
+** At the same tick note offs are sorted before note ons, so the off of a
+** zero length note (e.g. a drum trigger) comes before its on. A note off
+** that finds no active note is held back until the end of its tick and
+** closes a note on at the same tick; only then it's counted as unmatched.
+**
+** Notes are in the order of their note on within each track.
+*/
+
+#define NOTE_NONE 0xFFFFFFFF
+#define NOTE_PEND 128  /* note offs held back at the same tick */
+
+static void notes_close_track(mf_notes *mn, uint32_t *head, uint32_t *nxt, uint32_t tick)
+{
+  uint32_t k, n;
+
+  for (k=0; k < 16*128; k++) {
+    for (n = head[k]; n != NOTE_NONE; n = nxt[n]) {
+      mn->note[n].dur = tick - mn->note[n].tick;
+      mn->unclosed++;
+    }
+    head[k] = NOTE_NONE;
+  }
+}
+
+mf_notes *mf_notes_new(mf_seq *ms)
+{
+  mf_notes *mn;
+  uint32_t *nxt = NULL, *nx;
+  uint32_t  head[16*128];
+  uint32_t  tail[16*128];
+  uint16_t  pend_key[NOTE_PEND];
+  uint8_t   pend_vel[NOTE_PEND];
+  uint32_t  pend_cnt = 0, j;
+  uint32_t  k, n, key;
+  uint64_t  w;
+  uint8_t   st;
+  mf_note  *note;
+  int16_t   err = 0;
+
+  if (!ms || mf_seq_bytrack(ms)) return NULL;
+
+  mn = malloc(sizeof(mf_notes));
+  if (!mn) return NULL;
+  mn->note = NULL; mn->note_cnt = 0; mn->note_max = 0;
+  mn->unmatched = 0; mn->unclosed = 0;
+
+  for (k=0; k < 16*128; k++) head[k] = NOTE_NONE;
+
+  for (k=0; k < ms->evt_cnt && !err; k++) {
+    w = ms->evt[k];
+    if (pend_cnt > 0 && (evt_track(w) != evt_track(ms->evt[k-1]) ||
+                         evt_tick(w) != evt_tick(ms->evt[k-1]))) {
+      mn->unmatched += pend_cnt;
+      pend_cnt = 0;
+    }
+    if (k > 0 && evt_track(w) != evt_track(ms->evt[k-1]))
+      notes_close_track(mn, head, nxt, evt_tick(ms->evt[k-1]));
+
+    st = evt_status(w);
+    if (st != mf_st_note_on && st != mf_st_note_off) continue;
+
+    key = (evt_chan(w) << 7) | evt_data1(w);
+
+    if (st == mf_st_note_on && evt_data2(w) > 0) {
+      if (mn->note_cnt >= mn->note_max) {
+        n = mn->note_max ? mn->note_max * 2 : 1024;
+        if (!(note = realloc(mn->note, n * sizeof(mf_note)))) { err = 1; break; }
+        mn->note = note;
+        if (!(nx = realloc(nxt, n * sizeof(uint32_t)))) { err = 1; break; }
+        nxt = nx;
+        mn->note_max = n;
+      }
+      n = mn->note_cnt++;
+      mn->note[n].tick    = evt_tick(w);
+      mn->note[n].dur     = 0;
+      mn->note[n].track   = evt_track(w);
+      mn->note[n].chan    = evt_chan(w);
+      mn->note[n].pitch   = evt_data1(w);
+      mn->note[n].vel     = evt_data2(w);
+      mn->note[n].off_vel = 0;
+      nxt[n] = NOTE_NONE;
+
+      for (j=0; j < pend_cnt && pend_key[j] != key; j++) ;
+      if (j < pend_cnt) {  /* closed by a note off at this same tick */
+        mn->note[n].off_vel = pend_vel[j];
+        pend_cnt--;
+        memmove(pend_key+j, pend_key+j+1, (pend_cnt-j) * sizeof(uint16_t));
+        memmove(pend_vel+j, pend_vel+j+1, (pend_cnt-j) * sizeof(uint8_t));
+        continue;
+      }
+
+      if (head[key] == NOTE_NONE) head[key] = n;
+      else nxt[tail[key]] = n;
+      tail[key] = n;
+    }
+    else if ((n = head[key]) != NOTE_NONE) {
+      mn->note[n].dur     = evt_tick(w) - mn->note[n].tick;
+      mn->note[n].off_vel = st == mf_st_note_off ? evt_data2(w) : 0;
+      head[key] = nxt[n];
+    }
+    else if (pend_cnt < NOTE_PEND) {
+      pend_key[pend_cnt] = key;
+      pend_vel[pend_cnt] = st == mf_st_note_off ? evt_data2(w) : 0;
+      pend_cnt++;
+    }
+    else mn->unmatched++;
+  }
+  mn->unmatched += pend_cnt;
+  if (!err && ms->evt_cnt > 0)
+    notes_close_track(mn, head, nxt, evt_tick(ms->evt[ms->evt_cnt-1]));
+
+  if (nxt) free(nxt);
+  if (err) {
+    mf_notes_free(mn);
+    return NULL;
+  }
+  return mn;
+}
+
+int16_t mf_notes_free(mf_notes *mn)
+{
+  if (!mn) return 679;
+  if (mn->note) free(mn->note);
+  free(mn);
+  return 0;
+}
+
+/* == Tempo map
+**
+** The tempo map is a list of segments sorted by tick. Within a segment
+** time grows linearly:
+**
+**     us = seg.us + (tick - seg.tick) * seg.tempo / mt->den
+**
+** For PPQ divisions seg.tempo is the tempo (us per quarter note) and den
+** is the division. For SMPTE divisions (negative, frames per second in
+** the high byte and ticks per frame in the low byte) there is a single
+** segment: us per frame over ticks per frame (29 stands for 29.97 fps).
+** Tempo changes are ignored for SMPTE divisions.
+**
+** Ticks are converted to us (and back) with a binary search on the
+** segments. mf_tempo_us_bulk() converts an array of ticks: as long as the
+** ticks are ascending the current segment is moved forward with no search.
+*/
+
+#define MF_TEMPO 500000  /* default tempo (120 bpm) */
+
+mf_tempo *mf_tempo_new(int16_t division)
+{
+  mf_tempo *mt;
+  int16_t   fps, tpf;
+
+  if (division == 0) return NULL;
+
+  mt = malloc(sizeof(mf_tempo));
+  if (!mt) return NULL;
+
+  mt->seg_max = 8;
+  mt->seg = malloc(mt->seg_max * sizeof(mf_tempo_seg));
+  if (!mt->seg) { free(mt); return NULL; }
+
+  mt->division = division;
+  mt->seg_cnt  = 1;
+  mt->seg[0].tick = 0;
+  mt->seg[0].us   = 0;
+
+  if (division > 0) {
+    mt->seg[0].tempo = MF_TEMPO;
+    mt->den = division;
+  }
+  else {
+    fps = mf_smpte_fps(division);
+    tpf = mf_smpte_tpf(division);
+    if (tpf == 0) tpf = 1;
+    if (fps == 29) {
+      mt->seg[0].tempo = 1001000000;
+      mt->den = 30000 * tpf;
+    }
+    else {
+      mt->seg[0].tempo = 1000000;
+      mt->den = (fps > 0 ? fps : 1) * tpf;
+    }
+  }
+  return mt;
+}
+
+int16_t mf_tempo_free(mf_tempo *mt)
+{
+  if (!mt) return 689;
+  if (mt->seg) free(mt->seg);
+  free(mt);
+  return 0;
+}
+
+/* Last segment starting at or before tick */
+static uint32_t tempo_find(mf_tempo *mt, uint32_t tick)
+{
+  uint32_t lo = 0, hi = mt->seg_cnt, mid;
+
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (mt->seg[mid].tick <= tick) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+#define seg_us(mt,sg,t) ((sg)->us + (uint64_t)((t) - (sg)->tick) * (sg)->tempo / (mt)->den)
+
+int16_t mf_tempo_set(mf_tempo *mt, uint32_t tick, uint32_t tempo)
+{
+  mf_tempo_seg *seg;
+  uint32_t      k;
+
+  if (!mt) return 689;
+  if (tempo == 0) return 688;
+  if (mt->division < 0) return 0;
+
+  k = tempo_find(mt, tick);
+  if (mt->seg[k].tick != tick) {
+    if (mt->seg_cnt == mt->seg_max) {
+      seg = realloc(mt->seg, 2 * mt->seg_max * sizeof(mf_tempo_seg));
+      if (!seg) return 687;
+      mt->seg = seg;
+      mt->seg_max *= 2;
+    }
+    k++;
+    memmove(mt->seg+k+1, mt->seg+k, (mt->seg_cnt - k) * sizeof(mf_tempo_seg));
+    mt->seg_cnt++;
+    mt->seg[k].tick = tick;
+  }
+  mt->seg[k].tempo = tempo;
+
+  /* The time of the following segments changes */
+  for (; k < mt->seg_cnt; k++)
+    if (k > 0) mt->seg[k].us = seg_us(mt, mt->seg+k-1, mt->seg[k].tick);
+
+  return 0;
+}
+
+uint64_t mf_tempo_us(mf_tempo *mt, uint32_t tick)
+{
+  mf_tempo_seg *seg;
+
+  if (!mt) return 0;
+  seg = mt->seg + tempo_find(mt, tick);
+  return seg_us(mt, seg, tick);
+}
+
+uint32_t mf_tempo_tick(mf_tempo *mt, uint64_t us)
+{
+  mf_tempo_seg *seg;
+  uint32_t lo = 0, hi, mid;
+
+  if (!mt) return 0;
+  hi = mt->seg_cnt;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (mt->seg[mid].us <= us) lo = mid;
+    else hi = mid;
+  }
+  /* The last tick whose time (rounded down as in mf_tempo_us()) is <= us */
+  seg = mt->seg + lo;
+  return seg->tick + (uint32_t)(((us - seg->us + 1) * mt->den - 1) / seg->tempo);
+}
+
+int16_t mf_tempo_us_bulk(mf_tempo *mt, const uint32_t *tick, uint64_t *us, uint32_t n)
+{
+  uint32_t k = 0, j, sg;
+  uint32_t lim, t0, tempo;
+  uint64_t base, den;
+
+  if (!mt || (n > 0 && (!tick || !us))) return 689;
+
+  den = mt->den;
+  while (k < n) {
+    sg = tempo_find(mt, tick[k]);
+    do {
+      /* The ascending run of ticks that falls in this segment */
+      lim = (sg+1 < mt->seg_cnt) ? mt->seg[sg+1].tick : 0;
+      for (j = k+1; j < n && tick[j] >= tick[j-1] && (lim == 0 || tick[j] < lim); j++) ;
+
+      base = mt->seg[sg].us; t0 = mt->seg[sg].tick; tempo = mt->seg[sg].tempo;
+      for (; k < j; k++)
+        us[k] = base + (uint64_t)(tick[k] - t0) * tempo / den;
+
+      if (k >= n || tick[k] < tick[k-1]) break;
+      while (sg+1 < mt->seg_cnt && mt->seg[sg+1].tick <= tick[k]) sg++;
+    } while (1);
+  }
+  return 0;
+}
+
+#define get24(q) ((uint32_t)(q)[0] << 16 | (q)[1] << 8 | (q)[2])
+
+mf_tempo *mf_tempo_track(mf_seq *ms, int16_t track)
+{
+  mf_tempo *mt;
+  uint32_t  k;
+  mf_evt    e;
+
+  if (!ms) return NULL;
+  mt = mf_tempo_new(ms->division);
+
+  for (k=0; mt && k < ms->evt_cnt; k++) {
+    if (evt_class(ms->evt[k]) != EVT_SYS) continue;
+    if (track >= 0 && evt_track(ms->evt[k]) != track) continue;
+    evt_decode(ms, k, &e);
+    if (e.status != mf_st_meta_event || e.chan != mf_me_set_tempo ||
+        e.len != 3 || get24(e.data) == 0) continue;
+    if (mf_tempo_set(mt, e.tick, get24(e.data))) {
+      mf_tempo_free(mt);
+      mt = NULL;
+    }
+  }
+  return mt;
+}
+
+mf_tempo *mf_tempo_seq(mf_seq *ms)
+{
+  if (!ms) return NULL;
+  return mf_tempo_track(ms, ms->format == 2 ? 0 : -1);
+}
+
+static int16_t tempo_error(mf_reader *mr, int16_t err, char *msg)
+{ return err; }
+
+static int16_t tempo_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division)
+{
+  int16_t t;
+
+  /* Format 2: only the first pattern */
+  for (t=2; type == 2 && t <= ntracks && t <= 256; t++) mf_skip_track(mr, t, 1);
+  mr->aux = mf_tempo_new(division);
+  return mr->aux ? 0 : 686;
+}
+
+static int16_t tempo_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen)
+{ return 0; }
+
+static int16_t tempo_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
+                                                             int16_t data1, int16_t data2)
+{ return 0; }
+
+static int16_t tempo_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
+                                                            int32_t len, uint8_t *data)
+{
+  if (type != mf_st_meta_event || aux != mf_me_set_tempo ||
+      len != 3 || get24(data) == 0) return 0;
+  return mf_tempo_set(mr->aux, tick, get24(data));
+}
+
+mf_tempo *mf_tempo_file(char *fname)
+{
+  mf_reader *mr;
+  mf_tempo  *mt;
+
+  mr = mf_reader_map(fname);
+  if (!mr) return NULL;
+
+  mr->aux         = NULL;
+  mr->on_error    = tempo_error;
+  mr->on_header   = tempo_header;
+  mr->on_track    = tempo_track;
+  mr->on_midi_evt = tempo_midi_evt;
+  mr->on_sys_evt  = tempo_sys_evt;
+
+  if (mf_scan(mr) != 0) {
+    if (mr->aux) mf_tempo_free(mr->aux);
+    mr->aux = NULL;
+  }
+  mt = mr->aux;
+  mf_reader_close(mr);
+  return mt;
+}
+
+/* == Playback
+**
+** A player dispatches the events of a sequence at their wall clock time.
+** The scheduler thread walks the sequence, converts ticks to microseconds
+** with the tempo map (see mf_tempo_seq()) and pushes the events that are due in the next
+** PLAY_AHEAD microseconds in a ring. The output thread takes them from
+** the ring, waits for their time and calls on_event().
+** The ring has a single producer and a single consumer, each of them
+** only updating its own index: no lock is needed.
+**
+** Sleeping is not accurate enough, so the output thread sleeps until
+** some time before the event is due and then spins on the monotonic
+** clock. That time starts at PLAY_SPIN us and grows to cover the largest
+** oversleep seen so far (up to PLAY_SPIN_MAX us). The delay between the
+** due time and the call to on_event() is recorded in the jitter histogram.
+*/
+
+#define PLAY_RING   1024     /* must be a power of 2 */
+#define PLAY_AHEAD  100000   /* us */
+#define PLAY_SPIN   200      /* us */
+#define PLAY_SPIN_MAX 20000  /* us */
+#define PLAY_NAP    1000     /* us */
+#define PLAY_START  5000     /* us, gives the threads the time to start */
+
+typedef struct {
+  uint64_t due;  /* us */
+  uint32_t evt;
+} play_slot;
+
+struct mf_player_s {
+  mf_seq     *ms;
+  mf_fn_play  on_event;
+  void       *aux;
+  mf_tempo   *tempo;
+  uint64_t    t0;       /* ns */
+  mf_jitter   jitter;
+  int16_t     error;
+  int16_t     started;
+#ifndef MF_NO_THREADS
+  pthread_t   sched;
+  pthread_t   out;
+  atomic_uint head;     /* written by the scheduler */
+  atomic_uint tail;     /* written by the output thread */
+  atomic_int  done;     /* no more events will be pushed */
+  atomic_int  stop;
+  play_slot   ring[PLAY_RING];
+#endif
+};
+
+mf_player *mf_play_new(mf_seq *ms, mf_fn_play on_event, void *aux)
+{
+  mf_player *mp;
+
+  if (!ms || !on_event) return NULL;
+  if (mf_seq_bytick(ms)) return NULL;
+
+  mp = malloc(sizeof(mf_player));
+  if (!mp) return NULL;
+
+  mp->ms       = ms;
+  mp->on_event = on_event;
+  mp->aux      = aux;
+  mp->tempo    = NULL;
+  mp->error    = 0;
+  mp->started  = 0;
+  memset(&mp->jitter, 0, sizeof(mf_jitter));
+
+  mp->tempo = mf_tempo_seq(ms);
+  if (!mp->tempo) {
+    mf_play_close(mp);
+    return NULL;
+  }
+  return mp;
+}
+
+const mf_jitter *mf_play_jitter(mf_player *mp)
+{
+  return mp ? &mp->jitter : NULL;
+}
+
+#ifndef MF_NO_THREADS
+
+static uint64_t play_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void play_sleep(uint64_t until)
+{
+  struct timespec ts;
+  ts.tv_sec  = until / 1000000000;
+  ts.tv_nsec = until % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) ;
+}
+
+#define play_stopped(mp) atomic_load_explicit(&(mp)->stop, memory_order_relaxed)
+
+static void *play_sched(void *arg)
+{
+  mf_player *mp = arg;
+  uint32_t   head = 0;
+  uint32_t   k;
+  uint64_t   due;
+  play_slot *slot;
+
+  for (k=0; k < mp->ms->evt_cnt && !play_stopped(mp); k++) {
+    due = mf_tempo_us(mp->tempo, evt_tick(mp->ms->evt[k]));
+
+    /* Wait for a free slot and for the event to get close enough */
+    while (!play_stopped(mp)) {
+      if (head - atomic_load_explicit(&mp->tail, memory_order_acquire) < PLAY_RING &&
+          mp->t0 + due * 1000 <= play_now() + PLAY_AHEAD * 1000)
+        break;
+      play_sleep(play_now() + PLAY_NAP * 1000);
+    }
+
+    slot = mp->ring + (head & (PLAY_RING-1));
+    slot->due = due;
+    slot->evt = k;
+    atomic_store_explicit(&mp->head, ++head, memory_order_release);
+  }
+  atomic_store_explicit(&mp->done, 1, memory_order_release);
+  return NULL;
+}
+
+static void *play_out(void *arg)
+{
+  mf_player *mp = arg;
+  uint32_t   tail = 0;
+  uint64_t   due, now, late, wake;
+  uint64_t   spin = PLAY_SPIN * 1000;
+  play_slot *slot;
+  mf_evt     e;
+
+  while (!play_stopped(mp)) {
+    if (tail == atomic_load_explicit(&mp->head, memory_order_acquire)) {
+      if (atomic_load_explicit(&mp->done, memory_order_acquire) &&
+          tail == atomic_load_explicit(&mp->head, memory_order_acquire)) break;
+      play_sleep(play_now() + PLAY_NAP * 1000);
+      continue;
+    }
+
+    slot = mp->ring + (tail & (PLAY_RING-1));
+    due  = mp->t0 + slot->due * 1000;
+
+    while ((now = play_now()) + spin < due && !play_stopped(mp)) {
+      wake = now + PLAY_NAP * 1000;
+      if (wake > due - spin) wake = due - spin;
+      play_sleep(wake);
+      if ((now = play_now()) - wake + PLAY_SPIN * 1000 > spin)
+        spin = now - wake + PLAY_SPIN * 1000;
+      if (spin > PLAY_SPIN_MAX * 1000) spin = PLAY_SPIN_MAX * 1000;
+    }
+    while ((now = play_now()) < due) ;
+
+    late = (now - due) / 1000;
+    mp->jitter.count++;
+    if (late > mp->jitter.max_us) mp->jitter.max_us = late;
+    mp->jitter.bin[late / MF_JITTER_STEP < MF_JITTER_BINS ? late / MF_JITTER_STEP
+                                                          : MF_JITTER_BINS-1]++;
+
+    mp->error = mp->on_event(mp->aux, evt_decode(mp->ms, slot->evt, &e), slot->due);
+    atomic_store_explicit(&mp->tail, ++tail, memory_order_release);
+    if (mp->error) atomic_store_explicit(&mp->stop, 1, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+int16_t mf_play_start(mf_player *mp)
+{
+  if (!mp) return 699;
+  if (mp->started) return 696;
+
+  atomic_init(&mp->head, 0);
+  atomic_init(&mp->tail, 0);
+  atomic_init(&mp->done, 0);
+  atomic_init(&mp->stop, 0);
+  mp->t0 = play_now() + PLAY_START * 1000;
+
+  if (pthread_create(&mp->out, NULL, play_out, mp) != 0) return 697;
+  if (pthread_create(&mp->sched, NULL, play_sched, mp) != 0) {
+    atomic_store(&mp->stop, 1);
+    pthread_join(mp->out, NULL);
+    return 697;
+  }
+  mp->started = 1;
+  return 0;
+}
+
+int16_t mf_play_wait(mf_player *mp)
+{
+  if (!mp) return 699;
+  if (mp->started) {
+    pthread_join(mp->sched, NULL);
+    pthread_join(mp->out, NULL);
+    mp->started = 0;
+  }
+  return mp->error;
+}
+
+int16_t mf_play_stop(mf_player *mp)
+{
+  if (!mp) return 699;
+  if (mp->started) atomic_store(&mp->stop, 1);
+  return mf_play_wait(mp);
+}
+
+#else
+
+int16_t mf_play_start(mf_player *mp) { return mp ? 697 : 699; }
+int16_t mf_play_wait(mf_player *mp)  { return mp ? mp->error : 699; }
+int16_t mf_play_stop(mf_player *mp)  { return mp ? mp->error : 699; }
+
+#endif
+
+int16_t mf_play_close(mf_player *mp)
+{
+  int16_t ret;
+
+  if (!mp) return 699;
+  ret = mf_play_stop(mp);
+  mf_tempo_free(mp->tempo);
+  free(mp);
+  return ret;
+}
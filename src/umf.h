@@ -14,32 +14,156 @@
 #include <inttypes.h>
 
 
-typedef int16_t (*mf_fn_error   ) (int16_t err, char *msg);
-typedef int16_t (*mf_fn_header  ) (int16_t type, int16_t ntracks, int16_t division);
-typedef int16_t (*mf_fn_track   ) (int16_t eot,  int16_t tracknum, uint32_t tracklen);
-typedef int16_t (*mf_fn_midi_evt) (uint32_t delta, int16_t type, int16_t chan,
-                                                   int16_t data1, int16_t data2);
-typedef int16_t (*mf_fn_sys_evt ) (uint32_t delta, int16_t type, int16_t aux,
-                                                   int32_t len,  uint8_t *data);
+/* All the callbacks receive the reader that is calling them so that the
+** per-file state can be kept in mr->aux rather than in global variables.
+** This allows many files to be scanned in parallel, one per thread.
+*/
+typedef struct mf_reader_s mf_reader;
 
+/* Statistics. They are only collected if the library is compiled with
+** MF_STATS defined (e.g. make CFLAGS_SRC=-DMF_STATS), otherwise the
+** instrumentation compiles to nothing and the counters stay at zero.
+*/
+#define MF_STAT_CLASSES 9  /* 0x80-0xE0, sysex, meta */
+#define mf_stat_class(s) ((s) < 0xF0 ? (((s) >> 4) & 0x07) : ((s) == 0xFF ? 8 : 7))
 
 typedef struct {
+  uint64_t evt[MF_STAT_CLASSES];  /* events by status class */
+  uint64_t bytes;           /* bytes read or written */
+  uint64_t varlen;          /* variable length quantities decoded/encoded */
+  uint64_t sys_bytes;       /* sysex and meta data copied */
+  uint64_t callbacks;       /* calls to the on_* functions */
+  uint64_t chrbuf_realloc;  /* times chrbuf has been enlarged */
+  uint64_t seeks;
+  uint64_t ns_scan;         /* time spent (in nanoseconds) */
+  uint64_t ns_sort;
+  uint64_t ns_encode;
+} mf_stats;
+
+/* Chrome trace-event timeline (load it in chrome://tracing or Perfetto) */
+int16_t mf_trace_start(char *fname);
+int16_t mf_trace_stop(void);
+
+/* Division. A positive division is in ticks per quarter note (PPQ). A
+** negative one is SMPTE: the high byte is minus the frames per second
+** (24, 25, 29 for 29.97 drop frame or 30) and the low byte is the number
+** of ticks per frame. E.g. mf_smpte(25,40) gives millisecond ticks.
+** mf_div_quarter() is the number of ticks in a quarter note at the default
+** tempo (120 bpm) for either kind of division.
+*/
+#define mf_smpte(fps,tpf)   ((int16_t)(((uint16_t)(-(fps) & 0xFF) << 8) | ((tpf) & 0xFF)))
+#define mf_is_smpte(d)      ((int16_t)(d) < 0)
+#define mf_smpte_fps(d)     (-(int8_t)((uint16_t)(d) >> 8))
+#define mf_smpte_tpf(d)     ((uint16_t)(d) & 0xFF)
+#define mf_div_quarter(d)   (mf_is_smpte(d) ? ((mf_smpte_fps(d) == 29 ? 30 : mf_smpte_fps(d)) \
+                                                * mf_smpte_tpf(d)) / 2 : (int16_t)(d))
+
+typedef int16_t (*mf_fn_error   ) (mf_reader *mr, int16_t err, char *msg);
+typedef int16_t (*mf_fn_header  ) (mf_reader *mr, int16_t type, int16_t ntracks, int16_t division);
+typedef int16_t (*mf_fn_track   ) (mf_reader *mr, int16_t eot,  int16_t tracknum, uint32_t tracklen);
+typedef int16_t (*mf_fn_midi_evt) (mf_reader *mr, uint32_t delta, int16_t type, int16_t chan,
+                                                                  int16_t data1, int16_t data2);
+typedef int16_t (*mf_fn_sys_evt ) (mf_reader *mr, uint32_t delta, int16_t type, int16_t aux,
+                                                                  int32_t len,  uint8_t *data);
+
+
+struct mf_reader_s {
   FILE            *file        ;
   uint8_t         *chrbuf      ;
   uint32_t         chrbuf_sz   ;
+  const uint8_t   *mem         ;  /* in-memory source (NULL if reading from file) */
+  const uint8_t   *mem_cur     ;
+  const uint8_t   *mem_end     ;
+  int16_t          mem_own     ;  /* 0: caller's buffer 1: mmapped 2: malloc'd */
   mf_fn_error      on_error    ;
   mf_fn_header     on_header   ;
   mf_fn_track      on_track    ;
   mf_fn_midi_evt   on_midi_evt ;
   mf_fn_sys_evt    on_sys_evt  ;
+  int16_t          track       ;  /* track being scanned (1 is the first) */
+  int16_t          thread      ;  /* thread scanning it (see mf_scan_mt()) */
+  void            *feed        ;  /* push parser state (see mf_feed()) */
+  mf_stats         stats       ;
+  uint16_t         skip_cls    ;  /* status classes to skip (see mf_skip()) */
+  uint32_t         skip_meta[8];  /* meta types to skip (one bit each) */
+  uint32_t         skip_trk[8] ;  /* tracks to skip (one bit each, 1 to 256) */
+  uint16_t         flags       ;  /* MF_TOLERANT */
+  uint32_t         err_pos     ;  /* offset of the last problem found in tolerant mode */
+  uint32_t         err_cnt     ;  /* problems found in tolerant mode */
+  int32_t          filenum     ;  /* file being scanned (see mf_batch_run()) */
   void            *aux;
-} mf_reader;
+};
 
 
 int16_t mf_scan(mf_reader *mfile);
+int16_t mf_scan_mt(mf_reader *mr, int16_t nthreads);
 
+mf_reader *mf_reader_new(char *fname);
+mf_reader *mf_reader_map(char *fname);
+mf_reader *mf_reader_mem(const uint8_t *buf, uint32_t len);
 void mf_reader_close(mf_reader *mr);
 
+/* Filtering (mf_scan() and mf_scan_mt() only): skipped events and tracks
+** are jumped over without copying them and without calling any callback.
+** Classes are ORed: e.g. mf_skip(mr, MF_SKIP(mf_st_control_change) | MF_SKIP_SYSEX).
+** The end of track meta event is never skipped.
+*/
+#define MF_SKIP(s)     (1 << mf_stat_class(s))
+#define MF_SKIP_MIDI   0x7F
+#define MF_SKIP_SYSEX  MF_SKIP(mf_st_system_exclusive)
+#define MF_SKIP_META   MF_SKIP(mf_st_meta_event)
+
+int16_t mf_skip(mf_reader *mr, uint16_t classes);
+int16_t mf_skip_meta(mf_reader *mr, int16_t type, int16_t skip);
+int16_t mf_skip_track(mf_reader *mr, int16_t track, int16_t skip);
+
+/* Tolerant mode (mf_scan() only): corrupt or truncated data doesn't stop
+** the scan. Unknown chunks are skipped, the data is searched for the next
+** MTrk when a chunk header is bad and bad tracks are skipped up to their
+** declared length. Each problem is reported to on_error() (its return
+** value is ignored) with mr->track and mr->err_pos set.
+*/
+#define MF_TOLERANT  0x0001
+
+int16_t mf_set_tolerant(mf_reader *mr, int16_t on);
+
+/* Batch scanning: the files added to the batch are scanned with mf_scan()
+** by nthreads threads, one file per thread at a time. Callbacks, filters,
+** flags and aux are taken from mb->mr, set them before mf_batch_run(). By
+** default all the callbacks do nothing.
+** Callbacks are called from different threads at the same time: use
+** mr->thread (0 to nthreads-1) to keep separate state for each thread and
+** mr->filenum (the order in which the file was added) to know the file.
+** on_file(), if set, is called by the same thread after each file with the
+** return value of mf_scan() (79 if the file can't be read).
+** mf_batch_run() returns the first error in the order the files were added;
+** all of them are in mb->err[].
+*/
+typedef int16_t (*mf_fn_file) (mf_reader *mr, int32_t filenum, char *fname, int16_t err);
+
+typedef struct {
+  mf_reader   *mr;        /* the prototype for the readers of each thread */
+  mf_fn_file   on_file;
+  char       **fname;
+  long        *fsize;
+  int16_t     *err;       /* result of the last run for each file */
+  int32_t      cnt;
+  int32_t      max;
+  int16_t      nthreads;
+  mf_reader   *thr;       /* per thread readers, kept between runs */
+} mf_batch;
+
+mf_batch *mf_batch_new(int16_t nthreads);
+int16_t mf_batch_add(mf_batch *mb, char *fname);
+int16_t mf_batch_dir(mf_batch *mb, char *dir);
+int16_t mf_batch_run(mf_batch *mb);
+void mf_batch_close(mf_batch *mb);
+
+/* Push parser: bytes are pushed in chunks of any size */
+mf_reader *mf_reader_push(void);
+int16_t mf_feed(mf_reader *mr, const uint8_t *bytes, uint32_t n);
+int16_t mf_feed_end(mf_reader *mr);
+
 int16_t mf_read( char           *fname       ,
                  mf_fn_error     fn_error    ,
                  mf_fn_header    fn_header   ,
@@ -163,19 +287,41 @@ int16_t mf_read( char           *fname       ,
 /********************************************/
 #define mf_type_file 1
 
+#define MF_RUNNING_STATUS 0x0100
+
+
+/* Output function for mf_new_sink(): must return 0 on success */
+typedef int16_t (*mf_fn_sink) (void *aux, uint8_t *data, uint32_t len);
 
 typedef struct {
   uint16_t  type;
   FILE     *file;
-  uint32_t  len_pos;    /* where to write (in the file) the track len */
+  mf_fn_sink sink;      /* user function to write data to (if not NULL) */
+  void     *sink_aux;
+  uint8_t  *buf;        /* tracks are encoded here before being written */
+  uint32_t  buf_cnt;
+  uint32_t  buf_max;
+  uint32_t  trk_pos;    /* where the current track starts (in buf) */
   uint32_t  trk_len;    /* Total track length */
   int16_t   trk_cnt;    /* How many tracks? */
+  int16_t   trk_num;    /* How many tracks are expected (0: unknown) */
   int16_t   division;
+  int16_t   format;     /* 0, 1 or 2 (-1: 0 for one track, 1 otherwise) */
   int16_t   trk_in;     /* 0: before track 1: in track */
+  int16_t   hdr_out;    /* 1: header chunk has been written */
+  int16_t   own;        /* 1: file must be closed by mf_close() */
+  int16_t   flags;
+  int16_t   status;     /* last status byte written (for running status) */
   int16_t   chan;       /* current channel  (0-15) */
+  mf_stats  stats;
 } mf_writer;
 
 mf_writer *mf_new (char *fname, int16_t division);
+mf_writer *mf_new_file (FILE *f, int16_t division);
+mf_writer *mf_new_sink (mf_fn_sink sink, void *aux, int16_t division);
+int16_t mf_set_ntracks (mf_writer *mw, int16_t ntracks);
+int16_t mf_set_running (mf_writer *mw, int16_t on);
+int16_t mf_set_format (mf_writer *mw, int16_t format);
 int16_t mf_close (mf_writer *mw);
 
 int16_t mf_track_start (mf_writer *mw);
@@ -232,6 +378,15 @@ void mf_sequencer_specific(uint32_t delta, int32_t len, char *data);
 
 int16_t mf_numparms(int16_t s);
 
+/* Variable length quantities (at most four bytes, values up to 0x0FFFFFFF).
+** mf_vlq_put() and mf_vlq_encode() write whole words: reserve four bytes
+** per value in the destination.
+*/
+int32_t  mf_vlq_get(const uint8_t **p, const uint8_t *end);
+uint32_t mf_vlq_put(uint8_t *p, uint32_t n);
+int32_t  mf_vlq_decode(const uint8_t *src, uint32_t len, uint32_t *dst, uint32_t n);
+uint32_t mf_vlq_encode(const uint32_t *src, uint32_t n, uint8_t *dst);
+
 /*****************************/
 
 #define mf_type_seq 2
@@ -245,17 +400,54 @@ int16_t mf_numparms(int16_t s);
 #define MF_UNSORTED       0
 #define MF_SORTED_BYTRACK 1
 #define MF_SORTED_BYTICK  2
+#define MF_READONLY       4  /* mapped from a snapshot: can't be changed */
+/* Set MF_RUNNING_STATUS in ms->flags to use running status in mf_seq_save()/mf_seq_render() */
 #define MF_NO_EVENT 0xFFFFFFFE
 
+/* Read only view of an event in a sequence */
+typedef struct {
+  uint32_t       tick;
+  uint8_t        track;
+  uint8_t        status;  /* 0x80-0xE0 for channel events, 0xF0, 0xF7 or 0xFF */
+  uint8_t        chan;    /* channel (0-15) or meta event type */
+  uint8_t        data1;
+  uint8_t        data2;
+  uint32_t       len;     /* length of data for sysex and meta events */
+  const uint8_t *data;    /* points into the sequence, it's not a copy! */
+} mf_evt;
+
+#define mf_evt_is_midi(e) ((e)->status < 0xF0)
+
+/* Structure of arrays filled by mf_evt_batch() */
+typedef struct {
+  uint32_t  cnt;
+  uint32_t *tick;
+  uint8_t  *track;
+  uint8_t  *status;
+  uint8_t  *chan;
+  uint8_t  *data1;
+  uint8_t  *data2;
+} mf_evt_soa;
+
+/* Memory for the sequence buffers is requested to a function with the
+** same semantic of realloc(): a new block is allocated if ptr is NULL
+** and ptr is released if sz is 0. The old size of the block is passed
+** to make it easy to implement arenas.
+*/
+typedef void *(*mf_fn_alloc) (void *aux, void *ptr, size_t old_sz, size_t sz);
+
 typedef struct {
   uint16_t type;
   uint16_t flags;
   
-  uint8_t  *buf;  uint32_t buf_cnt;  uint32_t buf_max;
-  uint32_t *evt;  uint32_t evt_cnt;  uint32_t evt_max;
+  uint8_t  *buf;  uint32_t buf_cnt;  uint32_t buf_max;  /* sysex and meta data */
+  uint64_t *evt;  uint32_t evt_cnt;  uint32_t evt_max;  /* packed events */
+  uint32_t *sys;  uint32_t sys_cnt;  uint32_t sys_max;  /* offsets in buf */
+  uint64_t *tmp;  uint32_t tmp_max;                     /* scratch for sorting */
   
   char    *fname;
   int16_t  division;
+  int16_t  format;    /* of the file to write (-1: 0 or 1 depending on the tracks) */
   int16_t  curtrack;
   uint32_t curevt;
   uint32_t savtick[MF_MAX_SAV];
@@ -265,14 +457,49 @@ typedef struct {
   uint8_t  curvel[MF_MAX_TRACKS];
   uint8_t  curnote[MF_MAX_TRACKS];
   uint16_t cursav;
+  mf_evt   view;
+  int16_t  nthreads;  /* threads used to encode the tracks */
+  mf_fn_alloc alloc;  /* allocator for buf, evt and sys */
+  void       *alloc_aux;
+  mf_stats    stats;  /* sorting and encoding */
 
 } mf_seq;  
 
 mf_seq *mf_seq_new (char *fname, uint16_t division);
 int16_t mf_seq_close(mf_seq *ms);
+int16_t mf_seq_save(mf_seq *ms);
+int16_t mf_seq_render(mf_seq *ms, uint8_t *tracks, int16_t ntracks, uint8_t **buf, uint32_t *len);
+/* Loading in an empty sequence leaves it sorted by track (no sort needed
+** to save it) only if the file has the events of each tick in the order
+** of the sort, otherwise it's sorted as any other sequence. */
+int16_t mf_seq_load(mf_seq *ms, char *fname);
+int16_t mf_seq_set_threads(mf_seq *ms, int16_t nthreads);
+int16_t mf_seq_set_format(mf_seq *ms, int16_t format);
+
+/* Snapshots: the sorted sequence saved as it is in memory, to be loaded
+** with no parsing. With MF_SNAP_MAP the file is mapped and the sequence
+** is read only; MF_SNAP_VERIFY checks the whole content.
+*/
+#define MF_SNAP_MAP     1
+#define MF_SNAP_VERIFY  2
+
+int16_t mf_seq_snap_save(mf_seq *ms, char *fname);
+mf_seq *mf_seq_snap_load(char *fname, uint16_t flags);
+
+/* Reuse a sequence: events are discarded but the memory is kept */
+int16_t mf_seq_reset(mf_seq *ms, char *fname, uint16_t division);
+int16_t mf_seq_reserve(mf_seq *ms, uint32_t nevt, uint32_t nbytes);
+int16_t mf_seq_set_alloc(mf_seq *ms, mf_fn_alloc fn, void *aux);
 int16_t mf_seq_set_track(mf_seq *ms, int16_t track);
 int16_t mf_seq_get_track(mf_seq *ms);
 int16_t mf_seq_evt(mf_seq *ms, uint32_t tick, uint16_t type, uint16_t chan, uint16_t data1, uint16_t data2);
+
+/* A sequence holds at most MF_SEQ_MAX_SYS sysex and meta events (text
+** included): their index is stored in the 21 bits of the event payload.
+** Past that mf_seq_sys(), and mf_seq_load() for a file with more, return 747.
+*/
+#define MF_SEQ_MAX_SYS  0x200000
+
 int16_t mf_seq_sys(mf_seq *ms, uint32_t tick, uint16_t type, uint16_t aux, int32_t len, uint8_t *data);
 
 #define mf_seq_txt_evt(ms, tick, type, txt)   mf_seq_sys(ms, tick, mf_st_meta_event, (type) & 0x0F, -1, (uint8_t *)(txt))
@@ -315,16 +542,98 @@ uint32_t mf_seq_tick(mf_seq *ms, uint32_t mrk, uint32_t tick);
 int16_t mf_seq_bytrack(mf_seq *ms);
 int16_t mf_seq_bytick(mf_seq *ms);
 
+/* Iterate over the events of a sorted sequence. The returned view is
+** valid until the next call.
+*/
+mf_evt *mf_evt_first(mf_seq *ms);
+mf_evt *mf_evt_next(mf_seq *ms);
+mf_evt *mf_evt_prev(mf_seq *ms);
+uint32_t mf_evt_count(mf_seq *ms);
+
+int16_t  mf_evt_get(mf_seq *ms, uint32_t n, mf_evt *e);
+uint32_t mf_evt_batch(mf_seq *ms, uint32_t first, uint32_t n, mf_evt_soa *b);
+
+/* Notes: note on/off events paired in a single array */
+typedef struct {
+  uint32_t tick;
+  uint32_t dur;
+  uint8_t  track;
+  uint8_t  chan;
+  uint8_t  pitch;
+  uint8_t  vel;
+  uint8_t  off_vel;
+} mf_note;
+
+typedef struct {
+  mf_note  *note;  uint32_t note_cnt;  uint32_t note_max;
+  uint32_t  unmatched;  /* note off with no note on */
+  uint32_t  unclosed;   /* note on with no note off (ends with the track) */
+} mf_notes;
+
+mf_notes *mf_notes_new(mf_seq *ms);
+int16_t   mf_notes_free(mf_notes *mn);
+
+/* Tempo map: converts ticks to microseconds and back.
+** The division can be PPQ (positive) or SMPTE (negative).
+** In format 2 each track is an independent pattern with its own tempo:
+** mf_tempo_seq() and mf_tempo_file() only use the first track then, use
+** mf_tempo_track() for the others (track -1 means all of them).
+*/
+typedef struct {
+  uint32_t tick;
+  uint32_t tempo;  /* us per quarter note (for PPQ divisions) */
+  uint64_t us;     /* time at tick */
+} mf_tempo_seg;
+
+typedef struct {
+  mf_tempo_seg *seg;  uint32_t seg_cnt;  uint32_t seg_max;
+  uint32_t      den;
+  int16_t       division;
+} mf_tempo;
+
+mf_tempo *mf_tempo_new(int16_t division);
+mf_tempo *mf_tempo_seq(mf_seq *ms);
+mf_tempo *mf_tempo_track(mf_seq *ms, int16_t track);
+mf_tempo *mf_tempo_file(char *fname);
+int16_t   mf_tempo_free(mf_tempo *mt);
+int16_t   mf_tempo_set(mf_tempo *mt, uint32_t tick, uint32_t tempo);
+uint64_t  mf_tempo_us(mf_tempo *mt, uint32_t tick);
+uint32_t  mf_tempo_tick(mf_tempo *mt, uint64_t us);
+int16_t   mf_tempo_us_bulk(mf_tempo *mt, const uint32_t *tick, uint64_t *us, uint32_t n);
+
+/* Playback. Events are passed to on_event() at their time (us is the
+** time since the start of the playback) from a dedicated output thread.
+** The sequence must not be changed while playing.
+*/
+typedef struct mf_player_s mf_player;
+typedef int16_t (*mf_fn_play) (void *aux, mf_evt *e, uint64_t us);
+
+#define MF_JITTER_BINS 100  /* delay of each event, 10us per bin */
+#define MF_JITTER_STEP  10  /* (the last bin is for 990us and more) */
+
+typedef struct {
+  uint32_t count;
+  uint32_t max_us;
+  uint32_t bin[MF_JITTER_BINS];
+} mf_jitter;
+
+mf_player       *mf_play_new(mf_seq *ms, mf_fn_play on_event, void *aux);
+int16_t          mf_play_start(mf_player *mp);
+int16_t          mf_play_wait(mf_player *mp);
+int16_t          mf_play_stop(mf_player *mp);
+int16_t          mf_play_close(mf_player *mp);
+const mf_jitter *mf_play_jitter(mf_player *mp);
+
 uint8_t mf_pitch_str(char *s);
 
 /* ****************************** */
 
 
-#define mf_whole_n(m)      (((m)->division) * 4)
-#define mf_half_n(m)       (((m)->division) * 2)
-#define mf_quarter_n(m)    (((m)->division))
-#define mf_eigth_n(m)      (((m)->division) / 2)
-#define mf_sixteenth_n(m)  (((m)->division) / 4)
+#define mf_whole_n(m)      (mf_div_quarter((m)->division) * 4)
+#define mf_half_n(m)       (mf_div_quarter((m)->division) * 2)
+#define mf_quarter_n(m)    (mf_div_quarter((m)->division))
+#define mf_eigth_n(m)      (mf_div_quarter((m)->division) / 2)
+#define mf_sixteenth_n(m)  (mf_div_quarter((m)->division) / 4)
 
 #define mf_dot_n(d)         (((d)*3)/2)
 #define mf_ddot_n(d)        (((d)*7)/8)
@@ -345,6 +654,7 @@ uint8_t mf_pitch_str(char *s);
 #define ms_new(...)  mf_seq_new(mf_arg0(__VA_ARGS__,NULL),\
                                 mf_arg1(__VA_ARGS__, MF_DIVISION, MF_DIVISION))
 
+#define ms_save(m)   mf_seq_save(m)
 #define ms_close(m)  mf_seq_close(m)
 
 #define ms_note(...)  mf_seq_note(mf_arg0(__VA_ARGS__,NULL),\
@@ -0,0 +1,302 @@
+/*
+**  (C) by Remo Dentato (rdentato@gmail.com)
+**
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Scans many files in parallel with mf_batch_run() and prints, for the
+**  whole set, the number of events of each kind and the files with
+**  errors. Arguments are files or directories (searched recursively for
+**  .mid, .midi, .smf and .kar files); -l reads the names from a list
+**  file ("-" for stdin), one per line.
+**
+**  Without arguments it runs its own tests on a few generated files.
+**
+**  Usage: t_batch [-j threads] [-t] [-l list] [file|dir ...]
+*/
+
+#include "umf.h"
+#include "dbg.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 1024
+
+/* Counters of each thread, padded so that threads don't share cache lines */
+typedef struct {
+  uint64_t evt[MF_STAT_CLASSES];
+  uint64_t files;
+  uint64_t bytes;
+  uint64_t pad[5];
+} thr_count;
+
+static thr_count cnt[MAX_THREADS];
+static int16_t   quiet = 0;
+
+static int16_t bt_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
+                                                         int16_t data1, int16_t data2)
+{
+  cnt[mr->thread].evt[mf_stat_class(type)]++;
+  return 0;
+}
+
+static int16_t bt_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
+                                                        int32_t len, uint8_t *data)
+{
+  cnt[mr->thread].evt[mf_stat_class(type)]++;
+  return 0;
+}
+
+static int16_t bt_error(mf_reader *mr, int16_t err, char *msg)
+{
+  if (!quiet && (mr->flags & MF_TOLERANT) && msg)
+    fprintf(stderr, "  file %d track %d: %03d %s\n", mr->filenum, mr->track, err, msg);
+  return err;
+}
+
+static int16_t bt_file(mf_reader *mr, int32_t filenum, char *fname, int16_t err)
+{
+  cnt[mr->thread].files++;
+  cnt[mr->thread].bytes += mr->mem_end - mr->mem;
+  if (quiet) return 0;
+  if (err) fprintf(stderr, "%s: error %03d\n", fname, err);
+  else if (mr->err_cnt) fprintf(stderr, "%s: %u problems\n", fname, mr->err_cnt);
+  return 0;
+}
+
+static void count_sum(thr_count *tot)
+{
+  int k, c;
+
+  memset(tot, 0, sizeof(thr_count));
+  for (k=0; k<MAX_THREADS; k++) {
+    for (c=0; c<MF_STAT_CLASSES; c++) tot->evt[c] += cnt[k].evt[c];
+    tot->files += cnt[k].files;
+    tot->bytes += cnt[k].bytes;
+  }
+  memset(cnt, 0, sizeof(cnt));
+}
+
+static mf_batch *batch_new(int16_t nthreads, int16_t tolerant)
+{
+  mf_batch *mb = mf_batch_new(nthreads);
+
+  if (mb) {
+    mb->mr->on_error    = bt_error;
+    mb->mr->on_midi_evt = bt_midi_evt;
+    mb->mr->on_sys_evt  = bt_sys_evt;
+    mb->on_file         = bt_file;
+    mf_set_tolerant(mb->mr, tolerant);
+  }
+  return mb;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* == The tool */
+
+static int16_t add_list(mf_batch *mb, char *list)
+{
+  FILE   *f;
+  char    line[4096];
+  size_t  n;
+  int16_t err, ret = 0;
+
+  f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+  if (!f) return 907;
+  while (fgets(line, sizeof(line), f)) {
+    n = strlen(line);
+    while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = '\0';
+    if (n == 0) continue;
+    if ((err = mf_batch_add(mb, line))) {
+      fprintf(stderr, "%s: error %03d\n", line, err);
+      ret = err;
+    }
+  }
+  if (f != stdin) fclose(f);
+  return ret;
+}
+
+static int tool(int argc, char *argv[])
+{
+  static char *cls[] = {"note off", "note on", "key pressure", "control change",
+                        "program change", "channel pressure", "pitch bend",
+                        "sysex", "meta"};
+  mf_batch *mb;
+  thr_count tot;
+  char     *list = NULL;
+  int16_t   nthreads, tolerant = 0, err;
+  int32_t   k, nerr = 0;
+  uint64_t  nevt = 0;
+  double    t;
+  int       c;
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((c = getopt(argc, argv, "j:tl:")) != -1) {
+    if (c == 'j') nthreads = atoi(optarg);
+    else if (c == 't') tolerant = 1;
+    else if (c == 'l') list = optarg;
+    else {
+      fprintf(stderr, "Usage: t_batch [-j threads] [-t] [-l list] [file|dir ...]\n");
+      return 1;
+    }
+  }
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+  mb = batch_new(nthreads, tolerant);
+  if (!mb) return 1;
+
+  if (list) add_list(mb, list);
+  for (k=optind; k<argc; k++) {
+    err = mf_batch_dir(mb, argv[k]);
+    if (err == 907) err = mf_batch_add(mb, argv[k]);  /* not a directory */
+    if (err) fprintf(stderr, "%s: error %03d\n", argv[k], err);
+  }
+
+  t = now();
+  mf_batch_run(mb);
+  t = now() - t;
+
+  for (k=0; k<mb->cnt; k++) if (mb->err[k]) nerr++;
+  count_sum(&tot);
+  for (c=0; c<MF_STAT_CLASSES; c++) nevt += tot.evt[c];
+
+  printf("files:   %d (%d with errors) on %d threads\n", mb->cnt, nerr, mb->nthreads);
+  printf("bytes:   %" PRIu64 "\n", tot.bytes);
+  printf("events:  %" PRIu64 "\n", nevt);
+  for (c=0; c<MF_STAT_CLASSES; c++)
+    if (tot.evt[c]) printf("  %-17s %" PRIu64 "\n", cls[c], tot.evt[c]);
+  if (t > 0)
+    printf("time:    %.3f s (%.0f files/s, %.2f MB/s)\n", t, mb->cnt / t, tot.bytes / t / (1024.0 * 1024.0));
+
+  mf_batch_close(mb);
+  return nerr > 0;
+}
+
+/* == Tests */
+
+#define NFILES 9
+
+static char *fname[NFILES] = {"ba.mid", "bb.mid", "bc.mid", "bd.mid", "be.mid",
+                              "bf.mid", "bg.mid", "bh.mid", "bi.mid"};
+
+/* Writes a file with k*50+1 notes and, if k is even, a sysex;
+** returns the number of events */
+static uint64_t make_file(int k, uint8_t *sysex)
+{
+  mf_writer *mw;
+  uint64_t   nevt = 0;
+  int        n, len = 100 * (k+1);
+
+  mw = mf_new(fname[k], 96);
+  if (!mw) return 0;
+  mf_track_start(mw);
+  mf_set_tempo(mw, 0, 500000); nevt++;
+  mf_track_start(mw);
+  for (n=0; n <= k * 50; n++) {
+    mf_note_on(mw, 0, 1, 60 + n % 12, 90);
+    mf_note_off(mw, 24, 1, 60 + n % 12);
+    nevt += 2;
+  }
+  if ((k & 1) == 0) {
+    sysex[len-1] = 0xF7;
+    mf_sys_evt(mw, 0, mf_st_system_exclusive, 0, len, sysex);
+    sysex[len-1] = 0x00;
+    nevt++;
+  }
+  mf_close(mw);
+  return nevt;
+}
+
+static void tests(void)
+{
+  static uint8_t sysex[1024], tmp[8192];
+  mf_batch *mb;
+  thr_count tot;
+  uint64_t  expected = 0, nevt;
+  uint32_t  sz;
+  uint8_t  *buf;
+  int16_t   ret;
+  int       k, c;
+  FILE     *f;
+
+  quiet = 1;
+  for (k=0; k<NFILES-1; k++) expected += make_file(k, sysex);
+
+  /* The last one is truncated in its sysex */
+  make_file(NFILES-1, sysex);
+  if ((f = fopen(fname[NFILES-1], "rb"))) {
+    sz = fread(tmp, 1, sizeof(tmp), f);
+    fclose(f);
+    if ((f = fopen(fname[NFILES-1], "wb"))) {
+      fwrite(tmp, 1, sz - 10, f);
+      fclose(f);
+    }
+  }
+
+  mb = batch_new(4, 0);
+  dbgchk(mb != NULL, "\n");
+  for (k=0; k<NFILES; k++) mf_batch_add(mb, fname[k]);
+  ret = mf_batch_add(mb, "no such file.mid");
+  dbgchk(ret == 907 && mb->cnt == NFILES, "ret: %d cnt: %d\n", ret, mb->cnt);
+
+  ret = mf_batch_run(mb);
+  count_sum(&tot);
+  for (nevt=0, c=0; c<MF_STAT_CLASSES; c++) nevt += tot.evt[c];
+  dbgchk(ret != 0 && ret == mb->err[NFILES-1], "ret: %d\n", ret);
+  for (k=0; k<NFILES-1; k++) dbgchk(mb->err[k] == 0, "file: %d err: %d\n", k, mb->err[k]);
+  dbgchk(tot.files == NFILES && tot.evt[7] == 4, "files: %" PRIu64 " sysex: %" PRIu64 "\n", tot.files, tot.evt[7]);
+
+  /* It can be run again */
+  ret = mf_batch_run(mb);
+  count_sum(&tot);
+  dbgchk(ret == mb->err[NFILES-1] && tot.files == NFILES, "ret: %d\n", ret);
+  mf_batch_close(mb);
+
+  /* One thread, only the good files: the same events */
+  mb = batch_new(1, 0);
+  for (k=0; k<NFILES-1; k++) mf_batch_add(mb, fname[k]);
+  ret = mf_batch_run(mb);
+  count_sum(&tot);
+  for (nevt=0, c=0; c<MF_STAT_CLASSES; c++) nevt += tot.evt[c];
+  dbgchk(ret == 0 && nevt == expected, "ret: %d events: %" PRIu64 "/%" PRIu64 "\n",
+                                                      ret, nevt, expected);
+
+  /* A second run reuses the buffer of the first one as it is */
+  buf = mb->thr[0].chrbuf; sz = mb->thr[0].chrbuf_sz;
+  ret = mf_batch_run(mb);
+  count_sum(&tot);
+  dbgchk(ret == 0 && tot.files == NFILES-1 && buf != NULL &&
+         mb->thr[0].chrbuf == buf && mb->thr[0].chrbuf_sz == sz, "ret: %d\n", ret);
+  mf_batch_close(mb);
+
+  /* Tolerant: the truncated file is scanned up to where it ends */
+  mb = batch_new(3, 1);
+  mf_batch_add(mb, fname[NFILES-1]);
+  ret = mf_batch_run(mb);
+  count_sum(&tot);
+  dbgchk(ret == 0 && mb->err[0] == 0 && tot.evt[0] + tot.evt[1] > 0, "ret: %d\n", ret);
+  mf_batch_close(mb);
+
+  /* Directories */
+  mb = batch_new(2, 0);
+  ret = mf_batch_dir(mb, ".");
+  dbgchk(ret == 0 && mb->cnt >= NFILES, "ret: %d cnt: %d\n", ret, mb->cnt);
+  ret = mf_batch_dir(mb, "no such dir");
+  dbgchk(ret == 907, "ret: %d\n", ret);
+  mf_batch_close(mb);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 1) return tool(argc, argv);
+  tests();
+  exit(0);
+}
@@ -0,0 +1,253 @@
+/*
+**  (C) by Remo Dentato (rdentato@gmail.com)
+**
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Tolerant mode. A few known kinds of damage are checked first, then a
+**  valid file is mutated at random (bytes changed, lengths overwritten,
+**  chunks inserted, truncation) and scanned in tolerant mode.
+**
+**  Each mutated file is placed right before a page that can't be read so
+**  that reading past its end crashes the test; the data passed to
+**  on_sys_evt() must be within the file. Build with `make fuzz` to run
+**  it with the address sanitizer and more iterations.
+**
+**  Usage: t_fuzz [iterations [seed]]
+*/
+
+#include "umf.h"
+#include "dbg.h"
+
+#ifndef MF_NO_MMAP
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+static uint32_t rnd_state = 0x12345678;
+static uint32_t rnd(void)
+{
+  uint32_t x = rnd_state;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return (rnd_state = x);
+}
+
+/* == The source file */
+
+static uint8_t  src[4096];
+static uint32_t src_len = 0;
+
+static int16_t src_sink(void *aux, uint8_t *data, uint32_t len)
+{
+  if (src_len + len > sizeof(src)) return 1;
+  memcpy(src + src_len, data, len);
+  src_len += len;
+  return 0;
+}
+
+static void make_src(void)
+{
+  mf_writer *mw;
+  int k;
+
+  mw = mf_new_sink(src_sink, NULL, 96);
+  mf_track_start(mw);
+  mf_text(mw, 0, "Fuzz");
+  mf_set_tempo(mw, 0, 400000);
+  mf_track_start(mw);
+  for (k=0; k<24; k++) {
+    mf_note_on(mw, 0, 1, 40+k, 100);
+    mf_note_off(mw, 48, 1, 40+k);
+  }
+  mf_track_start(mw);
+  mf_sys_evt(mw, 10, mf_st_system_exclusive, 0, 5, (uint8_t *)"\x7E\x7F\x09\x01\xF7");
+  mf_control_change(mw, 5, 2, 7, 90);
+  mf_pitch_bend(mw, 10, 2, -100);
+  mf_close(mw);
+}
+
+/* == Scanning with bounds checks */
+
+static const uint8_t *buf_beg, *buf_end;
+static uint32_t n_evt, n_err, n_eot, n_oob;
+static int16_t  last_err;
+
+static int16_t fz_error(mf_reader *mr, int16_t err, char *msg)
+{ n_err++; last_err = err; return err; }
+
+static int16_t fz_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division)
+{ return 0; }
+
+static int16_t fz_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen)
+{ if (eot) n_eot++; return 0; }
+
+static int16_t fz_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
+                                                         int16_t data1, int16_t data2)
+{ n_evt++; return 0; }
+
+static int16_t fz_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
+                                                        int32_t len, uint8_t *data)
+{
+  if (len < 0 || (len > 0 && (data < buf_beg || data + len > buf_end))) n_oob++;
+  n_evt++;
+  return 0;
+}
+
+/* A buffer whose end is followed by an unreadable page */
+static uint8_t *guard_mem = NULL;
+static size_t   guard_len = 0;
+
+static uint8_t *guard_buf(uint32_t len)
+{
+#ifndef MF_NO_MMAP
+  size_t pg = sysconf(_SC_PAGESIZE);
+
+  if (!guard_mem) {
+    guard_len = (sizeof(src) * 2 + pg - 1) / pg * pg;
+    guard_mem = mmap(NULL, guard_len + pg, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (guard_mem == MAP_FAILED) return NULL;
+    mprotect(guard_mem + guard_len, pg, PROT_NONE);
+  }
+  return guard_mem + guard_len - len;
+#else
+  if (!guard_mem) guard_mem = malloc(sizeof(src) * 2);
+  return guard_mem;
+#endif
+}
+
+static int16_t scan(const uint8_t *buf, uint32_t len, int16_t tolerant)
+{
+  mf_reader *mr;
+  int16_t    ret;
+
+  buf_beg = buf; buf_end = buf + len;
+  n_evt = n_err = n_eot = n_oob = 0;
+  last_err = 0;
+
+  mr = mf_reader_mem(buf, len);
+  if (!mr) return -1;
+  mr->on_error    = fz_error;
+  mr->on_header   = fz_header;
+  mr->on_track    = fz_track;
+  mr->on_midi_evt = fz_midi_evt;
+  mr->on_sys_evt  = fz_sys_evt;
+  mf_set_tolerant(mr, tolerant);
+  ret = mf_scan(mr);
+  mf_reader_close(mr);
+  return ret;
+}
+
+/* Offset of the n-th MTrk chunk */
+static uint32_t trk_pos(uint8_t *buf, uint32_t len, int n)
+{
+  uint32_t k;
+  for (k=14; k+4 <= len; k++)
+    if (memcmp(buf+k, "MTrk", 4) == 0 && n-- == 0) return k;
+  return 0;
+}
+
+static uint32_t mutate(uint8_t *dst)
+{
+  uint32_t len = src_len, k, n, pos;
+
+  memcpy(dst, src, src_len);
+  n = 1 + rnd() % 4;
+  while (n-- > 0) {
+    pos = rnd() % len;
+    switch (rnd() % 6) {
+      case 0:  /* random bytes */
+        for (k = rnd() % 8; k > 0 && pos < len; k--) dst[pos++] = rnd();
+        break;
+      case 1:  /* flip a bit */
+        dst[pos] ^= 1 << (rnd() & 7);
+        break;
+      case 2:  /* a huge or small chunk length */
+        if ((pos = trk_pos(dst, len, rnd() % 3)) > 0) {
+          k = (rnd() & 1) ? rnd() : rnd() % 64;
+          dst[pos+4] = k >> 24; dst[pos+5] = k >> 16; dst[pos+6] = k >> 8; dst[pos+7] = k;
+        }
+        break;
+      case 3:  /* insert a chunk */
+        if (len + 16 <= sizeof(src) * 2) {
+          memmove(dst + pos + 16, dst + pos, len - pos);
+          memcpy(dst + pos, (rnd() & 1) ? "XFIH\0\0\0\x08" : "MTrk\0\0\0\x08", 8);
+          for (k=8; k<16; k++) dst[pos+k] = rnd();
+          len += 16;
+        }
+        break;
+      case 4:  /* truncate */
+        len = pos + 1;
+        break;
+      case 5:  /* a status byte where data is expected and vice versa */
+        dst[pos] = (dst[pos] & 0x80) ? dst[pos] & 0x7F : 0xF1 + rnd() % 14;
+        break;
+    }
+  }
+  return len;
+}
+
+int main(int argc, char *argv[])
+{
+  static uint8_t tmp[sizeof(src) * 2];
+  uint32_t iter = 20000, k, len, pos;
+  uint32_t src_evt, oob = 0, bad_ret = 0;
+  uint8_t *buf;
+  int16_t  ret;
+
+  if (argc > 1) iter = atol(argv[1]);
+  if (argc > 2) rnd_state = atol(argv[2]) | 1;
+
+  make_src();
+  ret = scan(src, src_len, 0);
+  src_evt = n_evt;
+  dbgchk(ret == 0 && src_evt == 53, "ret: %d events: %u\n", ret, src_evt);
+
+  /* A valid file gives the same events and no diagnostics */
+  ret = scan(src, src_len, 1);
+  dbgchk(ret == 0 && n_evt == src_evt && n_err == 0 && n_eot == 3, "ret: %d errors: %u\n", ret, n_err);
+
+  /* An unknown chunk between two tracks is skipped */
+  pos = trk_pos(src, src_len, 1);
+  memcpy(tmp, src, pos);
+  memcpy(tmp + pos, "XFIH\0\0\0\x04" "abcd", 12);
+  memcpy(tmp + pos + 12, src + pos, src_len - pos);
+  ret = scan(tmp, src_len + 12, 0);
+  dbgchk(ret == 120, "ret: %d\n", ret);
+  ret = scan(tmp, src_len + 12, 1);
+  dbgchk(ret == 0 && n_evt == src_evt && n_err == 1 && last_err == 123, "ret: %d err: %d\n", ret, last_err);
+
+  /* Running status with no status: the rest of track 2 is lost, not track 3 */
+  memcpy(tmp, src, src_len);
+  pos = trk_pos(tmp, src_len, 1);
+  tmp[pos + 9] = 0x40;
+  ret = scan(tmp, src_len, 1);
+  dbgchk(ret == 0 && n_evt == 5 && n_err == 1 && last_err == 223 && n_eot == 3,
+         "ret: %d events: %u err: %d\n", ret, n_evt, last_err);
+
+  /* Garbage in place of a chunk header: resync to the next MTrk */
+  memcpy(tmp, src, src_len);
+  pos = trk_pos(tmp, src_len, 1);
+  memcpy(tmp + pos, "\x01\x02\x03\x04", 4);
+  ret = scan(tmp, src_len, 1);
+  dbgchk(ret == 0 && n_evt == 5 && last_err == 120, "ret: %d events: %u err: %d\n", ret, n_evt, last_err);
+
+  /* Truncated file: the last track is clamped */
+  buf = guard_buf(src_len - 3);
+  memcpy(buf, src, src_len - 3);
+  ret = scan(buf, src_len - 3, 1);
+  dbgchk(ret == 0 && n_evt == src_evt && n_err == 2, "ret: %d events: %u errors: %u\n", ret, n_evt, n_err);
+
+  /* Random damage */
+  for (k=0; k<iter; k++) {
+    len = mutate(tmp);
+    buf = guard_buf(len);
+    if (!buf) break;
+    memcpy(buf, tmp, len);
+    ret = scan(buf, len, 1);
+    oob += n_oob;
+    if (ret != 0 && ret != 110 && ret != 111) bad_ret++;
+  }
+  dbgchk(k == iter && oob == 0 && bad_ret == 0, "iterations: %u out of bounds: %u bad returns: %u\n",
+                                                 k, oob, bad_ret);
+  exit(0);
+}
@@ -0,0 +1,207 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+*/
+
+#include "umf.h"
+#include "dbg.h"
+
+static uint32_t n_evt = 0;
+static uint32_t chksum = 0;
+
+#define sum(x) (chksum = chksum * 31 + (uint32_t)(x))
+
+static int16_t my_error(mf_reader *mr, int16_t err, char *msg)
+{ sum(err); return err; }
+
+static int16_t my_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division)
+{ sum(type); sum(ntracks); sum(division); return 0; }
+
+static int16_t my_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen)
+{ sum(eot); sum(tracknum); sum(tracklen); return 0; }
+
+static int16_t my_midi_evt(mf_reader *mr, uint32_t delta, int16_t type, int16_t chan,
+                                                           int16_t data1, int16_t data2)
+{ n_evt++; sum(delta); sum(type); sum(chan); sum(data1); sum(data2); return 0; }
+
+static int16_t my_sys_evt(mf_reader *mr, uint32_t delta, int16_t type, int16_t aux,
+                                                           int32_t len,  uint8_t *data)
+{
+  n_evt++; sum(delta); sum(type); sum(aux); sum(len);
+  while (len-- > 0) sum(*data++);
+  return 0;
+}
+
+static int16_t scan(mf_reader *mr)
+{
+  int16_t ret;
+
+  n_evt = 0; chksum = 0;
+  if (!mr) return -1;
+  mr->on_error    = my_error;
+  mr->on_header   = my_header;
+  mr->on_track    = my_track;
+  mr->on_midi_evt = my_midi_evt;
+  mr->on_sys_evt  = my_sys_evt;
+  ret = mf_scan(mr);
+  mf_reader_close(mr);
+  return ret;
+}
+
+static uint32_t n_trk = 0;
+
+static int16_t cnt_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen)
+{ n_trk++; return 0; }
+
+/* Scan with filters: classes, a meta type (if >= 0) and a track (if > 0) */
+static int16_t scan_skip(mf_reader *mr, uint16_t cls, int16_t meta, int16_t trk)
+{
+  int16_t ret;
+
+  if (!mr) return -1;
+  mf_skip(mr, cls);
+  if (meta >= 0) mf_skip_meta(mr, meta, 1);
+  if (trk > 0) mf_skip_track(mr, trk, 1);
+  n_evt = 0; chksum = 0; n_trk = 0;
+  mr->on_error    = my_error;
+  mr->on_header   = my_header;
+  mr->on_track    = cnt_track;
+  mr->on_midi_evt = my_midi_evt;
+  mr->on_sys_evt  = my_sys_evt;
+  ret = mf_scan(mr);
+  mf_reader_close(mr);
+  return ret;
+}
+
+/* Push the buffer in chunks of the given size, or split at the offsets
+** in cut[] (ending with 0) if it is not NULL */
+static int16_t feed(uint8_t *buf, uint32_t len, uint32_t chunk, uint32_t *cut)
+{
+  mf_reader *mr;
+  uint32_t k, n;
+  int16_t ret = 0;
+
+  n_evt = 0; chksum = 0;
+  mr = mf_reader_push();
+  if (!mr) return -1;
+  mr->on_error    = my_error;
+  mr->on_header   = my_header;
+  mr->on_track    = my_track;
+  mr->on_midi_evt = my_midi_evt;
+  mr->on_sys_evt  = my_sys_evt;
+  for (k=0; k < len && !ret; k += n) {
+    if (cut) n = (*cut && *cut < len) ? *cut++ - k : len - k;
+    else n = (len - k < chunk) ? len - k : chunk;
+    ret = mf_feed(mr, buf+k, n);
+  }
+  if (!ret) ret = mf_feed_end(mr);
+  mf_reader_close(mr);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  mf_writer *mw;
+  FILE *f;
+  uint8_t buf[1024];
+  uint32_t len;
+  uint32_t n_file, sum_file;
+  uint32_t cut[] = {14, 22, 32, 36, 40, 0};
+  int16_t ret;
+  int k;
+
+  mw = mf_new("mm.mid", 192);
+  dbgchk(mw != NULL, "");
+  if (!mw) exit(1);
+
+  mf_track_start(mw);
+  mf_text(mw, 0, "Memory");
+  for (k=0; k<32; k++) {
+    mf_note_on(mw, 0, k & 0x0F, 40+k, 100);
+    mf_note_off(mw, 96, k & 0x0F, 40+k);
+  }
+  mf_track_start(mw);
+  mf_sys_evt(mw, 10, mf_st_system_exclusive, 0, 5, (uint8_t *)"\x7E\x7F\x09\x01\xF7");
+  mf_pitch_bend(mw, 10, 3, -100);
+  mf_close(mw);
+
+  ret = scan(mf_reader_new("mm.mid"));
+  n_file = n_evt; sum_file = chksum;
+  dbgchk(ret == 0, "ret: %d\n", ret);
+  dbgchk(n_file == 67, "events: %u\n", n_file);
+
+  ret = scan(mf_reader_map("mm.mid"));
+  dbgchk(ret == 0 && n_evt == n_file && chksum == sum_file, "ret: %d\n", ret);
+
+  f = fopen("mm.mid", "rb");
+  len = f ? fread(buf, 1, sizeof(buf), f) : 0;
+  if (f) fclose(f);
+
+  ret = scan(mf_reader_mem(buf, len));
+  dbgchk(ret == 0 && n_evt == n_file && chksum == sum_file, "ret: %d\n", ret);
+
+  /* Truncated buffer must fail without reading past the end */
+  ret = scan(mf_reader_mem(buf, len - 7));
+  dbgchk(ret != 0, "ret: %d\n", ret);
+
+  /* Pushing it in chunks of any size gives the same events */
+  for (k=1; k<=1024; k = k*4 - 1) {
+    ret = feed(buf, len, k, NULL);
+    dbgchk(ret == 0 && n_evt == n_file && chksum == sum_file, "chunk: %d ret: %d\n", k, ret);
+  }
+
+  /* Or split exactly where the header, the track header and the events end */
+  ret = feed(buf, len, 0, cut);
+  dbgchk(ret == 0 && n_evt == n_file && chksum == sum_file, "ret: %d\n", ret);
+  ret = feed(buf, len - 7, 5, NULL);
+  dbgchk(ret == 130, "ret: %d\n", ret);
+
+  /* Filters: 64 notes, 1 text, 1 sysex, 1 pitch bend in two tracks */
+  ret = scan_skip(mf_reader_new("mm.mid"), MF_SKIP(mf_st_note_on) | MF_SKIP(mf_st_note_off), -1, 0);
+  dbgchk(ret == 0 && n_evt == 3 && n_trk == 4, "ret: %d events: %u\n", ret, n_evt);
+  ret = scan_skip(mf_reader_mem(buf, len), MF_SKIP_SYSEX, mf_me_text, 0);
+  dbgchk(ret == 0 && n_evt == 65, "ret: %d events: %u\n", ret, n_evt);
+  ret = scan_skip(mf_reader_new("mm.mid"), MF_SKIP_META | MF_SKIP_MIDI, -1, 0);
+  dbgchk(ret == 0 && n_evt == 1 && n_trk == 4, "ret: %d events: %u\n", ret, n_evt);
+  ret = scan_skip(mf_reader_new("mm.mid"), 0, -1, 1);
+  dbgchk(ret == 0 && n_evt == 2 && n_trk == 2, "ret: %d events: %u\n", ret, n_evt);
+  ret = scan_skip(mf_reader_mem(buf, len), 0, -1, 2);
+  dbgchk(ret == 0 && n_evt == 65 && n_trk == 2, "ret: %d events: %u\n", ret, n_evt);
+
+  /* Variable length quantities: boundaries round trip, at any offset from the end */
+  {
+    uint32_t vals[] = {0, 0x40, 0x7F, 0x80, 0x2000, 0x3FFF, 0x4000, 0x100000,
+                       0x1FFFFF, 0x200000, 0x8000000, 0x0FFFFFFF};
+    uint32_t nv = sizeof(vals)/sizeof(vals[0]);
+    uint32_t out[16];
+    const uint8_t *p;
+    int32_t v;
+
+    len = mf_vlq_encode(vals, nv, buf);
+    dbgchk(len == 1+1+1+2+2+2+3+3+3+4+4+4, "len: %u\n", len);
+    ret = mf_vlq_decode(buf, len, out, 16);
+    dbgchk(ret == (int16_t)nv && memcmp(vals, out, sizeof(vals)) == 0, "ret: %d\n", ret);
+
+    for (k=0; k<(int)nv; k++) {
+      len = mf_vlq_put(buf, vals[k]);   /* last one at the very end */
+      p = buf;
+      v = mf_vlq_get(&p, buf + len);
+      dbgchk(v == (int32_t)vals[k] && p == buf + len, "val: %X got: %X\n", vals[k], v);
+      p = buf;
+      v = (len > 1) ? mf_vlq_get(&p, buf + len - 1) : -1;
+      dbgchk(v == -1 && p == buf, "val: %X got: %X\n", vals[k], v);
+    }
+
+    /* More than four bytes are rejected */
+    memcpy(buf, "\x81\x80\x80\x80\x00\x00\x00\x00", 8);
+    p = buf;
+    v = mf_vlq_get(&p, buf + 8);
+    dbgchk(v == -2 && p == buf, "got: %X\n", v);
+    ret = mf_vlq_decode(buf, 8, out, 16);
+    dbgchk(ret == -1, "ret: %d\n", ret);
+  }
+
+  exit(0);
+}
@@ -49,6 +49,7 @@ int main(int argc, char *argv[])
     ms_note(m,70,d);
     ms_note(m,68,d);
 
+    ms_save(m);
     ms_close(m);
   }
   exit(0);
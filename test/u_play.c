@@ -0,0 +1,87 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Plays a short sequence with a tempo change to a dummy output and
+**  checks the time at which each event has been scheduled.
+*/
+
+#include "umf.h"
+#include "dbg.h"
+
+#define NEVT 32
+
+typedef struct {
+  uint32_t n;
+  uint32_t tick[NEVT+2];
+  uint64_t us[NEVT+2];
+} play_log;
+
+static int16_t dummy_out(void *aux, mf_evt *e, uint64_t us)
+{
+  play_log *pl = aux;
+
+  if (pl->n >= NEVT+2) return 1;
+  pl->tick[pl->n] = e->tick;
+  pl->us[pl->n]   = us;
+  pl->n++;
+  return 0;
+}
+
+/* 100000us per quarter for the first quarter, then 50000us */
+static uint64_t expected_us(uint32_t tick)
+{
+  if (tick < 96) return (uint64_t)tick * 100000 / 96;
+  return 100000 + (uint64_t)(tick - 96) * 50000 / 96;
+}
+
+int main(int argc, char *argv[])
+{
+  mf_seq    *ms;
+  mf_player *mp;
+  play_log   pl;
+  const mf_jitter *jt;
+  uint32_t k, n;
+  int ok;
+
+  ms = mf_seq_new("pl.mid", 96);
+  mf_seq_set_tempo(ms, 0, 100000);
+  mf_seq_set_tempo(ms, 96, 50000);
+  for (k=0; k<NEVT; k++)
+    mf_seq_evt(ms, k * 12, mf_st_note_on, 0, 60, k & 1 ? 0 : 90);
+
+  pl.n = 0;
+  mp = mf_play_new(ms, dummy_out, &pl);
+  dbgchk(mp != NULL, "");
+  if (mp) {
+    ok = mf_play_start(mp);
+    if (!ok) ok = mf_play_wait(mp);
+    dbgchk(ok == 0 && pl.n == NEVT+2, "err: %d events: %u\n", ok, pl.n);
+
+    ok = 1;
+    for (k=0; k < pl.n; k++)
+      ok = ok && pl.us[k] == expected_us(pl.tick[k]) && (k == 0 || pl.tick[k-1] <= pl.tick[k]);
+    dbgchk(ok, "");
+
+    jt = mf_play_jitter(mp);
+    for (k=0, n=0; k < MF_JITTER_BINS; k++) n += jt->bin[k];
+    dbgchk(jt->count == pl.n && n == pl.n, "count: %u\n", jt->count);
+    dbgmsg("max jitter: %u us\n", jt->max_us);
+    mf_play_close(mp);
+  }
+
+  /* Stopping */
+  pl.n = 0;
+  mp = mf_play_new(ms, dummy_out, &pl);
+  if (mp) {
+    mf_play_start(mp);
+    ok = mf_play_stop(mp);
+    dbgchk(ok == 0 && pl.n < NEVT+2, "err: %d events: %u\n", ok, pl.n);
+    mf_play_close(mp);
+  }
+
+  mf_seq_close(ms);
+  exit(0);
+}
@@ -1,9 +1,52 @@
 
 #include "umf.h"
+#include "dbg.h"
+
+static int same_file(char *a, char *b)
+{
+  FILE *fa, *fb;
+  int ca, cb;
+
+  fa = fopen(a, "rb"); fb = fopen(b, "rb");
+  if (!fa || !fb) return 0;
+  do {
+    ca = fgetc(fa); cb = fgetc(fb);
+  } while (ca == cb && ca != EOF);
+  fclose(fa); fclose(fb);
+  return ca == cb;
+}
+
+static int same_mem(char *a, uint8_t *buf, uint32_t len)
+{
+  FILE *fa;
+  uint32_t k = 0;
+  int ca;
+
+  fa = fopen(a, "rb");
+  if (!fa) return 0;
+  while ((ca = fgetc(fa)) != EOF && k < len && ca == buf[k]) k++;
+  fclose(fa);
+  return ca == EOF && k == len;
+}
+
+static int n_alloc = 0, n_free = 0;
+
+static void *cnt_alloc(void *aux, void *ptr, size_t old_sz, size_t sz)
+{
+  if (sz == 0) { n_free++; free(ptr); return NULL; }
+  if (!ptr) n_alloc++;
+  return realloc(ptr, sz);
+}
 
 int main(int argc, char *argv[])
 {
   mf_seq *m;
+  mf_evt *e;
+  mf_evt_soa b;
+  uint32_t ticks[16];
+  uint8_t  track[16], status[16], chan[16], data1[16], data2[16];
+  uint32_t tick, n;
+  int ok;
 
   m = mf_seq_new("ss.mid", 384);
 
@@ -21,13 +64,275 @@ int main(int argc, char *argv[])
     mf_seq_evt (m, 255, mf_st_note_on, 1, 64, 0);
 
     mf_seq_text(m,255,"ABCDE");
+
+    mf_seq_bytick(m);
+    ok = 1; n = 0; tick = 0;
+    for (e = mf_evt_first(m); e; e = mf_evt_next(m)) {
+      if (e->tick < tick) ok = 0;
+      tick = e->tick;
+      n++;
+    }
+    dbgchk(ok && n == mf_evt_count(m), "n: %u\n", n);
+
+    e = mf_evt_first(m);
+    dbgchk(e && e->track == 1 && e->status == 0xFF && e->len == 5 &&
+           memcmp(e->data, "ABCDE", 5) == 0, "");
+
+    b.tick = ticks; b.track = track; b.status = status;
+    b.chan = chan;  b.data1 = data1; b.data2 = data2;
+    n = mf_evt_batch(m, 0, 16, &b);
+    ok = (n == mf_evt_count(m));
+    for (e = mf_evt_first(m), n = 0; ok && e; e = mf_evt_next(m), n++)
+      ok = (e->tick == ticks[n] && e->track == track[n] && e->status == status[n] &&
+            e->chan == chan[n] && e->data1 == data1[n] && e->data2 == data2[n]);
+    dbgchk(ok, "n: %u\n", n);
+    mf_seq_save(m);
     mf_seq_close(m);
   }
 
   m = ms_new("zz.mid");
   if (m) {
-    ms_close(m);    
+    ms_save(m);
+    ms_close(m);
   }
+
+  /* Encoding tracks in parallel gives the same file */
+  for (n=1; n<=4; n+=3) {
+    m = mf_seq_new(n == 1 ? "p1.mid" : "p4.mid", 96);
+    mf_seq_set_threads(m, n);
+    for (tick=0; tick < 1000; tick++) {
+      mf_seq_set_track(m, tick % 5);
+      mf_seq_evt(m, tick * 10, mf_st_note_on, tick % 5, 30 + tick % 50, 100);
+      mf_seq_evt(m, tick * 10 + 40, mf_st_note_off, tick % 5, 30 + tick % 50, 0);
+      if (tick % 100 == 0) mf_seq_text(m, tick * 10, "Text");
+    }
+    mf_seq_save(m);
+    if (n == 4) {  /* Rendering in memory gives the same bytes */
+      uint8_t *buf = NULL, small[16], *p = small, trk[2] = {3, 1};
+      uint32_t len = 0, sz = sizeof(small);
+      ok = mf_seq_render(m, NULL, 0, &buf, &len) == 0 && same_mem("p4.mid", buf, len);
+      ok = ok && mf_seq_render(m, NULL, 0, &p, &sz) == 728 && sz == len;
+      free(buf); buf = NULL;
+      ok = ok && mf_seq_render(m, trk, 2, &buf, &sz) == 0 && sz < len && buf[11] == 2;
+      dbgchk(ok, "len: %u sz: %u\n", len, sz);
+      free(buf);
+    }
+    mf_seq_close(m);
+  }
+  dbgchk(same_file("p1.mid", "p4.mid"), "");
+
+  /* Loading a file and closing the sequence gives the same file */
+  for (n=1; n<=3; n+=2) {
+    m = mf_seq_new(n == 1 ? "l1.mid" : "l3.mid", 0);
+    mf_seq_set_threads(m, n);
+    ok = mf_seq_load(m, "p4.mid");
+    dbgchk(ok == 0 && m->division == 96 && mf_evt_count(m) == 2010 &&
+           mf_seq_sorted(m) == MF_SORTED_BYTRACK, "err: %d\n", ok);
+    mf_seq_save(m);
+    mf_seq_close(m);
+  }
+  dbgchk(same_file("p4.mid", "l1.mid") && same_file("p4.mid", "l3.mid"), "");
+
+  /* A note on before a note off at the same tick: not sorted */
+  {
+    mf_writer *mw = mf_new("lo.mid", 96);
+    mf_track_start(mw);
+    mf_note_on(mw, 0, 0, 60, 90);
+    mf_note_on(mw, 96, 0, 62, 90);
+    mf_note_off(mw, 0, 0, 60);
+    mf_note_off(mw, 96, 0, 62);
+    mf_close(mw);
+    m = mf_seq_new(NULL, 0);
+    ok = mf_seq_load(m, "lo.mid");
+    dbgchk(ok == 0 && mf_evt_count(m) == 4 && !mf_seq_sorted(m), "err: %d\n", ok);
+    mf_seq_close(m);
+  }
+
+  /* Note ons with velocity 0 (running status) are loaded as note offs */
+  {
+    mf_writer *mw = mf_new("lv.mid", 96);
+    mf_evt e;
+    mf_notes *mn;
+    mf_set_running(mw, 1);
+    mf_track_start(mw);
+    mf_note_on(mw, 0, 0, 60, 90);
+    mf_note_off(mw, 96, 0, 60);
+    mf_note_on(mw, 0, 0, 62, 90);
+    mf_note_off(mw, 96, 0, 62);
+    mf_close(mw);
+    m = mf_seq_new(NULL, 0);
+    ok = mf_seq_load(m, "lv.mid");
+    ok = ok == 0 && mf_evt_get(m, 1, &e) == 0 && e.status == mf_st_note_off && e.tick == 96;
+    ok = ok && mf_seq_sorted(m) == MF_SORTED_BYTRACK;
+    mn = mf_notes_new(m);
+    ok = ok && mn && mn->note_cnt == 2 && mn->unmatched == 0 && mn->unclosed == 0 &&
+         mn->note[0].dur == 96 && mn->note[1].dur == 96;
+    dbgchk(ok, "");
+    mf_notes_free(mn);
+    mf_seq_close(m);
+  }
+
+  /* A long sysex: no room is left reserved for events that aren't there */
+  {
+    static uint8_t dump[100000];
+    mf_writer *mw = mf_new("lx.mid", 96);
+    dump[sizeof(dump)-1] = 0xF7;
+    mf_track_start(mw);
+    mf_note_on(mw, 0, 0, 60, 90);
+    mf_sys_evt(mw, 0, mf_st_system_exclusive, 0, sizeof(dump), dump);
+    mf_note_off(mw, 96, 0, 60);
+    mf_close(mw);
+    m = mf_seq_new(NULL, 0);
+    ok = mf_seq_load(m, "lx.mid");
+    dbgchk(ok == 0 && mf_evt_count(m) == 3 && m->evt_max < 16 &&
+           m->buf_max - m->buf_cnt < 16, "err: %d evt_max: %u buf: %u/%u\n",
+           ok, m->evt_max, m->buf_cnt, m->buf_max);
+    mf_seq_close(m);
+  }
+
+  /* Pairing notes: overlapping notes with the same pitch are closed FIFO */
+  m = mf_seq_new("nn.mid", 96);
+  if (m) {
+    mf_notes *mn;
+    mf_seq_set_track(m, 1);
+    mf_seq_evt(m, 40, mf_st_note_on,  2, 72, 70);            /* never closed */
+    mf_seq_evt(m, 90, mf_st_control_change, 2, 7, 100);
+    mf_seq_set_track(m, 0);
+    mf_seq_evt(m,  0, mf_st_note_on,  0, 60, 90);
+    mf_seq_evt(m, 10, mf_st_note_on,  0, 60, 80);
+    mf_seq_evt(m,  5, mf_st_note_off, 0, 61, 0);             /* unmatched */
+    mf_seq_evt(m, 20, mf_st_note_off, 0, 60, 33);
+    mf_seq_evt(m, 15, mf_st_note_on,  1, 60, 50);
+    mf_seq_evt(m, 2015, mf_st_note_on, 1, 60, 0);            /* note off */
+    mf_seq_evt(m, 30, mf_st_note_off, 0, 60, 0);
+
+    mn = mf_notes_new(m);
+    ok = mn && mn->note_cnt == 4 && mn->unmatched == 1 && mn->unclosed == 1;
+    ok = ok && mn->note[0].tick ==  0 && mn->note[0].dur == 20 && mn->note[0].vel == 90 && mn->note[0].off_vel == 33;
+    ok = ok && mn->note[1].tick == 10 && mn->note[1].dur == 20 && mn->note[1].vel == 80;
+    ok = ok && mn->note[2].tick == 15 && mn->note[2].dur == 2000 && mn->note[2].chan == 1;
+    ok = ok && mn->note[3].track == 1 && mn->note[3].pitch == 72 && mn->note[3].dur == 50;
+    dbgchk(ok, "");
+    mf_notes_free(mn);
+    mf_seq_close(m);
+  }
+
+  /* Pairing notes: on and off at the same tick (sorted off first) */
+  m = mf_seq_new(NULL, 96);
+  if (m) {
+    mf_notes *mn;
+    mf_seq_evt(m,  0, mf_st_note_on,  9, 36, 100);
+    mf_seq_evt(m,  0, mf_st_note_off, 9, 36, 64);
+    mf_seq_evt(m, 10, mf_st_note_on,  9, 38, 90);
+    mf_seq_evt(m, 10, mf_st_note_on,  9, 38, 0);             /* note off */
+    mf_seq_evt(m, 10, mf_st_note_off, 9, 40, 0);             /* unmatched */
+    mf_seq_evt(m, 20, mf_st_note_on,  9, 42, 80);
+
+    mn = mf_notes_new(m);
+    ok = mn && mn->note_cnt == 3 && mn->unmatched == 1 && mn->unclosed == 1;
+    ok = ok && mn->note[0].tick ==  0 && mn->note[0].dur == 0 && mn->note[0].off_vel == 64;
+    ok = ok && mn->note[1].tick == 10 && mn->note[1].dur == 0 && mn->note[1].pitch == 38;
+    ok = ok && mn->note[2].tick == 20 && mn->note[2].pitch == 42;
+    dbgchk(ok, "");
+    mf_notes_free(mn);
+    mf_seq_close(m);
+  }
+
+  /* Reusing a sequence with a custom allocator: no more allocations after reset */
+  m = mf_seq_new(NULL, 96);
+  if (m) {
+    int k, na;
+    dbgchk(mf_seq_set_alloc(m, cnt_alloc, NULL) == 0, "");
+    dbgchk(mf_seq_reserve(m, 100, 64) == 0 && m->evt_max > 100 && m->buf_max > 64, "");
+    dbgchk(mf_seq_set_alloc(m, NULL, NULL) == 758, "");
+    for (k=0; k<50; k++) mf_seq_note(m, 60+k%12, 24, 90);
+    mf_seq_track_name(m, 0, "Reused");
+    mf_seq_bytick(m);
+    na = n_alloc;
+    mf_seq_reset(m, "nr.mid", 96);
+    ok = mf_evt_count(m) == 0 && m->evt_max > 100 && mf_seq_get_track(m) == 0;
+    for (k=0; k<50; k++) mf_seq_note(m, 60+k%12, 24, 90);
+    mf_seq_track_name(m, 0, "Reused");
+    ok = ok && n_alloc == na && mf_evt_count(m) == 101;
+    dbgchk(ok, "allocs: %d/%d\n", na, n_alloc);
+    dbgchk(mf_seq_close(m) == 0 && n_free == n_alloc, "free: %d/%d\n", n_free, n_alloc);
+  }
+
+  /* Loading in parallel: the allocator is only used for the merged arrays */
+  m = mf_seq_new(NULL, 0);
+  if (m) {
+    int na = n_alloc;
+    mf_seq_set_alloc(m, cnt_alloc, NULL);
+    mf_seq_set_threads(m, 3);
+    ok = mf_seq_load(m, "p4.mid") == 0 && mf_evt_count(m) == 2010;
+    dbgchk(ok && n_alloc - na <= 3, "allocs: %d\n", n_alloc - na);
+    dbgchk(mf_seq_close(m) == 0 && n_free == n_alloc, "free: %d/%d\n", n_free, n_alloc);
+  }
+
+  /* Snapshots: copied or mapped, the sequence renders to the same file */
+  m = mf_seq_new("sn.mid", 96);
+  if (m) {
+    mf_seq *s;
+    mf_evt  e;
+    int k;
+    for (k=0; k<40; k++) mf_seq_note(m, 60+k%12, 24, 90);
+    mf_seq_track_name(m, 0, "Snapshot");
+    mf_seq_set_track(m, 1);
+    mf_seq_sys(m, 10, mf_st_system_exclusive, 0, 5, (uint8_t *)"\x7E\x7F\x09\x01\xF7");
+    mf_seq_bytrack(m);
+    dbgchk(mf_seq_snap_save(m, "sn.snp") == 0, "");
+    mf_seq_save(m);
+
+    s = mf_seq_snap_load("sn.snp", MF_SNAP_VERIFY);
+    dbgchk(s && mf_evt_count(s) == mf_evt_count(m) && !(s->flags & MF_READONLY), "");
+    if (s) {
+      s->fname = "so.mid";
+      mf_seq_save(s);
+      dbgchk(same_file("sn.mid", "so.mid") && mf_seq_note(s, 60, 24, 90) == 0, "");
+      mf_seq_close(s);
+    }
+
+    s = mf_seq_snap_load("sn.snp", MF_SNAP_MAP | MF_SNAP_VERIFY);
+    dbgchk(s && (s->flags & MF_READONLY) && mf_evt_get(s, mf_evt_count(s)-1, &e) == 0 &&
+           e.status == mf_st_system_exclusive && e.len == 5, "");
+    if (s) {
+      s->fname = "so.mid";
+      mf_seq_save(s);
+      dbgchk(same_file("sn.mid", "so.mid"), "");
+      dbgchk(mf_seq_note(s, 60, 24, 90) != 0 && mf_seq_bytick(s) == 818 &&
+             mf_seq_reset(s, NULL, 0) == 708 && mf_evt_count(s) == mf_evt_count(m), "");
+      mf_seq_close(s);
+    }
+
+    /* Mapped and sorted by tick: saved and rendered from a sorted copy */
+    mf_seq_bytick(m);
+    dbgchk(mf_seq_snap_save(m, "sn.snp") == 0, "");
+    s = mf_seq_snap_load("sn.snp", MF_SNAP_MAP);
+    dbgchk(s && (s->flags & MF_READONLY) && (s->flags & MF_SORTED_BYTICK), "");
+    if (s) {
+      uint64_t *evt = s->evt, first = s->evt[0];
+      uint8_t  *out = NULL;
+      uint32_t  len = 0;
+      s->fname = "so.mid";
+      remove("so.mid");
+      dbgchk(mf_seq_save(s) == 0 && same_file("sn.mid", "so.mid"), "");
+      dbgchk(mf_seq_render(s, NULL, 0, &out, &len) == 0 && len > 0, "");
+      dbgchk(s->evt == evt && s->evt[0] == first && (s->flags & MF_SORTED_BYTICK), "");
+      if (out) free(out);
+      mf_seq_close(s);
+    }
+    mf_seq_close(m);
+
+    /* A damaged snapshot is rejected when verified */
+    {
+      FILE *f = fopen("sn.snp", "r+b");
+      if (f) { fseek(f, 60, SEEK_SET); fputc(0x55, f); fclose(f); }
+    }
+    s = mf_seq_snap_load("sn.snp", MF_SNAP_MAP | MF_SNAP_VERIFY);
+    dbgchk(s == NULL, "");
+    remove("sn.snp");
+  }
+
   exit(0);
 }
 
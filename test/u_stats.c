@@ -0,0 +1,108 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Statistics and trace. This test is linked with a copy of the library
+**  compiled with MF_STATS defined.
+*/
+
+#include "umf.h"
+#include "dbg.h"
+
+static int16_t nop_error(mf_reader *mr, int16_t err, char *msg) { return err; }
+static int16_t nop_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division) { return 0; }
+static int16_t nop_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen) { return 0; }
+static int16_t nop_midi_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t chan,
+                                                         int16_t data1, int16_t data2) { return 0; }
+static int16_t nop_sys_evt(mf_reader *mr, uint32_t tick, int16_t type, int16_t aux,
+                                                         int32_t len,  uint8_t *data) { return 0; }
+
+static void set_nop(mf_reader *mr)
+{
+  mr->on_error    = nop_error;
+  mr->on_header   = nop_header;
+  mr->on_track    = nop_track;
+  mr->on_midi_evt = nop_midi_evt;
+  mr->on_sys_evt  = nop_sys_evt;
+}
+
+int main(int argc, char *argv[])
+{
+  mf_seq    *ms;
+  mf_reader *mr;
+  mf_stats   st;
+  uint8_t    sysex[1000];
+  uint32_t   k;
+  long       fsize;
+  FILE      *f;
+  char       line[256];
+  int        ok;
+
+  dbgchk(mf_trace_start("st.json") == 0, "");
+
+  for (k=0; k < sizeof(sysex); k++) sysex[k] = k & 0x7F;
+  sysex[sizeof(sysex)-1] = 0xF7;
+
+  ms = mf_seq_new("st.mid", 96);
+  for (k=0; k < 300; k++) {
+    mf_seq_set_track(ms, k % 3);
+    mf_seq_evt(ms, k * 10, mf_st_note_on, 0, 60, 90);
+    mf_seq_evt(ms, k * 10 + 5, mf_st_control_change, 0, 7, k & 0x7F);
+  }
+  mf_seq_sys(ms, 0, mf_st_system_exclusive, 0, sizeof(sysex), sysex);
+  mf_seq_set_threads(ms, 2);
+  dbgchk(mf_seq_save(ms) == 0, "");
+  st = ms->stats;
+  mf_seq_close(ms);
+
+  dbgchk(st.evt[mf_stat_class(0x90)] == 300 && st.evt[mf_stat_class(0xB0)] == 300 &&
+         st.evt[mf_stat_class(0xF0)] == 1 && st.evt[mf_stat_class(0xFF)] == 0, "");
+  dbgchk(st.sys_bytes == sizeof(sysex) && st.ns_sort > 0 && st.ns_encode > 0, "");
+
+  fsize = 0;
+  if ((f = fopen("st.mid", "rb"))) { fseek(f, 0, SEEK_END); fsize = ftell(f); fclose(f); }
+  dbgchk(fsize > 0 && st.bytes == (uint64_t)fsize, "%lu %ld\n", (unsigned long)st.bytes, fsize);
+
+  /* Reading from a file copies the sysex in chrbuf */
+  mr = mf_reader_new("st.mid");
+  set_nop(mr);
+  dbgchk(mf_scan(mr) == 0, "");
+  st = mr->stats;
+  mf_reader_close(mr);
+  ok = st.evt[mf_stat_class(0x90)] == 300 && st.evt[mf_stat_class(0xB0)] == 300 &&
+       st.evt[mf_stat_class(0xF0)] == 1 && st.bytes == (uint64_t)fsize;
+  ok = ok && st.callbacks == 1 + 3*2 + 601 && st.chrbuf_realloc >= 1 && st.sys_bytes >= sizeof(sysex);
+  ok = ok && st.varlen >= 601 && st.ns_scan > 0;
+  dbgchk(ok, "");
+
+  /* Scanning in parallel gives the same counters (no copies) */
+  mr = mf_reader_map("st.mid");
+  set_nop(mr);
+  dbgchk(mf_scan_mt(mr, 2) == 0, "");
+  st = mr->stats;
+  mf_reader_close(mr);
+  ok = st.evt[mf_stat_class(0x90)] == 300 && st.evt[mf_stat_class(0xB0)] == 300 &&
+       st.evt[mf_stat_class(0xF0)] == 1 && st.bytes == (uint64_t)fsize;
+  ok = ok && st.callbacks == 1 + 3*2 + 601 && st.chrbuf_realloc == 0 && st.sys_bytes == 0;
+  dbgchk(ok, "");
+
+  dbgchk(mf_trace_stop() == 0, "");
+
+  /* The trace is a JSON array of complete events */
+  ok = 0;
+  if ((f = fopen("st.json", "r"))) {
+    ok = (fgetc(f) == '[');
+    k = 0;
+    while (fgets(line, sizeof(line), f)) {
+      if (strstr(line, "\"ph\": \"X\"")) k++;
+      if (strcmp(line, "]\n") == 0) ok = ok && (k > 0) && !fgets(line, sizeof(line), f);
+    }
+    fclose(f);
+  }
+  /* save: 1 sort + 3 tracks, scan: 3 + 3 tracks */
+  dbgchk(ok && k == 10, "events: %u\n", k);
+
+  exit(0);
+}
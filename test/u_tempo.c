@@ -0,0 +1,136 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Tempo map: conversions for PPQ and SMPTE divisions, bulk conversion
+**  and maps built from a sequence and from a file (also for format 2,
+**  where each track has its own tempo).
+*/
+
+#include "umf.h"
+#include "dbg.h"
+
+#define NTICKS 1000
+
+int main(int argc, char *argv[])
+{
+  mf_tempo  *mt, *mf;
+  mf_seq    *ms;
+  mf_writer *mw;
+  FILE      *f;
+  mf_evt     e;
+  uint32_t  ticks[NTICKS];
+  uint64_t  us[NTICKS];
+  uint32_t  k;
+  int ok;
+
+  /* 96 ticks per quarter: 500000us, then 250000us from tick 192 and
+  ** 1000000us from tick 384 (set out of order) */
+  mt = mf_tempo_new(96);
+  mf_tempo_set(mt, 384, 1000000);
+  mf_tempo_set(mt, 192, 250000);
+  dbgchk(mt && mt->seg_cnt == 3, "");
+  dbgchk(mf_tempo_us(mt, 96) == 500000 && mf_tempo_us(mt, 192) == 1000000 &&
+         mf_tempo_us(mt, 288) == 1250000 && mf_tempo_us(mt, 480) == 2500000, "");
+
+  ok = 1;
+  for (k=0; k < 1000; k++) ok = ok && mf_tempo_tick(mt, mf_tempo_us(mt, k)) == k;
+  dbgchk(ok, "k: %u\n", k);
+
+  /* Bulk conversion: ascending ticks and then unordered ones */
+  for (k=0; k < NTICKS; k++) ticks[k] = k < NTICKS/2 ? k * 3 : (k * 7919) % 1500;
+  mf_tempo_us_bulk(mt, ticks, us, NTICKS);
+  ok = 1;
+  for (k=0; k < NTICKS; k++) ok = ok && us[k] == mf_tempo_us(mt, ticks[k]);
+  dbgchk(ok, "k: %u\n", k);
+  mf_tempo_free(mt);
+
+  /* SMPTE: 25 fps, 40 ticks per frame gives 1ms per tick */
+  dbgchk(mf_smpte(25,40) == (int16_t)0xE728 && mf_smpte_fps(0xE728) == 25 &&
+         mf_smpte_tpf(0xE728) == 40 && mf_div_quarter(0xE728) == 500, "");
+  mt = mf_tempo_new(mf_smpte(25,40));
+  mf_tempo_set(mt, 100, 250000);
+  dbgchk(mt && mf_tempo_us(mt, 1234) == 1234000 && mf_tempo_tick(mt, 1234000) == 1234, "");
+  mf_tempo_free(mt);
+
+  /* 29.97 fps */
+  mt = mf_tempo_new((int16_t)0xE302);
+  dbgchk(mt && mf_tempo_us(mt, 60) == 1001000, "");
+  mf_tempo_free(mt);
+
+  /* From a sequence and from the file it is saved to */
+  ms = mf_seq_new("tm.mid", 480);
+  mf_seq_set_track(ms, 1);
+  mf_seq_evt(ms, 0, mf_st_note_on, 0, 60, 90);
+  mf_seq_evt(ms, 2000, mf_st_note_off, 0, 60, 0);
+  mf_seq_set_track(ms, 0);
+  mf_seq_set_tempo(ms, 960, 400000);
+  mf_seq_set_tempo(ms, 0, 600000);
+  mt = mf_tempo_seq(ms);
+  mf_seq_save(ms);
+  mf_seq_close(ms);
+  mf = mf_tempo_file("tm.mid");
+  dbgchk(mt && mf && mt->seg_cnt == 2 && mf->seg_cnt == 2 &&
+         mf_tempo_us(mt, 2000) == 1200000 + 1040 * 400000 / 480 &&
+         mf_tempo_us(mf, 2000) == mf_tempo_us(mt, 2000), "");
+  mf_tempo_free(mt);
+  mf_tempo_free(mf);
+
+  /* Format 2 with a SMPTE division: both survive a save and a load */
+  ms = mf_seq_new("t2.mid", mf_smpte(30,4));
+  dbgchk(mf_quarter_n(ms) == 60, "quarter: %d\n", mf_quarter_n(ms));
+  mf_seq_set_format(ms, 2);
+  mf_seq_set_track(ms, 0);
+  mf_seq_note(ms, 60, MF_NOVAL, MF_NOVAL);
+  mf_seq_set_track(ms, 1);
+  mf_seq_note(ms, 64, MF_NOVAL, MF_NOVAL);
+  dbgchk(mf_seq_save(ms) == 0, "");
+  mf_seq_close(ms);
+  ms = mf_seq_new(NULL, 0);
+  dbgchk(mf_seq_load(ms, "t2.mid") == 0 && ms->format == 2 && ms->division == mf_smpte(30,4) &&
+         mf_evt_count(ms) == 4 && mf_evt_get(ms, 1, &e) == 0 && e.tick == 60,
+         "format: %d division: %d\n", ms->format, ms->division);
+  mf_seq_close(ms);
+
+  /* Format 2: each pattern has its own tempo */
+  ms = mf_seq_new("t2.mid", 480);
+  mf_seq_set_format(ms, 2);
+  mf_seq_set_track(ms, 0);
+  mf_seq_set_tempo(ms, 0, 600000);
+  mf_seq_set_track(ms, 1);
+  mf_seq_set_tempo(ms, 0, 250000);
+  mt = mf_tempo_seq(ms);
+  mf = mf_tempo_track(ms, 1);
+  mf_seq_save(ms);
+  mf_seq_close(ms);
+  dbgchk(mt && mf && mf_tempo_us(mt, 480) == 600000 && mf_tempo_us(mf, 480) == 250000, "");
+  mf_tempo_free(mt);
+  mf_tempo_free(mf);
+  mf = mf_tempo_file("t2.mid");
+  dbgchk(mf && mf_tempo_us(mf, 480) == 600000, "");
+  mf_tempo_free(mf);
+
+  /* Format 0 files have a single track */
+  mw = mf_new("t2.mid", 96);
+  dbgchk(mf_set_format(mw, 0) == 0 && mf_track_start(mw) == 0 && mf_track_start(mw) == 302, "");
+  mf_close(mw);
+  ms = mf_seq_new("t2.mid", 480);
+  mf_seq_set_format(ms, 0);
+  mf_seq_set_track(ms, 1);
+  mf_seq_note(ms, 64, 0, 0);
+  dbgchk(mf_seq_save(ms) == 0, "");
+  mf_seq_set_track(ms, 2);
+  mf_seq_note(ms, 64, 0, 0);
+  /* Nothing is written if the tracks don't fit the format */
+  remove("t3.mid");
+  ms->fname = "t3.mid";
+  dbgchk(mf_seq_save(ms) == 723, "");
+  f = fopen("t3.mid", "rb");
+  dbgchk(f == NULL, "");
+  if (f) fclose(f);
+  mf_seq_close(ms);
+
+  exit(0);
+}
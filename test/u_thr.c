@@ -0,0 +1,168 @@
+/* 
+**  (C) by Remo Dentato (rdentato@gmail.com)
+** 
+** This software is distributed under the terms of the MIT license:
+**  https://opensource.org/licenses/MIT
+**
+**  Scans N files concurrently (one thread per file) and checks that
+**  each of them gives the same result of a serial scan.
+**  Then scans each file with its tracks decoded in parallel.
+*/
+
+#include <pthread.h>
+#include "umf.h"
+#include "dbg.h"
+
+#define NFILES 8
+
+#define MAXTRK 4
+
+typedef struct {
+  char     fname[16];
+  uint32_t n_evt;
+  uint32_t chksum;
+  uint32_t trksum[MAXTRK];
+  int16_t  ret;
+  int16_t  mt;   /* tracks scanned in parallel: only trksum[] is safe */
+} scan_res;
+
+static void add_sum(scan_res *r, int16_t track, uint32_t x)
+{
+  if (!r->mt) r->chksum = r->chksum * 31 + x;
+  r->trksum[track % MAXTRK] = r->trksum[track % MAXTRK] * 31 + x;
+}
+
+#define sum(r,x) add_sum(r, mr->track, (uint32_t)(x))
+
+static int16_t my_error(mf_reader *mr, int16_t err, char *msg)
+{ sum((scan_res *)mr->aux, err); return err; }
+
+static int16_t my_header(mf_reader *mr, int16_t type, int16_t ntracks, int16_t division)
+{ scan_res *r = mr->aux; sum(r,type); sum(r,ntracks); sum(r,division); return 0; }
+
+static int16_t my_track(mf_reader *mr, int16_t eot, int16_t tracknum, uint32_t tracklen)
+{ scan_res *r = mr->aux; sum(r,eot); sum(r,tracknum); sum(r,tracklen); return 0; }
+
+static int16_t my_midi_evt(mf_reader *mr, uint32_t delta, int16_t type, int16_t chan,
+                                                           int16_t data1, int16_t data2)
+{
+  scan_res *r = mr->aux;
+  if (!r->mt) r->n_evt++;
+  sum(r,delta); sum(r,type); sum(r,chan); sum(r,data1); sum(r,data2);
+  return 0;
+}
+
+static int16_t my_sys_evt(mf_reader *mr, uint32_t delta, int16_t type, int16_t aux,
+                                                           int32_t len,  uint8_t *data)
+{
+  scan_res *r = mr->aux;
+  if (!r->mt) r->n_evt++;
+  sum(r,delta); sum(r,type); sum(r,aux); sum(r,len);
+  while (len-- > 0) sum(r,*data++);
+  return 0;
+}
+
+static void *scan_mt(void *arg, int16_t nthreads)
+{
+  scan_res  *r = arg;
+  mf_reader *mr;
+  int k;
+
+  r->n_evt = 0; r->chksum = 0; r->ret = -1; r->mt = (nthreads > 0);
+  for (k=0; k<MAXTRK; k++) r->trksum[k] = 0;
+  mr = nthreads > 0 ? mf_reader_map(r->fname) : mf_reader_new(r->fname);
+  if (mr) {
+    mr->aux         = r;
+    mr->on_error    = my_error;
+    mr->on_header   = my_header;
+    mr->on_track    = my_track;
+    mr->on_midi_evt = my_midi_evt;
+    mr->on_sys_evt  = my_sys_evt;
+    r->ret = nthreads > 0 ? mf_scan_mt(mr, nthreads) : mf_scan(mr);
+    mf_reader_close(mr);
+  }
+  return NULL;
+}
+
+static void *scan(void *arg)
+{
+  return scan_mt(arg, 0);
+}
+
+static void write_file(char *fname, int n)
+{
+  mf_writer *mw;
+  int k, t;
+
+  mw = mf_new(fname, 96 + n);
+  if (!mw) return;
+  for (t=0; t <= n % 3; t++) {
+    mf_track_start(mw);
+    mf_text(mw, 0, fname);
+    for (k=0; k < 2000 + 100 * n; k++) {
+      mf_note_on(mw, k % 7, (n+t) & 0x0F, 30 + (k * n) % 60, 1 + k % 127);
+      mf_control_change(mw, 1, (n+t) & 0x0F, mf_cc_pan, k & 0x7F);
+      if ((k % 500) == 0) mf_sys_evt(mw, 0, mf_st_system_exclusive, 0, 3, (uint8_t *)"\x01\x02\xF7");
+    }
+  }
+  mf_close(mw);
+}
+
+int main(int argc, char *argv[])
+{
+  scan_res  serial[NFILES];
+  scan_res  parallel[NFILES];
+  pthread_t thr[NFILES];
+  int       started[NFILES];
+  int k, t, ok;
+
+  for (k=0; k<NFILES; k++) {
+    sprintf(serial[k].fname, "t%d.mid", k);
+    strcpy(parallel[k].fname, serial[k].fname);
+    write_file(serial[k].fname, k);
+    scan(&serial[k]);
+  }
+
+  for (k=0; k<NFILES; k++) {
+    started[k] = (pthread_create(&thr[k], NULL, scan, &parallel[k]) == 0);
+    if (!started[k]) scan(&parallel[k]);
+  }
+
+  for (k=0; k<NFILES; k++)
+    if (started[k]) pthread_join(thr[k], NULL);
+
+  for (k=0; k<NFILES; k++) {
+    ok = (serial[k].ret == 0) && (parallel[k].ret == 0) &&
+         (serial[k].n_evt  == parallel[k].n_evt) &&
+         (serial[k].chksum == parallel[k].chksum);
+    dbgchk(ok, "%s: %u/%u events %08X/%08X\n", serial[k].fname,
+                 serial[k].n_evt, parallel[k].n_evt, serial[k].chksum, parallel[k].chksum);
+  }
+
+  /* Tracks decoded in parallel */
+  for (k=0; k<NFILES; k++) {
+    scan_mt(&parallel[k], 3);
+    ok = (parallel[k].ret == 0);
+    for (t=0; t<MAXTRK; t++)
+      ok = ok && (serial[k].trksum[t] == parallel[k].trksum[t]);
+    dbgchk(ok, "%s\n", serial[k].fname);
+    remove(serial[k].fname);
+  }
+
+  /* A file with no tracks */
+  {
+    static uint8_t empty[] = "MThd\0\0\0\6\0\1\0\0\0\x60";
+    mf_reader *mr = mf_reader_mem(empty, 14);
+    int16_t    ret = -1;
+
+    if (mr) {
+      mr->aux = &parallel[0];
+      mr->on_header = my_header;
+      ret = mf_scan_mt(mr, 3);
+      mf_reader_close(mr);
+    }
+    dbgchk(ret == 0, "ret: %d\n", ret);
+  }
+
+  exit(0);
+}
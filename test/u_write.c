@@ -1,13 +1,28 @@
 
 #include "umf.h"
+#include "dbg.h"
 
+typedef struct {
+  uint8_t  data[1024];
+  uint32_t len;
+  int16_t  calls;
+} membuf;
 
-int main(int argc, char *argv[])
+static int16_t to_mem(void *aux, uint8_t *data, uint32_t len)
+{
+  membuf *mb = aux;
+  if (mb->len + len > sizeof(mb->data)) return 1;
+  memcpy(mb->data + mb->len, data, len);
+  mb->len += len;
+  mb->calls++;
+  return 0;
+}
+
+static int16_t write_song(mf_writer *m)
 {
-   mf_writer *m;
    int16_t ret = 999;
 
-   if ((m = mf_new("xx.mid",192))) {  ret = 0; }
+   if (m)     {ret = 0; }
 
    if (!ret)  {ret = mf_track_start(m);}
    if (!ret)  {ret = mf_text(m, 0, "First");}
@@ -26,7 +41,59 @@ int main(int argc, char *argv[])
 
    if (!ret)  {ret = mf_close(m);}
 
-   if (ret)   { fprintf(stderr, "ERROR: %d\n",ret); }
    return ret;
 }
 
+int main(int argc, char *argv[])
+{
+   mf_writer *m;
+   int16_t ret;
+   membuf mb1, mb2;
+   FILE *f;
+   uint8_t data[1024];
+   uint32_t len = 0;
+
+   ret = write_song(mf_new("xx.mid",192));
+   if (ret)   { fprintf(stderr, "ERROR: %d\n",ret); }
+
+   f = fopen("xx.mid","rb");
+   if (f) { len = fread(data, 1, sizeof(data), f); fclose(f); }
+
+   /* All in memory until the end */
+   mb1.len = 0; mb1.calls = 0;
+   m = mf_new_sink(to_mem, &mb1, 192);
+   ret = write_song(m);
+   dbgchk(!ret && mb1.calls == 1 && mb1.len == len && memcmp(mb1.data, data, len) == 0, "ret: %d\n", ret);
+
+   /* One write per track */
+   mb2.len = 0; mb2.calls = 0;
+   m = mf_new_sink(to_mem, &mb2, 192);
+   mf_set_ntracks(m, 2);
+   ret = write_song(m);
+   dbgchk(!ret && mb2.calls == 2 && mb2.len == len && memcmp(mb2.data, data, len) == 0, "ret: %d\n", ret);
+
+   /* Running status makes it shorter */
+   mb1.len = 0; mb1.calls = 0;
+   m = mf_new_sink(to_mem, &mb1, 192);
+   mf_set_running(m, 1);
+   ret = write_song(m);
+   dbgchk(!ret && mb1.len == len - 4, "ret: %d len: %u/%u\n", ret, mb1.len, len);
+
+   /* A meta event cancels running status; a note off becomes a note on
+   ** with velocity 0 so that it can use the running status */
+   mb1.len = 0; mb1.calls = 0;
+   m = mf_new_sink(to_mem, &mb1, 192);
+   mf_set_running(m, 1);
+   ret = mf_track_start(m);
+   if (!ret) ret = mf_midi_evt(m, 0, mf_st_note_on, 0, 64, 100);
+   if (!ret) ret = mf_text(m, 0, "x");
+   if (!ret) ret = mf_midi_evt(m, 0, mf_st_note_on, 0, 65, 100);
+   if (!ret) ret = mf_midi_evt(m, 10, mf_st_note_off, 0, 65, 0);
+   if (!ret) ret = mf_close(m);
+   dbgchk(!ret && mb1.len == 22 + 16 + 4 &&
+          memcmp(mb1.data + 22, "\x00\x90\x40\x64" "\x00\xFF\x01\x01x"
+                                "\x00\x90\x41\x64" "\x0A\x41\x00", 16) == 0,
+          "ret: %d len: %u\n", ret, mb1.len);
+
+   return ret;
+}